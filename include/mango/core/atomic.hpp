@@ -1,10 +1,11 @@
 /*
     MANGO Multimedia Development Platform
-    Copyright (C) 2012-2017 Twilight Finland 3D Oy Ltd. All rights reserved.
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #pragma once
 
 #include <atomic>
+#include <climits>
 #include "configure.hpp"
 
 namespace mango
@@ -13,9 +14,53 @@ namespace mango
     /* WARNING!
        Atomic locks are implemented as busy loops which consume significant
        amounts of CPU time if the locks are congested and held for a long
-       period of time.
+       period of time. AdaptiveLock, ReadWriteLock and TicketReadWriteLock
+       spin only for a short while and then put the thread to sleep.
     */
 
+    namespace detail
+    {
+
+        // block while *address == expected; can return spuriously
+        void parkWait(std::atomic<u32>* address, u32 expected);
+
+        // wake up to count threads blocked on the address
+        void parkWake(std::atomic<u32>* address, int count);
+
+        static inline void pause()
+        {
+#if defined(MANGO_CPU_INTEL)
+            _mm_pause();
+#elif defined(MANGO_CPU_ARM) && !defined(MANGO_COMPILER_MICROSOFT)
+            __asm__ __volatile__("yield");
+#endif
+        }
+
+        // exponential backoff for the spinning phase of the parking locks
+        class Backoff
+        {
+        protected:
+            int m_count { 1 };
+
+        public:
+            // returns false when it is time to park the thread
+            bool spin()
+            {
+                if (m_count > 64)
+                    return false;
+
+                for (int i = 0; i < m_count; ++i)
+                {
+                    pause();
+                }
+
+                m_count *= 2;
+                return true;
+            }
+        };
+
+    } // namespace detail
+
     // ----------------------------------------------------------------------------
     // SpinLock
     // ----------------------------------------------------------------------------
@@ -28,7 +73,7 @@ namespace mango
     public:
         bool tryLock()
         {
-            return m_locked.test_and_set(std::memory_order_acquire);
+            return !m_locked.test_and_set(std::memory_order_acquire);
         }
 
         void lock()
@@ -213,4 +258,289 @@ namespace mango
         }
     };
 
+    // ----------------------------------------------------------------------------
+    // AdaptiveLock
+    // ----------------------------------------------------------------------------
+
+    /*
+        AdaptiveLock spins with exponential backoff for a short while and then parks
+        the thread (futex on Linux). Uncontended lock and unlock are a single atomic
+        operation each, like with the SpinLock, but a congested lock does not burn
+        the CPU time of the threads waiting for it.
+    */
+
+    class AdaptiveLock
+    {
+    private:
+        // 0: unlocked, 1: locked, 2: locked and there might be parked threads
+        std::atomic<u32> m_state { 0 };
+
+        void lockSlow();
+
+    public:
+        bool tryLock()
+        {
+            u32 expected = 0;
+            return m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire);
+        }
+
+        void lock()
+        {
+            if (!tryLock()) {
+                lockSlow();
+            }
+        }
+
+        void unlock()
+        {
+            if (m_state.exchange(0, std::memory_order_release) == 2) {
+                detail::parkWake(&m_state, 1);
+            }
+        }
+    };
+
+    class AdaptiveLockGuard
+    {
+    private:
+        AdaptiveLock& m_lock;
+        bool m_locked { false };
+
+    public:
+        AdaptiveLockGuard(AdaptiveLock& adaptivelock)
+            : m_lock(adaptivelock)
+        {
+            lock();
+        }
+
+        ~AdaptiveLockGuard()
+        {
+            unlock();
+        }
+
+        void lock()
+        {
+            if (!m_locked) {
+                m_locked = true;
+                m_lock.lock();
+            }
+        }
+
+        void unlock()
+        {
+            if (m_locked) {
+                m_locked = false;
+                m_lock.unlock();
+            }
+        }
+    };
+
+    // ----------------------------------------------------------------------------
+    // ReadWriteLock
+    // ----------------------------------------------------------------------------
+
+    /*
+        ReadWriteLock is a reader-preferring lock which parks the waiting threads.
+        Readers get in whenever there is no writer holding the lock, so a steady
+        stream of readers can keep writers waiting; use TicketReadWriteLock when
+        the writers must make progress.
+    */
+
+    class ReadWriteLock
+    {
+    private:
+        static constexpr u32 WRITER = 1;
+        static constexpr u32 PARKED = 2;
+        static constexpr u32 READER = 4;
+
+        // reader count in the high bits
+        std::atomic<u32> m_state { 0 };
+
+        void readLockSlow();
+        void writeLockSlow();
+
+    public:
+        bool tryWriteLock()
+        {
+            u32 state = m_state.load(std::memory_order_relaxed);
+            return !(state & ~PARKED) &&
+                m_state.compare_exchange_strong(state, state | WRITER, std::memory_order_acquire);
+        }
+
+        void writeLock()
+        {
+            if (!tryWriteLock()) {
+                writeLockSlow();
+            }
+        }
+
+        void writeUnlock()
+        {
+            if (m_state.exchange(0, std::memory_order_release) & PARKED) {
+                detail::parkWake(&m_state, INT_MAX);
+            }
+        }
+
+        bool tryReadLock()
+        {
+            u32 state = m_state.load(std::memory_order_relaxed);
+            return !(state & WRITER) &&
+                m_state.compare_exchange_strong(state, state + READER, std::memory_order_acquire);
+        }
+
+        void readLock()
+        {
+            if (!tryReadLock()) {
+                readLockSlow();
+            }
+        }
+
+        void readUnlock()
+        {
+            u32 state = m_state.fetch_sub(READER, std::memory_order_release) - READER;
+            if (state == PARKED) {
+                // the last reader is out and a writer is waiting
+                if (m_state.compare_exchange_strong(state, 0, std::memory_order_relaxed)) {
+                    detail::parkWake(&m_state, INT_MAX);
+                }
+            }
+        }
+    };
+
+    // ----------------------------------------------------------------------------
+    // TicketReadWriteLock
+    // ----------------------------------------------------------------------------
+
+    /*
+        TicketReadWriteLock serves the readers and the writers in the order they
+        arrive. Consecutive readers share the lock; a writer waits for the readers
+        ahead of it and the readers behind it wait for the writer. The waiting
+        threads are parked after a short spin. The strict ordering has a price:
+        when there are more threads than processors every hand-over needs a
+        context switch, so prefer ReadWriteLock unless writer starvation is a
+        real problem.
+    */
+
+    class TicketReadWriteLock
+    {
+    private:
+        std::atomic<u32> m_ticket { 0 };
+        std::atomic<u32> m_read { 0 };   // next ticket allowed to read
+        std::atomic<u32> m_write { 0 };  // next ticket allowed to write
+        std::atomic<u32> m_parked { 0 };
+
+        void waitSlow(std::atomic<u32>& serving, u32 ticket);
+
+        void wait(std::atomic<u32>& serving, u32 ticket)
+        {
+            if (serving.load(std::memory_order_acquire) != ticket) {
+                waitSlow(serving, ticket);
+            }
+        }
+
+        void advance(std::atomic<u32>& serving)
+        {
+            serving.fetch_add(1, std::memory_order_seq_cst);
+            if (m_parked.load(std::memory_order_seq_cst)) {
+                detail::parkWake(&serving, INT_MAX);
+            }
+        }
+
+    public:
+        void writeLock()
+        {
+            wait(m_write, m_ticket.fetch_add(1, std::memory_order_relaxed));
+        }
+
+        void writeUnlock()
+        {
+            advance(m_read);
+            advance(m_write);
+        }
+
+        void readLock()
+        {
+            wait(m_read, m_ticket.fetch_add(1, std::memory_order_relaxed));
+
+            // let the next reader in
+            advance(m_read);
+        }
+
+        void readUnlock()
+        {
+            advance(m_write);
+        }
+    };
+
+    template <typename Lock>
+    class WriteLockGuard
+    {
+    private:
+        Lock& m_rwlock;
+        bool m_locked { false };
+
+    public:
+        WriteLockGuard(Lock& rwlock)
+            : m_rwlock(rwlock)
+        {
+            lock();
+        }
+
+        ~WriteLockGuard()
+        {
+            unlock();
+        }
+
+        void lock()
+        {
+            if (!m_locked) {
+                m_locked = true;
+                m_rwlock.writeLock();
+            }
+        }
+
+        void unlock()
+        {
+            if (m_locked) {
+                m_locked = false;
+                m_rwlock.writeUnlock();
+            }
+        }
+    };
+
+    template <typename Lock>
+    class ReadLockGuard
+    {
+    private:
+        Lock& m_rwlock;
+        bool m_locked { false };
+
+    public:
+        ReadLockGuard(Lock& rwlock)
+            : m_rwlock(rwlock)
+        {
+            lock();
+        }
+
+        ~ReadLockGuard()
+        {
+            unlock();
+        }
+
+        void lock()
+        {
+            if (!m_locked) {
+                m_locked = true;
+                m_rwlock.readLock();
+            }
+        }
+
+        void unlock()
+        {
+            if (m_locked) {
+                m_locked = false;
+                m_rwlock.readUnlock();
+            }
+        }
+    };
+
 } // namespace mango
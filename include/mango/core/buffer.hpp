@@ -5,6 +5,7 @@
 #pragma once
 
 #include <cstddef>
+#include <vector>
 #include "configure.hpp"
 #include "memory.hpp"
 #include "stream.hpp"
@@ -12,6 +13,12 @@
 namespace mango
 {
 
+    /*
+        Buffer is a growable memory stream. The capacity grows geometrically when writing
+        so appending is amortized O(1); large buffers are mapped with large_malloc() and
+        grow without copying where the platform can remap the pages.
+    */
+
     class Buffer : public Stream
     {
     private:
@@ -19,6 +26,8 @@ namespace mango
         size_t m_capacity;
         size_t m_offset;
 
+        void grow(size_t required);
+
     public:
         Buffer();
         Buffer(size_t bytes);
@@ -35,6 +44,53 @@ namespace mango
         operator Memory () const;
 		operator u8* () const;
 
+        // stream
+        u64 size() const;
+        u64 offset() const;
+        void seek(u64 distance, SeekMode mode);
+        void read(void* dest, size_t bytes);
+        void write(const void* data, size_t bytes);
+        void writev(const Memory* segments, size_t count);
+        u8* acquire(size_t bytes);
+        void commit(size_t bytes);
+    };
+
+    /*
+        BufferChain collects the output as a list of segments instead of one contiguous
+        block. Written data is copied into chunks; append() adds memory by reference so
+        large blocks, for example the compressed rows of an encoder, are not copied at
+        all. The segments are written to a stream with a single gather write.
+        The chain can only be appended to; seeking and reading are not supported.
+    */
+
+    class BufferChain : public Stream
+    {
+    private:
+        struct Chunk
+        {
+            u8* address;
+            size_t size;
+        };
+
+        std::vector<Memory> m_segments;
+        std::vector<Chunk> m_chunks;
+        size_t m_chunk_size;
+        size_t m_chunk_offset { 0 };
+        u64 m_size { 0 };
+
+    public:
+        BufferChain(size_t chunk_size = 64 * 1024);
+        ~BufferChain();
+
+        // add a segment by reference; the memory must stay valid while the chain is used
+        void append(Memory memory);
+
+        const Memory* segments() const;
+        size_t count() const;
+
+        // write all segments into the stream
+        void writeTo(Stream& stream) const;
+
         // stream
         u64 size() const;
         u64 offset() const;
@@ -4,6 +4,7 @@
 */
 #pragma once
 
+#include <vector>
 #include "configure.hpp"
 
 namespace mango
@@ -62,4 +63,29 @@ namespace mango
 
 	u64 getCPUFlags();
 
+	// ----------------------------------------------------------------------------
+	// getCPUTopology()
+	// ----------------------------------------------------------------------------
+
+    struct CPUTopology
+    {
+        struct Node
+        {
+            int index;              // NUMA node number used by the operating system
+            std::vector<int> cpus;  // logical processors in the node
+        };
+
+        // NUMA nodes with at least one processor; systems without NUMA have one node
+        std::vector<Node> nodes;
+
+        // node index for a logical processor, -1 when the processor is unknown
+        int getNode(int cpu) const;
+    };
+
+    const CPUTopology& getCPUTopology();
+
+    // NUMA node of the physical memory backing the address, -1 when not known
+    // (not supported or the page has not been touched yet)
+    int getMemoryNode(const void* address);
+
 } // namespace mango
@@ -5,10 +5,14 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <limits>
 #include <algorithm>
+#include <vector>
+#include <atomic>
 #include "configure.hpp"
 #include "object.hpp"
+#include "atomic.hpp"
 
 namespace mango
 {
@@ -74,6 +78,258 @@ namespace mango
     void* aligned_malloc(size_t size, size_t alignment = MANGO_DEFAULT_ALIGNMENT);
     void aligned_free(void* aligned);
 
+    // -----------------------------------------------------------------------
+    // large malloc/free
+    // -----------------------------------------------------------------------
+
+    // Allocations of 2 MB and more are mapped directly from the operating system and
+    // backed with huge pages where the platform supports it, which reduces TLB misses
+    // when large images and buffers are processed. Smaller allocations are forwarded
+    // to aligned_malloc(). The size given to large_free() must be the allocated size.
+    // large_realloc() moves the pages of a large allocation without copying on Linux;
+    // when it fails, it returns nullptr and the old allocation is left untouched.
+
+    void* large_malloc(size_t size);
+    void* large_realloc(void* address, size_t size, size_t new_size);
+    void large_free(void* address, size_t size);
+
+    // -----------------------------------------------------------------------
+    // memory tracking
+    // -----------------------------------------------------------------------
+
+    /*
+        MemoryTag counts the live bytes, the peak and the number of allocations for one
+        kind of memory, for example "png.inflate" or "zip.decompress". The tags are
+        declared as static objects where the memory is allocated and the counters can
+        be queried at runtime with get_memory_statistics(). Tags with the same name
+        share the counters. The counting is compiled in only when the library is built
+        with MANGO_ENABLE_MEMORY_TRACKING; otherwise the tags do nothing and the
+        statistics are empty.
+    */
+
+    struct MemoryStatistics
+    {
+        std::string tag;
+        size_t current;     // live bytes
+        size_t peak;        // highest number of live bytes
+        u64 allocations;    // number of allocations
+        u64 deallocations;  // number of deallocations
+    };
+
+    namespace detail
+    {
+        struct MemoryCounter;
+    }
+
+    class MemoryTag : private NonCopyable
+    {
+    protected:
+        const char* m_name;
+
+#ifdef MANGO_ENABLE_MEMORY_TRACKING
+        std::atomic<detail::MemoryCounter*> m_counter { nullptr };
+
+        detail::MemoryCounter* getCounter();
+#endif
+
+    public:
+        // the name must be a string literal
+        constexpr MemoryTag(const char* name)
+            : m_name(name)
+        {
+        }
+
+#ifdef MANGO_ENABLE_MEMORY_TRACKING
+        void allocate(size_t size);
+        void deallocate(size_t size);
+#else
+        void allocate(size_t size)
+        {
+            MANGO_UNREFERENCED_PARAMETER(size);
+        }
+
+        void deallocate(size_t size)
+        {
+            MANGO_UNREFERENCED_PARAMETER(size);
+        }
+#endif
+    };
+
+    // all tags which have been used, sorted by name
+    std::vector<MemoryStatistics> get_memory_statistics();
+
+    // the peak of every tag is set to the current number of live bytes
+    void reset_memory_peaks();
+
+    // -----------------------------------------------------------------------
+    // Allocator
+    // -----------------------------------------------------------------------
+
+    /*
+        Allocator is the interface for temporary buffers which are allocated and released
+        repeatedly, for example the working memory of the image decoders. The size given
+        to deallocate() must be the size which was allocated.
+    */
+
+    class Allocator
+    {
+    public:
+        virtual ~Allocator() = default;
+
+        virtual void* allocate(size_t size, size_t alignment = MANGO_DEFAULT_ALIGNMENT) = 0;
+        virtual void deallocate(void* address, size_t size) = 0;
+
+        template <typename T>
+        T* allocate(size_t count)
+        {
+            return reinterpret_cast<T*>(allocate(count * sizeof(T), std::max(alignof(T), size_t(MANGO_DEFAULT_ALIGNMENT))));
+        }
+
+        template <typename T>
+        void deallocate(T* address, size_t count)
+        {
+            deallocate(reinterpret_cast<void*>(address), count * sizeof(T));
+        }
+
+        // aligned_malloc() and aligned_free()
+        static Allocator& getDefault();
+    };
+
+    // -----------------------------------------------------------------------
+    // ArenaAllocator
+    // -----------------------------------------------------------------------
+
+    /*
+        ArenaAllocator is a bump allocator: allocate() advances a pointer in the current
+        chunk and deallocate() does nothing. The memory is released in one go by returning
+        to a marker, either directly or with a Scope, and the chunks are kept for reuse.
+        The arena is not thread-safe.
+    */
+
+    class ArenaAllocator : public Allocator, private NonCopyable
+    {
+    protected:
+        struct Chunk
+        {
+            u8* memory;
+            size_t size;
+        };
+
+        std::vector<Chunk> m_chunks;
+        size_t m_chunk { 0 };
+        size_t m_offset { 0 };
+        size_t m_chunk_size;
+
+    public:
+        struct Marker
+        {
+            size_t chunk;
+            size_t offset;
+        };
+
+        class Scope : private NonCopyable
+        {
+        protected:
+            ArenaAllocator& m_arena;
+            Marker m_marker;
+
+        public:
+            Scope(ArenaAllocator& arena)
+                : m_arena(arena)
+                , m_marker(arena.mark())
+            {
+            }
+
+            ~Scope()
+            {
+                m_arena.release(m_marker);
+            }
+        };
+
+        ArenaAllocator(size_t chunk_size = 64 * 1024);
+        ~ArenaAllocator();
+
+        using Allocator::allocate;
+        using Allocator::deallocate;
+
+        void* allocate(size_t size, size_t alignment = MANGO_DEFAULT_ALIGNMENT) override;
+        void deallocate(void* address, size_t size) override;
+
+        Marker mark() const
+        {
+            return { m_chunk, m_offset };
+        }
+
+        // release everything allocated after the marker
+        void release(const Marker& marker)
+        {
+            m_chunk = marker.chunk;
+            m_offset = marker.offset;
+        }
+
+        // release everything
+        void reset()
+        {
+            m_chunk = 0;
+            m_offset = 0;
+        }
+    };
+
+    // -----------------------------------------------------------------------
+    // PoolAllocator
+    // -----------------------------------------------------------------------
+
+    /*
+        PoolAllocator keeps the released blocks in power-of-two size classes from 64 bytes
+        to 16 MB so that buffers of similar size are recycled instead of going to the heap
+        each time. The cached memory is limited by the capacity; the blocks which do not
+        fit are freed. Larger allocations bypass the pool. Blocks are aligned to
+        MANGO_DEFAULT_ALIGNMENT and larger alignments are not supported. The allocator
+        is thread-safe.
+    */
+
+    class PoolAllocator : public Allocator, private NonCopyable
+    {
+    protected:
+        static constexpr int MinClassBits = 6;
+        static constexpr int MaxClassBits = 24;
+        static constexpr int ClassCount = MaxClassBits - MinClassBits + 1;
+
+        struct Block
+        {
+            Block* next;
+        };
+
+        struct SizeClass
+        {
+            AdaptiveLock lock;
+            Block* head { nullptr };
+        };
+
+        SizeClass m_classes[ClassCount];
+        std::atomic<size_t> m_cached { 0 };
+        size_t m_capacity;
+
+        static int getSizeClass(size_t size);
+
+    public:
+        PoolAllocator(size_t capacity = 64 * 1024 * 1024);
+        ~PoolAllocator();
+
+        using Allocator::allocate;
+        using Allocator::deallocate;
+
+        void* allocate(size_t size, size_t alignment = MANGO_DEFAULT_ALIGNMENT) override;
+        void deallocate(void* address, size_t size) override;
+
+        // free the cached blocks
+        void trim();
+
+        // shared pool for the services which opt in, for example with
+        // ImageDecoder::setAllocator()
+        static PoolAllocator& getInstance();
+    };
+
     // -----------------------------------------------------------------------
     // aligned memory allocator
     // -----------------------------------------------------------------------
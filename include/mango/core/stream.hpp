@@ -42,6 +42,31 @@ namespace mango
         {
             write(memory.address, memory.size);
         }
+
+        // gather write; streams which can write the segments in one go override this
+        virtual void writev(const Memory* segments, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                write(segments[i].address, segments[i].size);
+            }
+        }
+
+        // zero-copy write; acquire() returns size bytes of the stream's own memory at the
+        // current offset and commit() advances the offset over the bytes written there.
+        // The memory may be prepared for writing up front, so don't acquire much more
+        // than is going to be written; acquire again with a larger size to get more.
+        // The streams which don't have such memory return nullptr; use write() instead.
+        virtual u8* acquire(size_t size)
+        {
+            MANGO_UNREFERENCED_PARAMETER(size);
+            return nullptr;
+        }
+
+        virtual void commit(size_t size)
+        {
+            MANGO_UNREFERENCED_PARAMETER(size);
+        }
     };
 
     // --------------------------------------------------------------
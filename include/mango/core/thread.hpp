@@ -6,365 +6,2007 @@
 
 #include <queue>
 #include <vector>
+#include <algorithm>
+#include <iterator>
+#include <chrono>
+#include <type_traits>
+#include <cstddef>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <functional>
 #include <condition_variable>
-#include <future>
 #include "exception.hpp"
 #include "object.hpp"
 #include "atomic.hpp"
+#include "memory.hpp"
+#include "bits.hpp"
+#include "cpuinfo.hpp"
 
 namespace mango
 {
 
-    // TODO: use lock-free MPMC queue for free objects and only lock
-    //       when running out of objects in the queue
-    template <typename T>
-    class ObjectCache
+    namespace detail
     {
-    protected:
-        int m_block_size;
-        std::vector<T*> m_blocks;
-        T** m_stack { nullptr };
-        int m_stack_capacity { 0 };
-        int m_stack_size { 0 };
-        SpinLock m_lock;
 
-    public:
-        ObjectCache(int block_size)
-            : m_block_size(block_size)
+        // small per-thread number used to spread threads over striped resources
+        inline u32 getThreadSlot()
         {
+            static std::atomic<u32> counter { 0 };
+            static thread_local u32 slot = counter.fetch_add(1, std::memory_order_relaxed);
+            return slot;
         }
 
-        ~ObjectCache()
-        {
-            for (auto block : m_blocks) {
-                delete[] block;
-            }
+    } // namespace detail
 
-            delete[] m_stack;
-        }
+    /*
+        ObjectCache recycles objects of type T. The objects are constructed once when
+        the cache grows and acquire() / discard() hand them out and take them back
+        as they are; the state left by the previous user must be reset by the caller.
+
+        The free objects are kept in a lock-free stack shared by all threads and
+        in small magazines which threads are striped over so that the common case
+        does not touch the shared stack at all. A lock is taken only when the cache
+        runs out of objects and has to grow. The objects are released when the cache
+        is destroyed.
+    */
 
-        T* acquire()
+    template <typename T>
+    class ObjectCache : private NonCopyable
+    {
+    protected:
+        struct Node
         {
-            SpinLockGuard guard(m_lock);
-            if (!m_stack_size)
-            {
-                // reallocate stack
-                delete[] m_stack;
-                m_stack_capacity += m_block_size;
-                m_stack = new T*[m_stack_capacity];
+            std::atomic<u32> next;
+            u32 index;
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+        };
 
-                // allocate more objects
-                T* block = new T[m_block_size];
-                m_blocks.push_back(block);
+        struct Magazine
+        {
+            static constexpr int capacity = 16;
 
-                // put the allocated objects in the stack
-                for (int i = 0; i < m_block_size; ++i)
-                {
-                    m_stack[i] = block + i;
-                }
+            std::atomic<bool> busy { false };
+            int count { 0 };
+            T* objects[capacity];
 
-                m_stack_size = m_block_size;
-            }
+            // keep the magazines on separate cache lines
+            char padding[64];
+        };
+
+        static constexpr int MaxBlocks = 24;
+        static constexpr int MagazineCount = 16;
+
+        // free list head: (tag << 32) | index, index zero is the end of the list
+        alignas(64) std::atomic<u64> m_head { 0 };
+        alignas(64) Magazine m_magazines[MagazineCount];
+
+        AdaptiveLock m_grow_lock;
+        u32 m_block_size;
+        std::atomic<int> m_block_count { 0 };
+        Node* m_blocks[MaxBlocks];
 
-            T* object = m_stack[--m_stack_size];
-            return object;
+        // block k has block_size << k nodes so the capacity grows geometrically
+        Node* getNode(u32 index) const
+        {
+            const u32 i = index - 1;
+            const int block = u32_log2(i / m_block_size + 1);
+            const u32 start = m_block_size * ((1u << block) - 1);
+            return m_blocks[block] + (i - start);
         }
 
-        void discard(T* object)
+        static Node* getNode(T* object)
         {
-            SpinLockGuard guard(m_lock);
-            m_stack[m_stack_size++] = object;
+            char* storage = reinterpret_cast<char*>(object);
+            return reinterpret_cast<Node*>(storage - offsetof(Node, storage));
         }
-    };
 
-    struct TaskQueue;
+        void push(Node* first, Node* last)
+        {
+            u64 head = m_head.load(std::memory_order_relaxed);
+            for (;;)
+            {
+                last->next.store(u32(head), std::memory_order_relaxed);
+                const u64 desired = ((head >> 32) + 1) << 32 | first->index;
+                if (m_head.compare_exchange_weak(head, desired,
+                    std::memory_order_release, std::memory_order_relaxed))
+                    break;
+            }
+        }
 
-    class ThreadPool : private NonCopyable
-    {
-    private:
-        friend struct TaskQueue;
-        friend class ConcurrentQueue;
-        friend class SerialQueue;
+        Node* pop()
+        {
+            u64 head = m_head.load(std::memory_order_acquire);
+            for (;;)
+            {
+                const u32 index = u32(head);
+                if (!index)
+                    return nullptr;
+
+                // the node can be popped by another thread meanwhile but never freed;
+                // the tag makes our compare-exchange fail in that case
+                Node* node = getNode(index);
+                const u32 next = node->next.load(std::memory_order_relaxed);
+                const u64 desired = ((head >> 32) + 1) << 32 | next;
+                if (m_head.compare_exchange_weak(head, desired,
+                    std::memory_order_acquire, std::memory_order_acquire))
+                    return node;
+            }
+        }
 
-        struct Queue
+        Node* grow()
         {
-            ThreadPool* pool;
-            int priority;
-            std::atomic<int> task_input_count;
-            std::atomic<int> task_complete_count;
-            std::atomic<int> stamp_cancel;
-            std::string name;
+            AdaptiveLockGuard guard(m_grow_lock);
 
-            bool empty() const
+            // another thread might have grown the cache while we were waiting
+            Node* node = pop();
+            if (node)
+                return node;
+
+            const int block = m_block_count.load(std::memory_order_relaxed);
+            if (block >= MaxBlocks)
             {
-                return task_input_count.load() == task_complete_count.load();
+                MANGO_EXCEPTION("[ObjectCache] Out of memory.");
             }
-        };
 
-        struct Task
-        {
-            Queue* queue;
-            int stamp;
-            std::function<void()> func;
-        };
+            const u32 size = m_block_size << block;
+            const u32 start = m_block_size * ((1u << block) - 1);
 
-    public:
-        ThreadPool(size_t size);
-        ~ThreadPool();
+            Node* nodes = new Node[size];
+            for (u32 i = 0; i < size; ++i)
+            {
+                nodes[i].index = start + i + 1;
+                nodes[i].next.store(start + i + 2, std::memory_order_relaxed);
+                new (&nodes[i].storage) T();
+            }
 
-        static ThreadPool& getInstance();
-        static int getInstanceSize();
+            m_blocks[block] = nodes;
+            m_block_count.store(block + 1, std::memory_order_release);
 
-        int size() const;
+            // keep the first node and publish the rest
+            if (size > 1)
+            {
+                push(nodes + 1, nodes + size - 1);
+            }
 
-        void enqueue(std::function<void()>&& func)
+            return nodes;
+        }
+
+        Magazine* lockMagazine()
         {
-            enqueue(m_static_queue, std::move(func));
+            Magazine& magazine = m_magazines[detail::getThreadSlot() % MagazineCount];
+
+            // a busy magazine is skipped in favour of the shared stack
+            if (magazine.busy.exchange(true, std::memory_order_acquire))
+                return nullptr;
+
+            return &magazine;
         }
 
-    protected:
-        void thread(size_t threadID);
+    public:
+        ObjectCache(int block_size)
+            : m_block_size(u32(std::max(block_size, 1)))
+        {
+        }
 
-        Queue* createQueue(const std::string& name, int priority);
-        void deleteQueue(Queue* queue);
+        ~ObjectCache()
+        {
+            const int count = m_block_count.load(std::memory_order_acquire);
+            for (int block = 0; block < count; ++block)
+            {
+                const u32 size = m_block_size << block;
+                Node* nodes = m_blocks[block];
+                for (u32 i = 0; i < size; ++i)
+                {
+                    reinterpret_cast<T*>(&nodes[i].storage)->~T();
+                }
+                delete[] nodes;
+            }
+        }
 
-        void enqueue(Queue* queue, std::function<void()>&& func);
-        bool dequeue_and_process();
-        void cancel(Queue* queue);
-        void wait(Queue* queue);
+        T* acquire()
+        {
+            Magazine* magazine = lockMagazine();
+            if (magazine)
+            {
+                T* object = magazine->count ? magazine->objects[--magazine->count] : nullptr;
+                magazine->busy.store(false, std::memory_order_release);
+                if (object)
+                    return object;
+            }
 
-    private:
-        alignas(64) ObjectCache<Queue> m_queue_cache;
-        alignas(64) TaskQueue* m_queues;
+            Node* node = pop();
+            if (!node)
+            {
+                node = grow();
+            }
 
-        std::atomic<bool> m_stop { false };
-        std::atomic<int> m_sleep_count { 0 };
-        std::mutex m_queue_mutex;
-        std::condition_variable m_condition;
+            return reinterpret_cast<T*>(&node->storage);
+        }
 
-        Queue* m_static_queue;
-        std::vector<std::thread> m_threads;
-    };
+        void discard(T* object)
+        {
+            Magazine* magazine = lockMagazine();
+            if (magazine)
+            {
+                const bool stored = magazine->count < Magazine::capacity;
+                if (stored)
+                {
+                    magazine->objects[magazine->count++] = object;
+                }
+                magazine->busy.store(false, std::memory_order_release);
+                if (stored)
+                    return;
+            }
 
-    enum class Priority
-    {
-        HIGH = 0,
-        NORMAL = 1,
-        LOW = 2
+            Node* node = getNode(object);
+            push(node, node);
+        }
     };
 
     /*
-        ConcurrentQueue is API to submit work into the ThreadPool. The tasks have no
-        dependency to each other and can be executed in any order. Any number of queues
-        can be created from any thread in the program. The ThreadPool is shared between
-        queues. The queues can be configuted to different priorities to control which tasks
-        are more time critical.
+        ObjectPool is ObjectCache for objects which are constructed when they are taken
+        from the pool and destroyed when they are returned; only the memory is recycled.
 
         Usage example:
 
-        // create queue
-        ConcurrentQueue q;
-
-        // submit work into the queue
-        q.enqueue([] {
-            // TODO: do your stuff here..
-        });
+        ObjectPool<Decoder> pool(64);
 
-        // wait until the queue is drained
-        q.wait();
+        Decoder* decoder = pool.create(memory);
+        // TODO: use the decoder..
+        pool.destroy(decoder);
 
     */
 
-    class ConcurrentQueue : private NonCopyable
+    template <typename T>
+    class ObjectPool : private NonCopyable
     {
     protected:
-        ThreadPool& m_pool;
-        ThreadPool::Queue* m_queue;
+        struct Storage
+        {
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
+        };
+
+        ObjectCache<Storage> m_cache;
 
     public:
-        ConcurrentQueue();
-        ConcurrentQueue(const std::string& name, Priority priority = Priority::NORMAL);
-        ~ConcurrentQueue();
+        ObjectPool(int block_size)
+            : m_cache(block_size)
+        {
+        }
 
-        template <class F, class... Args>
-        void enqueue(F&& f, Args&&... args)
+        template <typename... Args>
+        T* create(Args&&... args)
         {
-            m_pool.enqueue(m_queue, std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            Storage* storage = m_cache.acquire();
+            try
+            {
+                return new (storage) T(std::forward<Args>(args)...);
+            }
+            catch (...)
+            {
+                m_cache.discard(storage);
+                throw;
+            }
         }
 
-        void cancel();
-        void wait();
+        void destroy(T* object)
+        {
+            if (object)
+            {
+                object->~T();
+                m_cache.discard(reinterpret_cast<Storage*>(object));
+            }
+        }
     };
 
-    /*
-        SerialQueue is API to serialize tasks to be executed after previous task
-        in the queue has completed. The tasks are NOT executed in the ThreadPool; each
-        queue has it's own execution thread.
+    enum class Priority
+    {
+        HIGH = 0,
+        NORMAL = 1,
+        LOW = 2
+    };
 
-        SerialQueue and ConcurrentQueue can be freely mixed can can enqueue work to other
-        queues from their tasks.
+    enum class WaitMode
+    {
+        // run any pending task while waiting
+        ANY,
+
+        // run only tasks from the waited queue or queues created by it's tasks;
+        // park the thread when there is nothing to help with
+        SCOPED
+    };
+
+    struct QueueStatistics
+    {
+        u32 wait_local;   // own tasks executed by threads waiting on the queue
+        u32 wait_foreign; // unrelated tasks executed by threads waiting on the queue
+        u32 wait_park;    // times a waiting thread parked
+        u32 enqueued;     // tasks enqueued into the queue
+        u32 completed;    // tasks completed or cancelled
+        u32 expired;      // tasks dropped because they had not started by their deadline
+
+        // recorded only with MANGO_ENABLE_THREAD_PROFILE while profiling is enabled;
+        // histogram bucket n counts times from 2^n to 2^(n+1) microseconds
+        u32 steals;             // tasks stolen from the worker which enqueued them
+        u64 wait_time;          // nanoseconds the tasks were queued before they started
+        u64 exec_time;          // nanoseconds the tasks were executing
+        u32 wait_histogram[16];
+        u32 exec_histogram[16];
+    };
+
+    /*
+        CancellationToken is a shared flag to stop work which is no longer needed. The copies
+        of a token share the state; the token is cancelled explicitly with cancel() or when
+        it's deadline passes. Queues drop their pending tasks when their token is cancelled
+        and long running tasks, decoders for example, poll cancelled() between rows or blocks.
+        A token constructed from nullptr is never cancelled and does not allocate.
 
         Usage example:
 
-        // create queue
-        SerialQueue s;
+        CancellationToken token(CancellationToken::Clock::now() + std::chrono::milliseconds(50));
 
-        // submit work into the queue
-        s.enqueue([] {
-            // TODO: do your stuff here..
-        });
+        ConcurrentQueue q("thumbnails");
+        q.setCancellationToken(token);
 
-        // wait until the queue is drained
-        s.wait(); // non-cooperative, CPU-sink
+        // the user scrolled away, the thumbnails are not needed anymore
+        token.cancel();
 
     */
 
-    class SerialQueue : private NonCopyable
+    class CancellationToken
     {
+    public:
+        using Clock = std::chrono::steady_clock;
+
     protected:
-        using Task = std::function<void()>;
+        struct State
+        {
+            std::atomic<bool> cancelled { false };
+            std::atomic<u64> deadline { 0 };
+        };
 
-        std::string m_name;
-        std::thread m_thread;
-        std::atomic<bool> m_stop { false };
-        std::atomic<int> m_task_counter { 0 };
+        std::shared_ptr<State> m_state;
 
-        std::deque<Task> m_task_queue;
-        std::mutex m_queue_mutex;
-        std::condition_variable m_condition;
+    public:
+        CancellationToken()
+            : m_state(std::make_shared<State>())
+        {
+        }
 
-        void thread();
+        CancellationToken(std::nullptr_t)
+        {
+        }
 
-    public:
-        SerialQueue();
-        SerialQueue(const std::string& name);
-        ~SerialQueue();
+        CancellationToken(Clock::time_point deadline)
+            : m_state(std::make_shared<State>())
+        {
+            setDeadline(deadline);
+        }
 
-        template <class F, class... Args>
-        void enqueue(F&& f, Args&&... args)
+        void cancel()
         {
-            std::unique_lock<std::mutex> lock(m_queue_mutex);
-            m_task_queue.emplace_back(f, (args)...);
-            ++m_task_counter;
-            m_condition.notify_one();
+            if (m_state)
+            {
+                m_state->cancelled = true;
+            }
         }
 
-        void cancel();
-        void wait();
-    };
+        void setDeadline(Clock::time_point deadline)
+        {
+            if (m_state)
+            {
+                m_state->deadline = std::max(getTime(deadline), u64(1));
+            }
+        }
 
-    /*
-        Task is a simple queue-less convenience object to enqueue work into the ThreadPool.
-        Synchronization must be done manually.
-    */
+        bool cancelled() const
+        {
+            if (!m_state)
+                return false;
 
-    class Task
-    {
-    public:
-        template <class F, class... Args>
-        Task(F&& f, Args&&... args)
+            if (m_state->cancelled.load(std::memory_order_relaxed))
+                return true;
+
+            const u64 deadline = m_state->deadline.load(std::memory_order_relaxed);
+            return deadline && getTime(Clock::now()) >= deadline;
+        }
+
+        // nanoseconds since the clock's epoch
+        static u64 getTime(Clock::time_point time)
         {
-            ThreadPool& pool = ThreadPool::getInstance();
-            pool.enqueue(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
         }
     };
 
     /*
-        FutureTask is an asynchronous API to submit tasks into the ThreadPool.
-        The get() member function will block the current thread until the result is available
-        and does not consume any significant amount of CPU; the thread will yield/sleep
-        while waiting for the result.
+        EventCount is a condition variable for lock-free data structures. The waiting
+        thread announces itself with prepareWait(), checks the condition once more and
+        then either calls cancelWait() or blocks in wait(). The notifying thread changes
+        the condition before calling notify(). Threads only block in the kernel (futex
+        on Linux) and notify() is practically free when nobody is waiting.
 
         Usage example:
 
-        // enqueue a simple task into the ThreadPool
-        FutureTask<int> task([] () -> int {
-            return 7;
-        });
-
-        // this will block until the task has been completed
-        int x = task.get();
+        for (;;) {
+            if (try_consume()) break;
+            u32 key = event.prepareWait();
+            if (try_consume()) { event.cancelWait(); break; }
+            event.wait(key);
+        }
 
     */
 
-    template <typename T>
-    class FutureTask
+    class EventCount : private NonCopyable
     {
-    private:
-        using Future = std::future<T>;
-        using Promise = std::promise<T>;
-        using Function = std::function<T()>;
+    protected:
+        std::atomic<u32> m_epoch { 0 };
+        std::atomic<u32> m_waiters { 0 };
 
-        Promise m_promise;
-        Future m_future;
+#if !defined(MANGO_PLATFORM_LINUX)
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+#endif
 
     public:
-        template <class F, class... Args>
-        FutureTask(F&& f, Args&&... args)
-            : m_promise()
-            , m_future(m_promise.get_future())
-        {
-            Function func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-            auto container = std::bind([this] (Function func) {
-                T value = func();
-                m_promise.set_value(value);
-            }, func);
+        EventCount() = default;
+        ~EventCount() = default;
 
-            ThreadPool& pool = ThreadPool::getInstance();
-            pool.enqueue(container);
-        }
+        u32 prepareWait();
+        void cancelWait();
+        void wait(u32 key);
 
-        T get()
-        {
-            return m_future.get();
-        }
+        // gives up after the timeout
+        void wait(u32 key, std::chrono::milliseconds timeout);
 
-        void wait()
-        {
-            m_future.wait();
-        }
+        // wake up to count waiting threads
+        void notify(int count = 1);
+        void notifyAll();
     };
 
-    template <>
-    class FutureTask<void>
+    namespace detail
     {
-    private:
-        using Future = std::future<void>;
-        using Promise = std::promise<void>;
-        using Function = std::function<void()>;
 
-        Promise m_promise;
-        Future m_future;
+        /*
+            Per-thread cache of fixed size memory blocks. A block released on a thread is
+            reused by the next allocation on the same thread; the cache is bounded and any
+            overflow goes back to the heap. Tasks are typically created on one thread and
+            released on another so the blocks circulate between the caches.
+        */
 
-    public:
-        template <class F, class... Args>
-        FutureTask(F&& f, Args&&... args)
-            : m_promise()
-            , m_future(m_promise.get_future())
+        template <size_t Size>
+        class BlockCache : private NonCopyable
         {
-            Function func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-            auto container = std::bind([this] (Function func) {
-                func();
-                m_promise.set_value();
-            }, func);
+        protected:
+            struct Block
+            {
+                Block* next;
+            };
+
+            static constexpr int capacity = 256;
+
+            Block* m_head { nullptr };
+            int m_count { 0 };
+
+            BlockCache() = default;
+
+            ~BlockCache()
+            {
+                while (m_head)
+                {
+                    Block* block = m_head;
+                    m_head = block->next;
+                    ::operator delete(block);
+                }
+
+                // blocks released during thread exit go straight to the heap
+                destroyed() = true;
+            }
+
+            static bool& destroyed()
+            {
+                static thread_local bool value = false;
+                return value;
+            }
+
+            static BlockCache& instance()
+            {
+                static thread_local BlockCache cache;
+                return cache;
+            }
+
+        public:
+            static void* allocate()
+            {
+                if (!destroyed())
+                {
+                    BlockCache& cache = instance();
+                    if (cache.m_head)
+                    {
+                        Block* block = cache.m_head;
+                        cache.m_head = block->next;
+                        --cache.m_count;
+                        return block;
+                    }
+                }
+
+                return ::operator new(std::max(Size, sizeof(Block)));
+            }
+
+            static void release(void* pointer)
+            {
+                if (!destroyed())
+                {
+                    BlockCache& cache = instance();
+                    if (cache.m_count < capacity)
+                    {
+                        Block* block = reinterpret_cast<Block*>(pointer);
+                        block->next = cache.m_head;
+                        cache.m_head = block;
+                        ++cache.m_count;
+                        return;
+                    }
+                }
+
+                ::operator delete(pointer);
+            }
+        };
+
+    } // namespace detail
+
+    /*
+        TaskFunction is a move-only void() callable with inline storage for small function
+        objects; larger objects are stored in pooled memory blocks. Submitting a task does
+        not touch the heap in the common case of a lambda with a few captures.
+    */
+
+    class TaskFunction
+    {
+    protected:
+        static constexpr size_t InlineSize = 64;
+
+        struct Ops
+        {
+            void (*invoke)(void* storage);
+            void (*move)(void* dest, void* source);
+            void (*destroy)(void* storage);
+        };
+
+        template <typename F>
+        struct InlineOps
+        {
+            static void invoke(void* storage)
+            {
+                (*reinterpret_cast<F*>(storage))();
+            }
+
+            static void move(void* dest, void* source)
+            {
+                new (dest) F(std::move(*reinterpret_cast<F*>(source)));
+                reinterpret_cast<F*>(source)->~F();
+            }
+
+            static void destroy(void* storage)
+            {
+                reinterpret_cast<F*>(storage)->~F();
+            }
+
+            static const Ops* ops()
+            {
+                static const Ops table = { invoke, move, destroy };
+                return &table;
+            }
+        };
+
+        template <typename F>
+        struct PooledOps
+        {
+            // objects up to 256 bytes come from a block cache, larger ones from the heap
+            static constexpr bool pooled = sizeof(F) <= 256 && alignof(F) <= alignof(std::max_align_t);
+
+            static F*& pointer(void* storage)
+            {
+                return *reinterpret_cast<F**>(storage);
+            }
+
+            static void create(void* storage, F&& func)
+            {
+                if (!pooled)
+                {
+                    pointer(storage) = new F(std::move(func));
+                    return;
+                }
+
+                void* memory = detail::BlockCache<256>::allocate();
+                try
+                {
+                    pointer(storage) = new (memory) F(std::move(func));
+                }
+                catch (...)
+                {
+                    // the block goes back to the cache if the move constructor throws
+                    detail::BlockCache<256>::release(memory);
+                    throw;
+                }
+            }
+
+            static void invoke(void* storage)
+            {
+                (*pointer(storage))();
+            }
+
+            static void move(void* dest, void* source)
+            {
+                pointer(dest) = pointer(source);
+            }
+
+            static void destroy(void* storage)
+            {
+                F* func = pointer(storage);
+                if (pooled)
+                {
+                    func->~F();
+                    detail::BlockCache<256>::release(func);
+                }
+                else
+                {
+                    delete func;
+                }
+            }
+
+            static const Ops* ops()
+            {
+                static const Ops table = { invoke, move, destroy };
+                return &table;
+            }
+        };
+
+        alignas(std::max_align_t) unsigned char m_storage[InlineSize];
+        const Ops* m_ops { nullptr };
+
+        template <typename F>
+        void create(F&& func, std::true_type)
+        {
+            new (m_storage) F(std::move(func));
+            m_ops = InlineOps<F>::ops();
+        }
+
+        template <typename F>
+        void create(F&& func, std::false_type)
+        {
+            PooledOps<F>::create(m_storage, std::move(func));
+            m_ops = PooledOps<F>::ops();
+        }
+
+        void reset()
+        {
+            if (m_ops)
+            {
+                m_ops->destroy(m_storage);
+                m_ops = nullptr;
+            }
+        }
+
+    public:
+        TaskFunction() = default;
+
+        template <typename F, typename D = typename std::decay<F>::type,
+                  typename = typename std::enable_if<!std::is_same<D, TaskFunction>::value>::type>
+        TaskFunction(F&& func)
+        {
+            using Inline = std::integral_constant<bool,
+                sizeof(D) <= InlineSize &&
+                alignof(D) <= alignof(std::max_align_t) &&
+                std::is_nothrow_move_constructible<D>::value>;
+            create<D>(D(std::forward<F>(func)), Inline());
+        }
+
+        TaskFunction(TaskFunction&& other) noexcept
+        {
+            if (other.m_ops)
+            {
+                other.m_ops->move(m_storage, other.m_storage);
+                m_ops = other.m_ops;
+                other.m_ops = nullptr;
+            }
+        }
+
+        TaskFunction& operator = (TaskFunction&& other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                if (other.m_ops)
+                {
+                    other.m_ops->move(m_storage, other.m_storage);
+                    m_ops = other.m_ops;
+                    other.m_ops = nullptr;
+                }
+            }
+            return *this;
+        }
+
+        TaskFunction(const TaskFunction&) = delete;
+        TaskFunction& operator = (const TaskFunction&) = delete;
+
+        ~TaskFunction()
+        {
+            reset();
+        }
+
+        explicit operator bool () const
+        {
+            return m_ops != nullptr;
+        }
+
+        void operator () ()
+        {
+            m_ops->invoke(m_storage);
+        }
+    };
+
+    /*
+        ScratchArena is a per-thread bump allocator for temporary memory. The ThreadPool
+        tasks get the arena with ThreadPool::getScratch() and everything they allocate
+        is released when the task completes; the memory is reused by the following tasks
+        without going to the heap. Outside of the tasks the allocations are released with
+        a ScratchArena::Scope. The arena is an Allocator so it can be handed to the image
+        decoders for their temporary buffers.
+
+        Usage example:
+
+        q.enqueue([] {
+            s16* data = ThreadPool::getScratch().allocate<s16>(640);
+            // TODO: use the 64 byte aligned data..
+        });
+
+    */
+
+    using ScratchArena = ArenaAllocator;
+
+    struct TaskQueue;
+    struct DeadlineQueue;
+    struct WorkerContext;
+    class TaskDeque;
+
+    class ThreadPool : private NonCopyable
+    {
+    private:
+        friend struct TaskQueue;
+        friend struct DeadlineQueue;
+        friend struct WorkerContext;
+        friend class TaskDeque;
+        friend class ConcurrentQueue;
+        friend class SerialQueue;
+        friend class TaskGraph;
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        struct Profile
+        {
+            std::atomic<u32> steals;
+            std::atomic<u64> wait_time;
+            std::atomic<u64> exec_time;
+            std::atomic<u32> wait_histogram[16];
+            std::atomic<u32> exec_histogram[16];
+            u32 name;
+        };
+
+        struct TraceBuffer;
+#endif
+
+        struct Queue
+        {
+            ThreadPool* pool;
+            std::atomic<Queue*> parent; // recycled queues can be walked concurrently
+            int priority;
+            std::atomic<int> task_input_count;
+            std::atomic<int> task_complete_count;
+            std::atomic<int> task_active_count; // tasks of the queue and its descendants being executed
+            std::atomic<int> stamp_cancel;
+            std::atomic<u32> wait_local_count;
+            std::atomic<u32> wait_foreign_count;
+            std::atomic<u32> wait_park_count;
+            std::atomic<u32> expired_count;
+            std::string name;
+            CancellationToken token;
+
+            // threads in scoped wait for the queue or any of its descendants
+            EventCount event;
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+            Profile profile;
+#endif
+
+            bool empty() const
+            {
+                return task_input_count.load() == task_complete_count.load();
+            }
+
+            // queue is the scope or created from it's tasks
+            bool scoped(const Queue* scope) const
+            {
+                // NOTE: the depth limit protects against recycled parents forming a cycle
+                const Queue* queue = this;
+                for (int depth = 0; queue && depth < 16; ++depth)
+                {
+                    if (queue == scope)
+                        return true;
+                    queue = queue->parent.load(std::memory_order_relaxed);
+                }
+                return false;
+            }
+        };
+
+        struct Task
+        {
+            Queue* queue;
+            int stamp;
+            u64 deadline; // CancellationToken::getTime(), zero when there is no deadline
+            TaskFunction func;
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+            u64 time; // submitted, zero when not profiling
+#endif
+        };
+
+        struct Worker;
+
+    public:
+        struct Config
+        {
+            // number of workers; zero creates one worker per logical processor
+            int size { 0 };
+
+            // distribute the workers over the NUMA nodes and pin them to the processors
+            // of their node; tasks enqueued with a node hint prefer workers on that node
+            bool numa { false };
+
+            // microseconds an idle worker keeps looking for tasks before it is parked
+            int spin { 50 };
+        };
+
+        ThreadPool(size_t size);
+        ThreadPool(const Config& config);
+        ~ThreadPool();
+
+        // configure the shared instance; must be called before it is first used
+        static void configure(const Config& config);
+
+        static ThreadPool& getInstance();
+        static int getInstanceSize();
+
+        // configure the shared I/O instance; must be called before it is first used.
+        // The default size is four workers per logical processor.
+        static void configureIO(const Config& config);
+
+        // shared instance for tasks which spend most of their time blocked in I/O:
+        // reading files, page faults on mapped memory, etc. Keeping them out of the
+        // compute instance leaves it's workers free for work which needs the CPU.
+        static ThreadPool& getIOInstance();
+
+        int size() const;
+        int idle() const;
+
+        // number of NUMA nodes the workers are distributed over; zero when not NUMA aware
+        int nodes() const;
+
+        // time an idle worker keeps looking for tasks before it is parked
+        void setSpinBudget(int microseconds);
+
+        // index of the worker executing on the current thread, from zero to size() - 1;
+        // -1 when the current thread is not a worker of this pool
+        int getWorkerIndex() const;
+
+        // scratch memory of the current thread; released automatically after each task
+        static ScratchArena& getScratch();
+
+        void enqueue(TaskFunction&& func)
+        {
+            enqueue(m_static_queue, std::move(func));
+        }
+
+        // record queue statistics and task trace events; has no effect unless the library
+        // is built with MANGO_ENABLE_THREAD_PROFILE
+        void setProfiling(bool enable);
+
+        // recorded task events in Chrome trace event format (chrome://tracing); only the
+        // most recent events are kept per worker. Call when the pool is quiet.
+        std::string getTrace() const;
+
+    protected:
+        void thread(size_t threadID);
+
+        Queue* createQueue(const std::string& name, int priority);
+        void deleteQueue(Queue* queue);
+
+        void initialize(const Config& config);
+
+        static Task* createTask();
+        static void destroyTask(Task* task);
+        void enqueue(Queue* queue, TaskFunction&& func, int node = -1);
+        void enqueueDeadline(Queue* queue, TaskFunction&& func, u64 deadline);
+        void submit(Task* task, int node);
+        void submit(Task** tasks, size_t count);
+
+        // enqueue count tasks created with generator(index) with one counter update
+        // and one wake-up
+        template <typename Generator>
+        void enqueue_bulk(Queue* queue, size_t count, Generator&& generator)
+        {
+            constexpr size_t batch = 64;
+
+            if (!count)
+                return;
+
+            const int stamp = queue->task_input_count.fetch_add(int(count));
+
+            Task* tasks[batch];
+            size_t index = 0;
+            size_t created = 0;
+
+            try
+            {
+                while (index < count)
+                {
+                    const size_t n = std::min(count - index, batch);
+                    for (created = 0; created < n; ++created)
+                    {
+                        TaskFunction func = generator(index + created);
+                        Task* task = createTask();
+                        task->queue = queue;
+                        task->stamp = stamp + int(index + created);
+                        task->func = std::move(func);
+                        tasks[created] = task;
+                    }
+
+                    submit(tasks, n);
+                    index += n;
+                    created = 0;
+                }
+            }
+            catch (...)
+            {
+                // the tasks which were not submitted are counted as completed
+                for (size_t i = 0; i < created; ++i)
+                {
+                    destroyTask(tasks[i]);
+                }
+
+                queue->task_complete_count += int(count - index);
+                m_event.notify(int(std::min(index, m_threads.size())));
+                signal(queue);
+                throw;
+            }
+
+            m_event.notify(int(std::min(count, m_threads.size())));
+            signal(queue);
+        }
+        void handoff(Queue* queue, TaskFunction&& io, TaskFunction&& func);
+        TaskFunction defer(Queue* queue, TaskFunction&& func);
+        Task* dequeue();
+        Task* dequeue(Queue* scope);
+        Task* steal(int priority, Worker* worker, const Queue* scope = nullptr);
+        Task* inject(int priority, Worker* worker);
+        void process(Task* task);
+        void signal(Queue* queue);
+        bool pending() const;
+        void cancel(Queue* queue);
+        void wait(Queue* queue, WaitMode mode = WaitMode::ANY);
+        QueueStatistics getStatistics(const Queue* queue) const;
+
+        Worker* getCurrentWorker() const;
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        void profile(Task* task, u64 begin, u64 end);
+#endif
+
+    private:
+        alignas(64) ObjectCache<Queue> m_queue_cache;
+
+        // injection queues for tasks submitted from outside the pool
+        alignas(64) TaskQueue* m_queues;
+
+        // injection queues for tasks with a NUMA node hint
+        TaskQueue* m_node_queues;
+
+        // tasks with a deadline in earliest deadline first order
+        DeadlineQueue* m_deadline_queues;
+        int m_node_count;
+
+        // per-worker work-stealing deques
+        Worker* m_workers;
+
+        std::atomic<bool> m_stop { false };
+        std::atomic<int> m_idle_count { 0 };
+        std::atomic<int> m_spin_budget { 50 };
+
+        // parked workers
+        EventCount m_event;
+
+        Queue* m_static_queue;
+        std::vector<std::thread> m_threads;
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        std::atomic<bool> m_profiling { false };
+
+        // events of tasks executed outside of the workers, for example in wait()
+        TraceBuffer* m_external_trace;
+        SpinLock m_trace_lock;
+#endif
+    };
+
+    /*
+        ConcurrentQueue is API to submit work into the ThreadPool. The tasks have no
+        dependency to each other and can be executed in any order. Any number of queues
+        can be created from any thread in the program. The ThreadPool is shared between
+        queues. The queues can be configuted to different priorities to control which tasks
+        are more time critical.
+
+        Usage example:
+
+        // create queue
+        ConcurrentQueue q;
+
+        // submit work into the queue
+        q.enqueue([] {
+            // TODO: do your stuff here..
+        });
+
+        // wait until the queue is drained
+        q.wait();
+
+        Large numbers of tasks should be submitted at once, which is considerably
+        cheaper than enqueuing them one by one:
+
+        q.enqueue_n(height, [&] (int y) {
+            process(y);
+        });
+
+        Blocking I/O should be kept out of the compute pool. The I/O can be handed off
+        to the I/O pool so that the compute workers are free while the data is loading:
+
+        q.enqueue_io([&] {
+            file = new File(filename); // blocking
+        }, [&] {
+            decode(*file);             // executed in the compute pool
+        });
+
+        ConcurrentQueue io(ThreadPool::getIOInstance(), "io");
+
+        The waiting thread helps the ThreadPool by executing pending tasks. With
+        WaitMode::SCOPED it only executes tasks from the waited queue and the queues
+        created from it's tasks, so a short wait is not held up by an unrelated long task.
+
+        q.wait(WaitMode::SCOPED);
+
+    */
+
+    class ConcurrentQueue : private NonCopyable
+    {
+    protected:
+        ThreadPool& m_pool;
+        ThreadPool::Queue* m_queue;
+
+    public:
+        ConcurrentQueue();
+        ConcurrentQueue(const std::string& name, Priority priority = Priority::NORMAL);
+        ConcurrentQueue(ThreadPool& pool, const std::string& name, Priority priority = Priority::NORMAL);
+        ~ConcurrentQueue();
+
+        template <class F, class... Args>
+        void enqueue(F&& f, Args&&... args)
+        {
+            m_pool.enqueue(m_queue, std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        }
+
+        // prefer a worker on the NUMA node, for example getMemoryNode(bitmap.image)
+        template <class F, class... Args>
+        void enqueue_node(int node, F&& f, Args&&... args)
+        {
+            m_pool.enqueue(m_queue, std::bind(std::forward<F>(f), std::forward<Args>(args)...), node);
+        }
+
+        // the task is dropped if it has not started by the deadline; tasks with a deadline are
+        // executed in earliest deadline first order ahead of the backlog of their priority
+        template <class F, class... Args>
+        void enqueue_until(CancellationToken::Clock::time_point deadline, F&& f, Args&&... args)
+        {
+            m_pool.enqueueDeadline(m_queue, std::bind(std::forward<F>(f), std::forward<Args>(args)...),
+                std::max(CancellationToken::getTime(deadline), u64(1)));
+        }
+
+        // enqueue the tasks in the range [begin, end)
+        template <class Iterator>
+        void enqueue_bulk(Iterator begin, Iterator end)
+        {
+            m_pool.enqueue_bulk(m_queue, size_t(std::distance(begin, end)), [&begin] (size_t) {
+                return TaskFunction(*begin++);
+            });
+        }
+
+        // enqueue count tasks calling func(index); func is copied into each task
+        template <class F>
+        void enqueue_n(int count, F&& func)
+        {
+            m_pool.enqueue_bulk(m_queue, size_t(std::max(count, 0)), [&func] (size_t index) {
+                return TaskFunction([func, index] () mutable {
+                    func(int(index));
+                });
+            });
+        }
+
+        // execute io in the I/O pool and continue with func in the queue when it is done;
+        // the queue is not drained until func has completed
+        template <class IO, class F>
+        void enqueue_io(IO&& io, F&& func)
+        {
+            m_pool.handoff(m_queue, std::forward<IO>(io), std::forward<F>(func));
+        }
+
+        // count func into the queue now and submit it when the returned function is called,
+        // for example from the completion of an asynchronous operation. The returned
+        // function must be called exactly once; the queue is not drained until then.
+        template <class F>
+        TaskFunction defer(F&& func)
+        {
+            return m_pool.defer(m_queue, std::forward<F>(func));
+        }
+
+        void cancel();
+        void wait(WaitMode mode = WaitMode::ANY);
+
+        // tasks which have not started are dropped once the token is cancelled;
+        // set the token before enqueuing tasks
+        void setCancellationToken(const CancellationToken& token);
+
+        QueueStatistics getStatistics() const;
+    };
+
+    /*
+        TaskGraph is API to submit tasks with dependencies into the ThreadPool. A node
+        is scheduled as soon as all of it's predecessors have completed; there is no
+        barrier between the stages so independent chains of nodes overlap freely.
+        The graph must be acyclic. Completed graph can be run again.
+
+        Usage example:
+
+        TaskGraph graph("mipmaps");
+
+        // create nodes
+        TaskGraph::Node* decode = graph.node([] { ... });
+        TaskGraph::Node* mipmap = graph.node([] { ... });
+        TaskGraph::Node* compress = graph.node([] { ... });
+
+        // "decode" before "mipmap" before "compress"
+        graph.edge(decode, mipmap);
+        graph.edge(mipmap, compress);
+
+        // submit the nodes without predecessors into the ThreadPool
+        graph.run();
+
+        // wait until every node has completed
+        graph.wait();
+
+    */
+
+    class TaskGraph : private NonCopyable
+    {
+    public:
+        class Node : private NonCopyable
+        {
+        protected:
+            friend class TaskGraph;
+
+            TaskFunction m_func;
+            std::vector<Node*> m_successors;
+            int m_predecessors { 0 };
+            std::atomic<int> m_pending { 0 };
+
+        public:
+            Node(TaskFunction&& func)
+                : m_func(std::move(func))
+            {
+            }
+        };
+
+    protected:
+        ThreadPool& m_pool;
+        ThreadPool::Queue* m_queue;
+        std::vector<std::unique_ptr<Node>> m_nodes;
+
+        void schedule(Node* node);
+        void execute(Node* node);
+
+    public:
+        TaskGraph();
+        TaskGraph(const std::string& name, Priority priority = Priority::NORMAL);
+        ~TaskGraph();
+
+        template <class F, class... Args>
+        Node* node(F&& f, Args&&... args)
+        {
+            m_nodes.emplace_back(new Node(std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
+            return m_nodes.back().get();
+        }
+
+        // "to" will not start before "from" has completed
+        void edge(Node* from, Node* to);
+
+        void run();
+        void cancel();
+        void wait(WaitMode mode = WaitMode::ANY);
+    };
+
+    enum class SerialMode
+    {
+        // tasks are executed in the ThreadPool one at a time
+        STRAND,
+
+        // tasks are executed in a dedicated thread owned by the queue
+        THREAD
+    };
+
+    /*
+        SerialQueue is API to serialize tasks to be executed after previous task
+        in the queue has completed. By default the queue is a strand in the ThreadPool:
+        it does not own a thread and only occupies a worker while it has pending tasks,
+        so any number of queues can be created. SerialMode::THREAD gives the queue it's
+        own execution thread for tasks which block for long periods of time.
+
+        SerialQueue and ConcurrentQueue can be freely mixed can can enqueue work to other
+        queues from their tasks.
+
+        Usage example:
+
+        // create queue
+        SerialQueue s;
+
+        // submit work into the queue
+        s.enqueue([] {
+            // TODO: do your stuff here..
+        });
+
+        // wait until the queue is drained
+        s.wait();
+
+        The waiting thread helps the ThreadPool like ConcurrentQueue::wait() does; in
+        the SerialMode::THREAD the waiting thread sleeps until the queue is drained.
+
+    */
+
+    class SerialQueue : private NonCopyable
+    {
+    protected:
+        struct Node
+        {
+            std::atomic<Node*> next;
+            int stamp;
+            TaskFunction func;
+        };
+
+        ThreadPool& m_pool;
+        ThreadPool::Queue* m_queue;
+        SerialMode m_mode;
+
+        std::thread m_thread;
+        std::atomic<bool> m_stop { false };
+        EventCount m_event;
+
+        // intrusive MPSC list: producers push at the head, the consumer pops at the tail
+        std::atomic<Node*> m_head;
+        char m_padding0[64];
+        Node* m_tail;
+        char m_padding1[64];
+
+        // tasks enqueued but not yet completed; the enqueue which finds the queue
+        // empty schedules the consumer
+        std::atomic<int> m_task_counter { 0 };
+        std::atomic<int> m_task_input_count { 0 };
+        std::atomic<int> m_stamp_cancel { -1 };
+
+        void push(TaskFunction&& func);
+        bool drain(int count);
+        void schedule();
+        void thread();
+
+    public:
+        SerialQueue();
+        SerialQueue(const std::string& name, SerialMode mode = SerialMode::STRAND);
+        ~SerialQueue();
+
+        template <class F, class... Args>
+        void enqueue(F&& f, Args&&... args)
+        {
+            push(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        }
+
+        void cancel();
+        void wait(WaitMode mode = WaitMode::ANY);
+    };
+
+    /*
+        Task is a simple queue-less convenience object to enqueue work into the ThreadPool.
+        Synchronization must be done manually.
+    */
+
+    class Task
+    {
+    public:
+        template <class F, class... Args>
+        Task(F&& f, Args&&... args)
+        {
+            ThreadPool& pool = ThreadPool::getInstance();
+            pool.enqueue(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        }
+    };
+
+    /*
+        FutureTask is an asynchronous API to submit tasks into the ThreadPool.
+        The get() member function will block the current thread until the result is available
+        and does not consume any significant amount of CPU; the thread will yield/sleep
+        while waiting for the result. The shared state is recycled from a per-thread cache
+        so creating a FutureTask does not allocate in the common case.
+
+        The then() member function chains a continuation which is scheduled into the
+        ThreadPool when the result is ready, so a pipeline of stages never blocks a thread.
+        when_all() and when_any() combine FutureTasks into one which is ready when all or
+        any of them are. These consume the FutureTasks they are given.
+
+        Usage example:
+
+        // enqueue a simple task into the ThreadPool
+        FutureTask<int> task([] () -> int {
+            return 7;
+        });
+
+        // this will block until the task has been completed
+        int x = task.get();
+
+        // stages are executed in the ThreadPool one after another
+        FutureTask<Bitmap> bitmap = FutureTask<Memory>(readFile, filename)
+            .then([] (Memory memory) { return decode(memory); })
+            .then([] (Bitmap bitmap) { return resize(std::move(bitmap)); });
+
+        // ready when all the tasks are; the results are read without blocking
+        when_all(std::move(tasks)).then([] (std::vector<FutureTask<int>> tasks) {
+            for (auto& task : tasks) {
+                int value = task.get();
+            }
+        });
+
+    */
+
+    namespace detail
+    {
+
+        struct FutureAccess;
+
+        // callback attached to a FutureState; runs when the value is ready
+        struct FutureContinuation
+        {
+            FutureContinuation* next;
+            TaskFunction func;
+
+            // run in the completing thread instead of scheduling into the ThreadPool
+            bool immediate;
+
+            FutureContinuation(TaskFunction&& func, bool immediate)
+                : next(nullptr)
+                , func(std::move(func))
+                , immediate(immediate)
+            {
+            }
+
+            static FutureContinuation* create(TaskFunction&& func, bool immediate)
+            {
+                void* memory = BlockCache<sizeof(FutureContinuation)>::allocate();
+                return new (memory) FutureContinuation(std::move(func), immediate);
+            }
+
+            // marks the list of a completed state; continuations attached after that run at once
+            static FutureContinuation* completed()
+            {
+                return reinterpret_cast<FutureContinuation*>(uintptr_t(1));
+            }
+
+            void run()
+            {
+                if (immediate)
+                {
+                    func();
+                }
+                else
+                {
+                    ThreadPool::getInstance().enqueue(std::move(func));
+                }
+
+                this->~FutureContinuation();
+                BlockCache<sizeof(FutureContinuation)>::release(this);
+            }
+
+            static void runList(FutureContinuation* head)
+            {
+                // the list is in reverse order of attachment
+                FutureContinuation* list = nullptr;
+                while (head)
+                {
+                    FutureContinuation* next = head->next;
+                    head->next = list;
+                    list = head;
+                    head = next;
+                }
+
+                while (list)
+                {
+                    FutureContinuation* next = list->next;
+                    list->run();
+                    list = next;
+                }
+            }
+        };
+
+        template <typename T>
+        struct FutureValue
+        {
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+            template <typename F>
+            void set(F& func)
+            {
+                new (&storage) T(func());
+            }
+
+            T& get()
+            {
+                return *reinterpret_cast<T*>(&storage);
+            }
+
+            T take()
+            {
+                return std::move(get());
+            }
+
+            void destroy()
+            {
+                get().~T();
+            }
+        };
+
+        template <>
+        struct FutureValue<void>
+        {
+            template <typename F>
+            void set(F& func)
+            {
+                func();
+            }
+
+            void take()
+            {
+            }
+
+            void destroy()
+            {
+            }
+        };
+
+        template <typename T>
+        struct FutureState
+        {
+            std::atomic<int> refs { 2 };
+            std::atomic<u32> ready { 0 };
+            std::atomic<u32> waiters { 0 };
+            std::atomic<FutureContinuation*> continuations { nullptr };
+            FutureValue<T> value;
+
+            static FutureState* create()
+            {
+                return new (BlockCache<sizeof(FutureState)>::allocate()) FutureState();
+            }
+
+            void release()
+            {
+                if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    if (ready.load(std::memory_order_relaxed))
+                    {
+                        value.destroy();
+                    }
+
+                    this->~FutureState();
+                    BlockCache<sizeof(FutureState)>::release(this);
+                }
+            }
+
+            void complete()
+            {
+                ready.store(1, std::memory_order_seq_cst);
+                FutureContinuation* head = continuations.exchange(FutureContinuation::completed(), std::memory_order_acq_rel);
+
+                // only the threads waiting for this state are woken up
+                if (waiters.load(std::memory_order_seq_cst))
+                {
+                    parkWake(&ready, INT_MAX);
+                }
+
+                FutureContinuation::runList(head);
+            }
+
+            void attach(TaskFunction&& func, bool immediate)
+            {
+                FutureContinuation* node = FutureContinuation::create(std::move(func), immediate);
+                FutureContinuation* head = continuations.load(std::memory_order_acquire);
+
+                do
+                {
+                    if (head == FutureContinuation::completed())
+                    {
+                        node->run();
+                        return;
+                    }
+
+                    node->next = head;
+                } while (!continuations.compare_exchange_weak(head, node,
+                    std::memory_order_acq_rel, std::memory_order_acquire));
+            }
+
+            void wait()
+            {
+                for (int i = 0; i < 64; ++i)
+                {
+                    if (ready.load(std::memory_order_acquire))
+                        return;
+                    std::this_thread::yield();
+                }
+
+                while (!ready.load(std::memory_order_acquire))
+                {
+                    // pairs with complete(); either we see the value or it sees us
+                    waiters.fetch_add(1, std::memory_order_seq_cst);
+                    if (!ready.load(std::memory_order_seq_cst))
+                    {
+                        parkWait(&ready, 0);
+                    }
+                    waiters.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+        };
+
+        // invokes a continuation with the value of the previous stage
+        template <typename T>
+        struct FutureApply
+        {
+            template <typename F>
+            static auto call(F& func, FutureValue<T>& value) -> decltype(func(value.take()))
+            {
+                return func(value.take());
+            }
+        };
+
+        template <>
+        struct FutureApply<void>
+        {
+            template <typename F>
+            static auto call(F& func, FutureValue<void>& value) -> decltype(func())
+            {
+                MANGO_UNREFERENCED_PARAMETER(value);
+                return func();
+            }
+        };
+
+        template <typename T, typename F>
+        using FutureResult = decltype(FutureApply<T>::call(std::declval<F&>(), std::declval<FutureValue<T>&>()));
+
+    } // namespace detail
+
+    template <typename T>
+    class FutureTask : private NonCopyable
+    {
+    private:
+        using State = detail::FutureState<T>;
+
+        State* m_state;
+
+        template <typename U>
+        friend class FutureTask;
+        friend struct detail::FutureAccess;
+
+        explicit FutureTask(State* state)
+            : m_state(state)
+        {
+        }
+
+    public:
+        template <class F, class... Args>
+        FutureTask(F&& f, Args&&... args)
+            : m_state(State::create())
+        {
+            State* state = m_state;
+            auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
 
             ThreadPool& pool = ThreadPool::getInstance();
-            pool.enqueue(container);
+            pool.enqueue([state, func = std::move(func)] () mutable {
+                state->value.set(func);
+                state->complete();
+                state->release();
+            });
+        }
+
+        FutureTask(FutureTask&& other)
+            : m_state(other.m_state)
+        {
+            other.m_state = nullptr;
+        }
+
+        ~FutureTask()
+        {
+            if (m_state)
+            {
+                m_state->release();
+            }
         }
 
-        void get()
+        // returns the result; like std::future::get() it can be called only once
+        T get()
         {
-            m_future.get();
+            m_state->wait();
+            return m_state->value.take();
         }
 
         void wait()
         {
-            m_future.wait();
+            m_state->wait();
+        }
+
+        // schedules func(value) into the ThreadPool when the result is ready and returns
+        // the FutureTask of the continuation; this FutureTask is consumed
+        template <typename F, typename D = typename std::decay<F>::type>
+        FutureTask<detail::FutureResult<T, D>> then(F&& f)
+        {
+            using R = detail::FutureResult<T, D>;
+            using Next = detail::FutureState<R>;
+
+            State* state = m_state;
+            m_state = nullptr;
+
+            Next* next = Next::create();
+
+            state->attach([state, next, func = D(std::forward<F>(f))] () mutable {
+                auto call = [&] {
+                    return detail::FutureApply<T>::call(func, state->value);
+                };
+                next->value.set(call);
+                next->complete();
+                next->release();
+                state->release();
+            }, false);
+
+            return FutureTask<R>(next);
         }
     };
 
+    namespace detail
+    {
+
+        struct FutureAccess
+        {
+            template <typename T>
+            static FutureState<T>* state(FutureTask<T>& task)
+            {
+                return task.m_state;
+            }
+
+            template <typename T>
+            static FutureTask<T> make(FutureState<T>* state)
+            {
+                return FutureTask<T>(state);
+            }
+        };
+
+    } // namespace detail
+
+    template <typename T>
+    struct WhenAnyResult
+    {
+        size_t index;
+        std::vector<FutureTask<T>> tasks;
+    };
+
+    // returns a FutureTask which is ready when all the tasks are; the result holds the
+    // completed tasks whose get() does not block
+    template <typename T>
+    FutureTask<std::vector<FutureTask<T>>> when_all(std::vector<FutureTask<T>> tasks)
+    {
+        using Result = std::vector<FutureTask<T>>;
+        using State = detail::FutureState<Result>;
+
+        struct Join
+        {
+            std::atomic<size_t> pending;
+            Result tasks;
+            State* state;
+
+            Join(Result&& tasks, State* state)
+                : pending(tasks.size() + 1)
+                , tasks(std::move(tasks))
+                , state(state)
+            {
+            }
+
+            void arrive()
+            {
+                if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    auto take = [this] {
+                        return std::move(tasks);
+                    };
+                    state->value.set(take);
+                    state->complete();
+                    state->release();
+                    delete this;
+                }
+            }
+        };
+
+        State* state = State::create();
+        Join* join = new Join(std::move(tasks), state);
+
+        // the extra pending count keeps the join alive while attaching
+        for (auto& task : join->tasks)
+        {
+            detail::FutureAccess::state(task)->attach([join] {
+                join->arrive();
+            }, true);
+        }
+
+        join->arrive();
+
+        return detail::FutureAccess::make(state);
+    }
+
+    // returns a FutureTask which is ready when any of the tasks is; the result holds the
+    // index of the first completed task and all the tasks
+    template <typename T>
+    FutureTask<WhenAnyResult<T>> when_any(std::vector<FutureTask<T>> tasks)
+    {
+        using Result = WhenAnyResult<T>;
+        using State = detail::FutureState<Result>;
+
+        struct Join
+        {
+            std::atomic<size_t> refs;
+            std::atomic<bool> done { false };
+            std::vector<detail::FutureState<T>*> sources;
+            std::vector<FutureTask<T>> tasks;
+            State* state;
+
+            Join(std::vector<FutureTask<T>>&& tasks, State* state)
+                : refs(tasks.size() + 1)
+                , tasks(std::move(tasks))
+                , state(state)
+            {
+                // the tasks are handed out with the result while continuations are
+                // still attached to them, so the join keeps the states alive
+                for (auto& task : this->tasks)
+                {
+                    detail::FutureState<T>* source = detail::FutureAccess::state(task);
+                    source->refs.fetch_add(1, std::memory_order_relaxed);
+                    sources.push_back(source);
+                }
+            }
+
+            ~Join()
+            {
+                for (auto source : sources)
+                {
+                    source->release();
+                }
+            }
+
+            void arrive(size_t index)
+            {
+                if (!done.exchange(true, std::memory_order_acq_rel))
+                {
+                    auto take = [this, index] {
+                        return Result { index, std::move(tasks) };
+                    };
+                    state->value.set(take);
+                    state->complete();
+                    state->release();
+                }
+
+                release();
+            }
+
+            void release()
+            {
+                if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                {
+                    delete this;
+                }
+            }
+        };
+
+        State* state = State::create();
+
+        if (tasks.empty())
+        {
+            // nothing will ever complete; the result is ready at once
+            auto take = [] {
+                return Result { 0, std::vector<FutureTask<T>>() };
+            };
+            state->value.set(take);
+            state->complete();
+            state->release();
+            return detail::FutureAccess::make(state);
+        }
+
+        Join* join = new Join(std::move(tasks), state);
+
+        for (size_t i = 0; i < join->sources.size(); ++i)
+        {
+            join->sources[i]->attach([join, i] {
+                join->arrive(i);
+            }, true);
+        }
+
+        join->release();
+
+        return detail::FutureAccess::make(state);
+    }
+
+    /*
+        parallel_for, parallel_reduce and parallel_for_2d execute a loop in the ThreadPool.
+        The range is split lazily: the upper half is handed to the ThreadPool only when
+        there is an idle worker to pick it up, otherwise the current thread keeps processing
+        the range in grain sized chunks. Small ranges never touch the ThreadPool and large
+        ranges are balanced between the workers which are actually available.
+
+        Usage example:
+
+        // process image in chunks of at least 8 scanlines
+        parallel_for(0, height, 8, [&] (int y0, int y1) {
+            for (int y = y0; y < y1; ++y) {
+                // TODO: process scanline y
+            }
+        });
+
+        // sum of elements; the reduce function must be associative and commutative
+        int sum = parallel_reduce(0, count, 1024, 0, [&] (int i0, int i1) {
+            int s = 0;
+            for (int i = i0; i < i1; ++i) {
+                s += values[i];
+            }
+            return s;
+        }, [] (int a, int b) {
+            return a + b;
+        });
+
+        // process image in 64x64 tiles
+        parallel_for_2d(0, 0, width, height, 64, 64, [&] (int x0, int y0, int x1, int y1) {
+            // TODO: process tile
+        });
+
+    */
+
+    namespace detail
+    {
+
+        struct ParallelContext : private NonCopyable
+        {
+            ThreadPool& pool;
+            ConcurrentQueue queue;
+            std::atomic<int> pending { 0 };
+            int grain;
+
+            ParallelContext(int grain)
+                : pool(ThreadPool::getInstance())
+                , queue("parallel", Priority::HIGH)
+                , grain(std::max(grain, 1))
+            {
+            }
+
+            bool split() const
+            {
+                // hand out work only to idle workers which have not been handed a range yet
+                return pending.load(std::memory_order_relaxed) < pool.idle();
+            }
+        };
+
+        template <typename Body>
+        void parallel_body(const Body& body, int begin, int end)
+        {
+            // the ranges are also executed outside of the tasks; release the scratch memory
+            // after each one just like the tasks do
+            ScratchArena::Scope scope(ThreadPool::getScratch());
+            body(begin, end);
+        }
+
+        template <typename Body>
+        void parallel_range(ParallelContext& context, int begin, int end, const Body& body)
+        {
+            while (end - begin > context.grain)
+            {
+                if (context.split())
+                {
+                    const int middle = begin + (end - begin) / 2;
+
+                    ++context.pending;
+                    context.queue.enqueue([&context, &body, middle, end] {
+                        --context.pending;
+                        parallel_range(context, middle, end, body);
+                    });
+
+                    end = middle;
+                }
+                else
+                {
+                    parallel_body(body, begin, begin + context.grain);
+                    begin += context.grain;
+                }
+            }
+
+            if (begin < end)
+            {
+                parallel_body(body, begin, end);
+            }
+        }
+
+    } // namespace detail
+
+    template <typename Func>
+    void parallel_for(int begin, int end, int grain, Func func)
+    {
+        if (end - begin <= std::max(grain, 1))
+        {
+            if (begin < end)
+            {
+                detail::parallel_body(func, begin, end);
+            }
+            return;
+        }
+
+        detail::ParallelContext context(grain);
+        detail::parallel_range(context, begin, end, func);
+        context.queue.wait(WaitMode::SCOPED);
+    }
+
+    template <typename T, typename Func, typename Reduce>
+    T parallel_reduce(int begin, int end, int grain, T identity, Func func, Reduce reduce)
+    {
+        T result = identity;
+        SpinLock lock;
+
+        parallel_for(begin, end, grain, [&] (int i0, int i1) {
+            T value = func(i0, i1);
+            SpinLockGuard guard(lock);
+            result = reduce(result, value);
+        });
+
+        return result;
+    }
+
+    template <typename Func>
+    void parallel_for_2d(int x0, int y0, int x1, int y1, int xgrain, int ygrain, Func func)
+    {
+        xgrain = std::max(xgrain, 1);
+        ygrain = std::max(ygrain, 1);
+
+        const int xtiles = (x1 - x0 + xgrain - 1) / xgrain;
+        const int ytiles = (y1 - y0 + ygrain - 1) / ygrain;
+
+        if (xtiles <= 0 || ytiles <= 0)
+            return;
+
+        // split the tiles in row-major order so that the ranges stay spatially coherent
+        parallel_for(0, xtiles * ytiles, 1, [&] (int i0, int i1) {
+            for (int i = i0; i < i1; ++i)
+            {
+                const int tx = x0 + (i % xtiles) * xgrain;
+                const int ty = y0 + (i / xtiles) * ygrain;
+                func(tx, ty, std::min(tx + xgrain, x1), std::min(ty + ygrain, y1));
+            }
+        });
+    }
+
 } // namespace mango
@@ -0,0 +1,122 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "../core/configure.hpp"
+#include "../core/object.hpp"
+#include "../core/memory.hpp"
+#include "../core/thread.hpp"
+
+namespace mango {
+namespace filesystem {
+
+    // -----------------------------------------------------------------
+    // AsyncFile
+    // -----------------------------------------------------------------
+
+    class AsyncFile : private NonCopyable
+    {
+    protected:
+        friend class AsyncReader;
+
+        std::string m_filename;
+        Memory m_memory;
+        bool m_success { false };
+
+        void allocate(size_t size);
+        void load();
+
+    public:
+        AsyncFile(const std::string& filename);
+        ~AsyncFile();
+
+        const std::string& filename() const;
+
+        // false when the file could not be opened or read
+        bool success() const;
+
+        // memory
+        operator Memory () const;
+        const u8* data() const;
+        size_t size() const;
+    };
+
+    // -----------------------------------------------------------------
+    // AsyncReader
+    // -----------------------------------------------------------------
+
+    /*
+        AsyncReader loads whole files into memory without blocking the calling thread.
+        The callback is executed as a task in the queue as soon as the file has been
+        read, so the decoding of one file overlaps with the reading of the next ones.
+        The file is released when the callback returns.
+
+        On Linux the open, read and close requests of all files are batched through
+        io_uring; one thread of the reader waits for the completions. Elsewhere, or
+        when the kernel does not support io_uring, the files are read in the I/O
+        ThreadPool.
+
+        Usage example:
+
+        ConcurrentQueue q;
+        AsyncReader reader(q);
+
+        for (auto& filename : filenames)
+        {
+            reader.read(filename, [] (AsyncFile& file) {
+                if (file.success())
+                    decode(file);
+            });
+        }
+
+        // wait until the files have been read and decoded
+        q.wait();
+
+        The queue must outlive the reader; the destructor waits until the submitted
+        files have been read.
+    */
+
+    class AsyncReader : private NonCopyable
+    {
+    public:
+        using Callback = std::function<void(AsyncFile& file)>;
+
+    protected:
+        struct Ring;
+        struct Request;
+
+        ConcurrentQueue& m_queue;
+        std::unique_ptr<Ring> m_ring;
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        size_t m_pending { 0 };
+
+        void complete();
+
+    public:
+        // depth is the number of files which are read at the same time with io_uring;
+        // zero reads the files in the I/O ThreadPool
+        AsyncReader(ConcurrentQueue& queue, int depth = 64);
+        ~AsyncReader();
+
+        // read the whole file and call callback(file) in the queue
+        void read(const std::string& filename, Callback callback);
+
+        // block until all submitted files have been read; the callbacks may still be
+        // pending in the queue
+        void wait();
+
+        // true when the files are read with io_uring
+        bool isNative() const;
+    };
+
+} // namespace filesystem
+} // namespace mango
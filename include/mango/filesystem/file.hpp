@@ -19,14 +19,15 @@ namespace filesystem {
     {
     protected:
         std::string m_filename;
-        std::unique_ptr<Path> m_path;
+        std::shared_ptr<Mapper> m_mapper;
         std::unique_ptr<VirtualMemory> m_memory;
 
         Memory getMemory() const;
 
     public:
-        File(const std::string& filename);
-        File(const Path& path, const std::string& filename);
+        // flags are the Mapping access pattern hints of the file
+        File(const std::string& filename, u32 flags = Mapping::DEFAULT);
+        File(const Path& path, const std::string& filename, u32 flags = Mapping::DEFAULT);
         File(const Memory& memory, const std::string& extension, const std::string& filename);
         ~File();
 
@@ -40,22 +41,99 @@ namespace filesystem {
         size_t size() const;
     };
 
+    /*
+        FileStream buffers the sequential reads and writes in buffer_size bytes; writes
+        larger than the buffer and the writev() segments go to the file directly.
+        The DIRECT flag bypasses the operating system page cache when writing, which
+        keeps multi-gigabyte outputs from evicting everything else from the cache.
+        The writes are staged in an aligned buffer; seeking to an unaligned offset
+        or writing an unaligned tail turns the direct mode off for the rest of the
+        stream. The flag is ignored when reading.
+
+        readAt() and writeAt() transfer data at an absolute offset without moving
+        the stream offset and can be called concurrently, for example from the tasks
+        of a ConcurrentQueue. They bypass the stream buffer, so flush() the stream
+        before mixing them with sequential access to the same range. In DIRECT mode
+        the address, offset and size of the positional calls must be aligned to 4 KB.
+    */
+
     class FileStream : public Stream
     {
     protected:
 		struct FileHandle* m_handle;
 
     public:
-        FileStream(const std::string& filename, OpenMode mode);
+        enum Flags
+        {
+            DIRECT = 0x01,
+        };
+
+        FileStream(const std::string& filename, OpenMode mode, size_t buffer_size = 64 * 1024, u32 flags = 0);
         ~FileStream();
 
         const std::string& filename() const;
 
+        // write the buffered data to the file
+        void flush();
+
+        // positional I/O; readAt() returns the number of bytes read, which is less than
+        // the size at the end of the file. It throws on a WRITE stream when the target
+        // only permits writing.
+        size_t readAt(u64 offset, void* dest, size_t size) const;
+        void writeAt(u64 offset, const void* data, size_t size);
+
+        u64 size() const;
+        u64 offset() const;
+        void seek(u64 distance, SeekMode mode);
+        void read(void* dest, size_t size);
+        void write(const void* data, size_t size);
+        void writev(const Memory* segments, size_t count);
+    };
+
+    /*
+        MappedOutputFile writes into a shared memory mapping of the file, so the data
+        goes straight into the page cache without a stream buffer or a write() call.
+        The file is preallocated and mapped in large chunks; when the chunk fills up,
+        the file is extended and remapped with double the size. close() truncates the
+        file to the written size; the destructor calls it but can't report errors.
+
+        The preallocation reports a full disk as an exception when the file grows;
+        on the platforms which can't preallocate, a full disk raises SIGBUS when the
+        mapping is written instead. Only regular files can be mapped; isMappable()
+        tells if the target is one (or doesn't exist yet) and the preallocation is
+        available.
+
+        The large writes and acquire() fault in the pages up front, which is much
+        cheaper than taking one page fault at a time while copying. The memory
+        returned by acquire() is valid until the next write() or acquire() call.
+    */
+
+    class MappedOutputFile : public Stream
+    {
+    protected:
+        struct MappedHandle* m_handle;
+
+    public:
+        // reserve is the expected size of the file
+        MappedOutputFile(const std::string& filename, u64 reserve = 0);
+        ~MappedOutputFile();
+
+        static bool isMappable(const std::string& filename);
+
+        const std::string& filename() const;
+
+        // unmap and truncate the file to the written size; the stream can't be
+        // accessed after this
+        void close();
+
         u64 size() const;
         u64 offset() const;
         void seek(u64 distance, SeekMode mode);
         void read(void* dest, size_t size);
         void write(const void* data, size_t size);
+        void writev(const Memory* segments, size_t count);
+        u8* acquire(size_t size);
+        void commit(size_t size);
     };
 
 } // namespace filesystem
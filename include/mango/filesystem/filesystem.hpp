@@ -7,4 +7,5 @@
 #include "mapper.hpp"
 #include "path.hpp"
 #include "file.hpp"
-#include "fileobserver.hpp"
+#include "fileobserver.hpp"
+#include "asyncreader.hpp"
@@ -88,6 +88,37 @@ namespace filesystem {
         }
     };
 
+    /*
+        Mapping flags describe how a memory mapped file is going to be accessed.
+        They are hints; the platforms which don't support a hint ignore it.
+
+        SEQUENTIAL : the file is read front-to-back; aggressive read-ahead
+        RANDOM     : the file is read in random order; no read-ahead
+        WILLNEED   : start reading the file into the page cache immediately
+        POPULATE   : fault in the whole mapping before mmap() returns
+        HUGEPAGE   : back the mapping with transparent huge pages where possible
+
+        The flags of a file inside a container (ZIP, MGX, RAR) apply to the range
+        of the container mapping that the file occupies. The compressed files are
+        always read sequentially.
+    */
+
+    struct Mapping
+    {
+        enum Flags
+        {
+            DEFAULT    = 0x00,
+            SEQUENTIAL = 0x01,
+            RANDOM     = 0x02,
+            WILLNEED   = 0x04,
+            POPULATE   = 0x08,
+            HUGEPAGE   = 0x10,
+        };
+    };
+
+    // apply the access pattern hints to a range of mapped memory
+    void advise(Memory memory, u32 flags);
+
     class AbstractMapper : protected NonCopyable
     {
     public:
@@ -96,9 +127,36 @@ namespace filesystem {
 
         virtual bool isFile(const std::string& filename) const = 0;
         virtual void getIndex(FileIndex& index, const std::string& pathname) = 0;
-        virtual VirtualMemory* mmap(const std::string& filename) = 0;
+        virtual VirtualMemory* mmap(const std::string& filename, u32 flags = Mapping::DEFAULT) = 0;
+
+        // a key which changes when the file is replaced or modified; the containers
+        // with an identity are shared through the container cache
+        virtual std::string getIdentity(const std::string& filename) const
+        {
+            MANGO_UNREFERENCED_PARAMETER(filename);
+            return std::string();
+        }
     };
 
+    /*
+        The containers (ZIP, MGX, RAR) opened from the filesystem are cached
+        process-wide. Opening more files from the same container reuses the parsed
+        directory and the container mapping as long as the container file has not
+        been modified; the Mapping flags of the first open apply to the mapping.
+
+        The containers which are not used by any Path or File are released in
+        least-recently-used order when the total size of the cached mappings or
+        the number of the cached containers (each holds a file handle) exceeds
+        the limits. The containers in use are never released.
+    */
+
+    void setContainerCacheLimits(u64 memory, size_t handles);
+
+    // release the containers which are not in use
+    void purgeContainerCache();
+
+    struct CachedContainer;
+
     class Mapper : protected NonCopyable
     {
     protected:
@@ -108,8 +166,10 @@ namespace filesystem {
         std::shared_ptr<Mapper> m_parent_mapper;
         VirtualMemory* m_parent_memory { nullptr };
         std::vector<std::unique_ptr<AbstractMapper>> m_mappers;
+        std::vector<std::shared_ptr<CachedContainer>> m_containers;
         std::string m_basepath;
         std::string m_pathname;
+        u32 m_flags { Mapping::DEFAULT };
 
         std::string parse(std::string& pathname, const std::string& password);
         AbstractMapper* createCustomMapper(std::string& pathname, std::string& filename, const std::string& password);
@@ -117,8 +177,9 @@ namespace filesystem {
         AbstractMapper* createFileMapper(const std::string& basepath);
 
     public:
-        Mapper(const std::string& pathname, const std::string& password);
-        Mapper(std::shared_ptr<Mapper> mapper, const std::string& filename, const std::string& password);
+        // flags are the Mapping flags of the container files
+        Mapper(const std::string& pathname, const std::string& password, u32 flags = Mapping::DEFAULT);
+        Mapper(std::shared_ptr<Mapper> mapper, const std::string& filename, const std::string& password, u32 flags = Mapping::DEFAULT);
         Mapper(const Memory& memory, const std::string& extension, const std::string& password);
         ~Mapper();
 
@@ -21,8 +21,9 @@ namespace filesystem {
         FileIndex m_files;
 
     public:
-        Path(const std::string& pathname, const std::string& password = "");
-        Path(const Path& path, const std::string& filename, const std::string& password = "");
+        // flags are the Mapping flags of the containers in the pathname
+        Path(const std::string& pathname, const std::string& password = "", u32 flags = Mapping::DEFAULT);
+        Path(const Path& path, const std::string& filename, const std::string& password = "", u32 flags = Mapping::DEFAULT);
         Path(const Memory& memory, const std::string& extension, const std::string& password = "");
         ~Path();
 
@@ -6,6 +6,8 @@
 
 #include <string>
 #include "../core/object.hpp"
+#include "../core/memory.hpp"
+#include "../core/thread.hpp"
 #include "format.hpp"
 #include "compression.hpp"
 #include "header.hpp"
@@ -26,6 +28,19 @@ namespace mango
         // optional interface
         virtual Exif exif();
         virtual Memory memory(int level, int depth, int face);
+
+        // decoders which support cancellation stop at the next row or block when the
+        // token is cancelled; the contents of the surface are undefined in that case
+        void setCancellationToken(const CancellationToken& token);
+
+        // decoders which support it allocate their temporary buffers from the allocator;
+        // the default is Allocator::getDefault(); services decoding many images can opt
+        // in to PoolAllocator::getInstance() to recycle the buffers
+        void setAllocator(Allocator& allocator);
+
+    protected:
+        CancellationToken m_token { nullptr };
+        Allocator* m_allocator { &Allocator::getDefault() };
     };
 
     class ImageDecoder : protected NonCopyable
@@ -43,6 +58,9 @@ namespace mango
         Memory memory(int level, int depth, int face);
         void decode(Surface& dest, Palette* palette = nullptr, int level = 0, int depth = 0, int face = 0);
 
+        void setCancellationToken(const CancellationToken& token);
+        void setAllocator(Allocator& allocator);
+
     protected:
         ImageDecoderInterface* m_interface;
         bool m_is_decoder;
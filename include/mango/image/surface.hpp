@@ -65,6 +65,13 @@ namespace mango
         ~Bitmap();
 
         Bitmap& operator = (Bitmap&& bitmap);
+
+    private:
+        // size of the image allocated with large_malloc(); zero when the image was
+        // given to the constructor and is owned with new[]
+        size_t m_size { 0 };
+
+        void release();
     };
 
 } // namespace mango
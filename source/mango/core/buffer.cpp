@@ -2,6 +2,8 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
+#include <algorithm>
+#include <cstring>
 #include <mango/core/buffer.hpp>
 #include <mango/core/exception.hpp>
 
@@ -9,6 +11,24 @@
 
 namespace mango {
 
+    static MemoryTag g_buffer_tag("core.buffer");
+
+    static u8* buffer_malloc(size_t bytes)
+    {
+        u8* address = reinterpret_cast<u8*>(large_malloc(bytes));
+        if (!address)
+        {
+            if (bytes)
+            {
+                MANGO_EXCEPTION(ID"Memory allocation failed.");
+            }
+            return nullptr;
+        }
+
+        g_buffer_tag.allocate(bytes);
+        return address;
+    }
+
     Buffer::Buffer()
         : m_memory(nullptr, 0)
         , m_capacity(0)
@@ -17,31 +37,42 @@ namespace mango {
     }
 
     Buffer::Buffer(size_t bytes)
-        : m_memory(new u8[bytes], bytes)
+        : m_memory(buffer_malloc(bytes), bytes)
         , m_capacity(bytes)
         , m_offset(0)
     {
     }
 
     Buffer::Buffer(const u8* address, size_t bytes)
-        : m_memory(new u8[bytes], bytes)
+        : m_memory(buffer_malloc(bytes), bytes)
         , m_capacity(bytes)
         , m_offset(0)
     {
-        std::memcpy(m_memory.address, address, bytes);
+        if (bytes)
+        {
+            std::memcpy(m_memory.address, address, bytes);
+        }
     }
 
     Buffer::Buffer(Memory memory)
-        : m_memory(new u8[memory.size], memory.size)
+        : m_memory(buffer_malloc(memory.size), memory.size)
         , m_capacity(memory.size)
         , m_offset(0)
     {
-        std::memcpy(m_memory.address, memory.address, memory.size);
+        if (memory.size)
+        {
+            std::memcpy(m_memory.address, memory.address, memory.size);
+        }
     }
 
     Buffer::~Buffer()
     {
-        delete[] m_memory.address;
+        if (m_memory.address)
+        {
+            g_buffer_tag.deallocate(m_capacity);
+        }
+
+        large_free(m_memory.address, m_capacity);
     }
 
     size_t Buffer::capacity() const
@@ -53,20 +84,35 @@ namespace mango {
     {
         if (bytes > m_capacity)
         {
-            u8* storage = new u8[bytes];
+            u8* storage = reinterpret_cast<u8*>(large_realloc(m_memory.address, m_capacity, bytes));
+            if (!storage)
+            {
+                MANGO_EXCEPTION(ID"Memory allocation failed.");
+            }
+
             if (m_memory.address)
             {
-                std::memcpy(storage, m_memory.address, m_memory.size);
-                delete[] m_memory.address;
+                g_buffer_tag.deallocate(m_capacity);
             }
+            g_buffer_tag.allocate(bytes);
+
             m_memory.address = storage;
             m_capacity = bytes;
         }
     }
 
+    void Buffer::grow(size_t required)
+    {
+        if (required > m_capacity)
+        {
+            // double the capacity so that appending is amortized constant time
+            reserve(std::max(required, m_capacity * 2));
+        }
+    }
+
     void Buffer::resize(size_t bytes)
     {
-        reserve(bytes);
+        grow(bytes);
         m_memory.size = bytes;
         m_offset = std::min(m_offset, bytes);
     }
@@ -128,16 +174,151 @@ namespace mango {
 
     void Buffer::write(const void* data, size_t bytes)
     {
-        size_t required = m_offset + bytes;
-        if (required > m_capacity)
+        grow(m_offset + bytes);
+
+        std::memcpy(m_memory.address + m_offset, data, bytes);
+        m_offset += bytes;
+        m_memory.size = std::max(m_memory.size, m_offset);
+    }
+
+    void Buffer::writev(const Memory* segments, size_t count)
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i)
         {
-            // grow 1.4x the required capacity
-            reserve((required * 7) / 5);
+            bytes += segments[i].size;
         }
 
-        std::memcpy(m_memory.address + m_offset, data, bytes);
+        grow(m_offset + bytes);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            std::memcpy(m_memory.address + m_offset, segments[i].address, segments[i].size);
+            m_offset += segments[i].size;
+        }
+
+        m_memory.size = std::max(m_memory.size, m_offset);
+    }
+
+    u8* Buffer::acquire(size_t bytes)
+    {
+        grow(m_offset + bytes);
+        return m_memory.address + m_offset;
+    }
+
+    void Buffer::commit(size_t bytes)
+    {
         m_offset += bytes;
         m_memory.size = std::max(m_memory.size, m_offset);
     }
 
+    // -----------------------------------------------------------------
+    // BufferChain
+    // -----------------------------------------------------------------
+
+    BufferChain::BufferChain(size_t chunk_size)
+        : m_chunk_size(chunk_size)
+    {
+    }
+
+    BufferChain::~BufferChain()
+    {
+        for (auto& chunk : m_chunks)
+        {
+            g_buffer_tag.deallocate(chunk.size);
+            large_free(chunk.address, chunk.size);
+        }
+    }
+
+    void BufferChain::append(Memory memory)
+    {
+        if (memory.size)
+        {
+            m_segments.push_back(memory);
+            m_size += memory.size;
+        }
+    }
+
+    const Memory* BufferChain::segments() const
+    {
+        return m_segments.data();
+    }
+
+    size_t BufferChain::count() const
+    {
+        return m_segments.size();
+    }
+
+    void BufferChain::writeTo(Stream& stream) const
+    {
+        stream.writev(m_segments.data(), m_segments.size());
+    }
+
+    u64 BufferChain::size() const
+    {
+        return m_size;
+    }
+
+    u64 BufferChain::offset() const
+    {
+        return m_size;
+    }
+
+    void BufferChain::seek(u64 distance, SeekMode mode)
+    {
+        MANGO_UNREFERENCED_PARAMETER(distance);
+        MANGO_UNREFERENCED_PARAMETER(mode);
+        MANGO_EXCEPTION(ID"BufferChain does not support seeking.");
+    }
+
+    void BufferChain::read(void* dest, size_t bytes)
+    {
+        MANGO_UNREFERENCED_PARAMETER(dest);
+        MANGO_UNREFERENCED_PARAMETER(bytes);
+        MANGO_EXCEPTION(ID"BufferChain does not support reading.");
+    }
+
+    void BufferChain::write(const void* data, size_t bytes)
+    {
+        const u8* source = reinterpret_cast<const u8*>(data);
+
+        while (bytes)
+        {
+            if (m_chunks.empty() || m_chunk_offset == m_chunks.back().size)
+            {
+                const size_t size = std::max(m_chunk_size, bytes);
+                u8* address = reinterpret_cast<u8*>(large_malloc(size));
+                if (!address)
+                {
+                    MANGO_EXCEPTION(ID"Memory allocation failed.");
+                }
+
+                g_buffer_tag.allocate(size);
+                m_chunks.push_back({ address, size });
+                m_chunk_offset = 0;
+            }
+
+            Chunk& chunk = m_chunks.back();
+            u8* dest = chunk.address + m_chunk_offset;
+            const size_t copy = std::min(bytes, chunk.size - m_chunk_offset);
+
+            std::memcpy(dest, source, copy);
+
+            // extend the last segment when it ends where the copy starts
+            if (!m_segments.empty() && m_segments.back().address + m_segments.back().size == dest)
+            {
+                m_segments.back().size += copy;
+            }
+            else
+            {
+                m_segments.push_back(Memory(dest, copy));
+            }
+
+            m_chunk_offset += copy;
+            m_size += copy;
+            source += copy;
+            bytes -= copy;
+        }
+    }
+
 } // namespace mango
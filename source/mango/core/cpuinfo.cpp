@@ -3,8 +3,17 @@
     Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <fstream>
+#include <sstream>
 #include <mango/core/cpuinfo.hpp>
 
+#if defined(MANGO_PLATFORM_LINUX)
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
 namespace
 {
     using namespace mango;
@@ -204,6 +213,183 @@ namespace
         return 0; // unsupported platform
     }
 
+#endif
+
+    // ----------------------------------------------------------------------------
+    // getCPUTopologyInternal()
+    // ----------------------------------------------------------------------------
+
+    CPUTopology getDefaultTopology()
+    {
+        CPUTopology topology;
+
+        CPUTopology::Node node;
+        node.index = 0;
+
+        const int count = std::max(int(std::thread::hardware_concurrency()), 1);
+        for (int i = 0; i < count; ++i)
+        {
+            node.cpus.push_back(i);
+        }
+
+        topology.nodes.push_back(node);
+        return topology;
+    }
+
+#if defined(MANGO_PLATFORM_LINUX)
+
+    // parse kernel list format, for example: "0-7,16-23"
+    std::vector<int> parseList(const std::string& text)
+    {
+        std::vector<int> list;
+
+        std::stringstream stream(text);
+        std::string range;
+
+        while (std::getline(stream, range, ','))
+        {
+            int first = 0;
+            int last = 0;
+
+            const int count = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (count == 1)
+            {
+                last = first;
+            }
+            else if (count != 2)
+            {
+                continue;
+            }
+
+            for (int i = first; i <= last; ++i)
+            {
+                list.push_back(i);
+            }
+        }
+
+        return list;
+    }
+
+    std::string readLine(const std::string& filename)
+    {
+        std::ifstream file(filename);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    CPUTopology getCPUTopologyInternal()
+    {
+        CPUTopology topology;
+
+        const std::string path = "/sys/devices/system/node/";
+
+        for (int index : parseList(readLine(path + "online")))
+        {
+            CPUTopology::Node node;
+            node.index = index;
+            node.cpus = parseList(readLine(path + "node" + std::to_string(index) + "/cpulist"));
+
+            // skip memory-only nodes
+            if (!node.cpus.empty())
+            {
+                topology.nodes.push_back(node);
+            }
+        }
+
+        if (topology.nodes.empty())
+        {
+            // kernel without NUMA support
+            topology = getDefaultTopology();
+        }
+
+        return topology;
+    }
+
+    int getMemoryNodeInternal(const void* address)
+    {
+        // MPOL_F_NODE | MPOL_F_ADDR: node where the page at address is allocated
+        const unsigned long flags = 1 | 2;
+
+        int node = -1;
+        if (syscall(SYS_get_mempolicy, &node, nullptr, 0, address, flags) < 0)
+        {
+            node = -1;
+        }
+
+        return node;
+    }
+
+#elif defined(MANGO_PLATFORM_WINDOWS)
+
+    CPUTopology getCPUTopologyInternal()
+    {
+        CPUTopology topology;
+
+        DWORD size = 0;
+        GetLogicalProcessorInformationEx(RelationNumaNode, nullptr, &size);
+
+        std::vector<u8> buffer(size);
+        if (size && GetLogicalProcessorInformationEx(RelationNumaNode,
+            reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data()), &size))
+        {
+            for (DWORD offset = 0; offset < size; )
+            {
+                auto info = reinterpret_cast<const SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buffer.data() + offset);
+                offset += info->Size;
+
+                if (info->Relationship != RelationNumaNode)
+                    continue;
+
+                // processors are numbered by group, 64 per group
+                const GROUP_AFFINITY& affinity = info->NumaNode.GroupMask;
+
+                CPUTopology::Node node;
+                node.index = int(info->NumaNode.NodeNumber);
+
+                for (int bit = 0; bit < int(sizeof(KAFFINITY) * 8); ++bit)
+                {
+                    if (affinity.Mask & (KAFFINITY(1) << bit))
+                    {
+                        node.cpus.push_back(int(affinity.Group) * 64 + bit);
+                    }
+                }
+
+                if (!node.cpus.empty())
+                {
+                    topology.nodes.push_back(node);
+                }
+            }
+        }
+
+        if (topology.nodes.empty())
+        {
+            topology = getDefaultTopology();
+        }
+
+        return topology;
+    }
+
+    int getMemoryNodeInternal(const void* address)
+    {
+        MANGO_UNREFERENCED_PARAMETER(address);
+        return -1;
+    }
+
+#else
+
+    CPUTopology getCPUTopologyInternal()
+    {
+        // the other platforms don't expose NUMA topology; everything is one node
+        return getDefaultTopology();
+    }
+
+    int getMemoryNodeInternal(const void* address)
+    {
+        MANGO_UNREFERENCED_PARAMETER(address);
+        return -1;
+    }
+
 #endif
 
 } // namespace
@@ -217,4 +403,41 @@ namespace mango
         return flags;
     }
 
+    int CPUTopology::getNode(int cpu) const
+    {
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            const std::vector<int>& cpus = nodes[i].cpus;
+            if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+            {
+                return int(i);
+            }
+        }
+
+        return -1;
+    }
+
+    const CPUTopology& getCPUTopology()
+    {
+        static CPUTopology topology = getCPUTopologyInternal(); // cache the value
+        return topology;
+    }
+
+    int getMemoryNode(const void* address)
+    {
+        const int node = getMemoryNodeInternal(address);
+
+        // translate operating system node number to index in the topology
+        const CPUTopology& topology = getCPUTopology();
+        for (size_t i = 0; i < topology.nodes.size(); ++i)
+        {
+            if (topology.nodes[i].index == node)
+            {
+                return int(i);
+            }
+        }
+
+        return -1;
+    }
+
 } // namespace mango
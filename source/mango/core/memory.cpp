@@ -3,9 +3,16 @@
     Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <cassert>
+#include <cstring>
+#include <mutex>
+#include <deque>
 #include <mango/core/bits.hpp>
 #include <mango/core/memory.hpp>
 
+#if defined(MANGO_PLATFORM_UNIX)
+#include <sys/mman.h>
+#endif
+
 namespace mango {
 
     // -----------------------------------------------------------------------
@@ -127,4 +134,528 @@ namespace mango {
 
 #endif
 
+    // -----------------------------------------------------------------------
+    // large malloc/free
+    // -----------------------------------------------------------------------
+
+    static constexpr size_t large_threshold = 2 * 1024 * 1024;
+    static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+    static inline size_t get_large_size(size_t size)
+    {
+        return (size + huge_page_size - 1) & ~(huge_page_size - 1);
+    }
+
+    static void* large_realloc_copy(void* address, size_t size, size_t new_size)
+    {
+        void* result = large_malloc(new_size);
+        if (!result)
+        {
+            // like realloc(), the old block is left untouched on failure
+            return nullptr;
+        }
+
+        if (address)
+        {
+            std::memcpy(result, address, std::min(size, new_size));
+        }
+
+        large_free(address, size);
+        return result;
+    }
+
+#if defined(MANGO_PLATFORM_UNIX)
+
+    void* large_malloc(size_t size)
+    {
+        if (size < large_threshold)
+        {
+            return aligned_malloc(size, MANGO_DEFAULT_ALIGNMENT);
+        }
+
+        const size_t bytes = get_large_size(size);
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_2MB)
+        // explicit huge pages are available only when they have been reserved by the administrator
+        void* address = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if (address != MAP_FAILED)
+        {
+            return address;
+        }
+#endif
+
+        // over-allocate so that the mapping can be aligned to the huge page size
+        void* base = ::mmap(nullptr, bytes + huge_page_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            return nullptr;
+        }
+
+        u8* start = reinterpret_cast<u8*>(base);
+        u8* aligned = reinterpret_cast<u8*>((reinterpret_cast<uintptr_t>(start) + huge_page_size - 1) & ~uintptr_t(huge_page_size - 1));
+
+        const size_t head = aligned - start;
+        const size_t tail = huge_page_size - head;
+
+        if (head)
+        {
+            ::munmap(start, head);
+        }
+
+        if (tail)
+        {
+            ::munmap(aligned + bytes, tail);
+        }
+
+#if defined(MADV_HUGEPAGE)
+        // transparent huge pages in the "madvise" mode
+        ::madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+
+        return aligned;
+    }
+
+    void large_free(void* address, size_t size)
+    {
+        if (!address)
+            return;
+
+        if (size < large_threshold)
+        {
+            aligned_free(address);
+            return;
+        }
+
+        ::munmap(address, get_large_size(size));
+    }
+
+#if defined(MANGO_PLATFORM_LINUX)
+
+    void* large_realloc(void* address, size_t size, size_t new_size)
+    {
+        if (address && size >= large_threshold && new_size >= large_threshold)
+        {
+            const size_t bytes = get_large_size(size);
+            const size_t new_bytes = get_large_size(new_size);
+
+            if (bytes == new_bytes)
+            {
+                return address;
+            }
+
+            // the kernel moves the page table entries; the data is not copied
+            void* result = ::mremap(address, bytes, new_bytes, MREMAP_MAYMOVE);
+            if (result != MAP_FAILED)
+            {
+#if defined(MADV_HUGEPAGE)
+                ::madvise(result, new_bytes, MADV_HUGEPAGE);
+#endif
+                return result;
+            }
+        }
+
+        return large_realloc_copy(address, size, new_size);
+    }
+
+#endif
+
+#elif defined(MANGO_PLATFORM_WINDOWS)
+
+    // NOTE: large pages (MEM_LARGE_PAGES) require the SeLockMemoryPrivilege so the
+    //       mapping uses the normal page size
+
+    void* large_malloc(size_t size)
+    {
+        if (size < large_threshold)
+        {
+            return aligned_malloc(size, MANGO_DEFAULT_ALIGNMENT);
+        }
+
+        return VirtualAlloc(NULL, get_large_size(size), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+
+    void large_free(void* address, size_t size)
+    {
+        if (!address)
+            return;
+
+        if (size < large_threshold)
+        {
+            aligned_free(address);
+            return;
+        }
+
+        VirtualFree(address, 0, MEM_RELEASE);
+    }
+
+#else
+
+    void* large_malloc(size_t size)
+    {
+        return aligned_malloc(size, MANGO_DEFAULT_ALIGNMENT);
+    }
+
+    void large_free(void* address, size_t size)
+    {
+        MANGO_UNREFERENCED_PARAMETER(size);
+        aligned_free(address);
+    }
+
+#endif
+
+#if !defined(MANGO_PLATFORM_LINUX)
+
+    void* large_realloc(void* address, size_t size, size_t new_size)
+    {
+        return large_realloc_copy(address, size, new_size);
+    }
+
+#endif
+
+    // -----------------------------------------------------------------------
+    // memory tracking
+    // -----------------------------------------------------------------------
+
+#ifdef MANGO_ENABLE_MEMORY_TRACKING
+
+    namespace detail
+    {
+
+        struct MemoryCounter
+        {
+            std::string name;
+            std::atomic<size_t> current { 0 };
+            std::atomic<size_t> peak { 0 };
+            std::atomic<u64> allocations { 0 };
+            std::atomic<u64> deallocations { 0 };
+
+            MemoryCounter(const char* name)
+                : name(name)
+            {
+            }
+        };
+
+    } // namespace detail
+
+    namespace
+    {
+
+        struct MemoryRegistry
+        {
+            std::mutex mutex;
+            std::deque<detail::MemoryCounter> counters;
+        };
+
+        MemoryRegistry& get_memory_registry()
+        {
+            // never destroyed so that static tags can be used during shutdown
+            static MemoryRegistry* registry = new MemoryRegistry;
+            return *registry;
+        }
+
+    } // namespace
+
+    detail::MemoryCounter* MemoryTag::getCounter()
+    {
+        detail::MemoryCounter* counter = m_counter.load(std::memory_order_acquire);
+        if (!counter)
+        {
+            MemoryRegistry& registry = get_memory_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+
+            for (auto& node : registry.counters)
+            {
+                if (node.name == m_name)
+                {
+                    counter = &node;
+                    break;
+                }
+            }
+
+            if (!counter)
+            {
+                registry.counters.emplace_back(m_name);
+                counter = &registry.counters.back();
+            }
+
+            m_counter.store(counter, std::memory_order_release);
+        }
+
+        return counter;
+    }
+
+    void MemoryTag::allocate(size_t size)
+    {
+        detail::MemoryCounter* counter = getCounter();
+
+        const size_t current = counter->current.fetch_add(size, std::memory_order_relaxed) + size;
+        counter->allocations.fetch_add(1, std::memory_order_relaxed);
+
+        size_t peak = counter->peak.load(std::memory_order_relaxed);
+        while (current > peak && !counter->peak.compare_exchange_weak(peak, current, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void MemoryTag::deallocate(size_t size)
+    {
+        detail::MemoryCounter* counter = getCounter();
+
+        counter->current.fetch_sub(size, std::memory_order_relaxed);
+        counter->deallocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::vector<MemoryStatistics> get_memory_statistics()
+    {
+        std::vector<MemoryStatistics> result;
+
+        MemoryRegistry& registry = get_memory_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        for (auto& counter : registry.counters)
+        {
+            MemoryStatistics statistics;
+
+            statistics.tag = counter.name;
+            statistics.current = counter.current.load(std::memory_order_relaxed);
+            statistics.peak = counter.peak.load(std::memory_order_relaxed);
+            statistics.allocations = counter.allocations.load(std::memory_order_relaxed);
+            statistics.deallocations = counter.deallocations.load(std::memory_order_relaxed);
+
+            result.push_back(statistics);
+        }
+
+        std::sort(result.begin(), result.end(), [] (const MemoryStatistics& a, const MemoryStatistics& b)
+        {
+            return a.tag < b.tag;
+        });
+
+        return result;
+    }
+
+    void reset_memory_peaks()
+    {
+        MemoryRegistry& registry = get_memory_registry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        for (auto& counter : registry.counters)
+        {
+            counter.peak.store(counter.current.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+#else
+
+    std::vector<MemoryStatistics> get_memory_statistics()
+    {
+        return std::vector<MemoryStatistics>();
+    }
+
+    void reset_memory_peaks()
+    {
+    }
+
+#endif
+
+    // -----------------------------------------------------------------------
+    // Allocator
+    // -----------------------------------------------------------------------
+
+    namespace
+    {
+
+        class DefaultAllocator : public Allocator
+        {
+        public:
+            void* allocate(size_t size, size_t alignment) override
+            {
+                return aligned_malloc(size, alignment);
+            }
+
+            void deallocate(void* address, size_t size) override
+            {
+                MANGO_UNREFERENCED_PARAMETER(size);
+                aligned_free(address);
+            }
+        };
+
+    } // namespace
+
+    Allocator& Allocator::getDefault()
+    {
+        static DefaultAllocator allocator;
+        return allocator;
+    }
+
+    // -----------------------------------------------------------------------
+    // ArenaAllocator
+    // -----------------------------------------------------------------------
+
+    ArenaAllocator::ArenaAllocator(size_t chunk_size)
+        : m_chunk_size(chunk_size)
+    {
+    }
+
+    ArenaAllocator::~ArenaAllocator()
+    {
+        for (auto& chunk : m_chunks)
+        {
+            aligned_free(chunk.memory);
+        }
+    }
+
+    void* ArenaAllocator::allocate(size_t size, size_t alignment)
+    {
+        for (;;)
+        {
+            if (m_chunk == m_chunks.size())
+            {
+                const size_t bytes = std::max(m_chunk_size, size + alignment);
+                u8* memory = reinterpret_cast<u8*>(aligned_malloc(bytes, MANGO_DEFAULT_ALIGNMENT));
+                if (!memory)
+                {
+                    // the arena is left unchanged so the caller can recover
+                    return nullptr;
+                }
+
+                m_chunks.push_back({ memory, bytes });
+            }
+
+            Chunk& chunk = m_chunks[m_chunk];
+
+            const uintptr_t base = reinterpret_cast<uintptr_t>(chunk.memory);
+            const size_t offset = ((base + m_offset + alignment - 1) & ~uintptr_t(alignment - 1)) - base;
+
+            if (offset + size <= chunk.size)
+            {
+                m_offset = offset + size;
+                return chunk.memory + offset;
+            }
+
+            // continue in the next chunk; the released chunks are reused
+            ++m_chunk;
+            m_offset = 0;
+        }
+    }
+
+    void ArenaAllocator::deallocate(void* address, size_t size)
+    {
+        // the memory is released with the markers
+        MANGO_UNREFERENCED_PARAMETER(address);
+        MANGO_UNREFERENCED_PARAMETER(size);
+    }
+
+    // -----------------------------------------------------------------------
+    // PoolAllocator
+    // -----------------------------------------------------------------------
+
+    int PoolAllocator::getSizeClass(size_t size)
+    {
+        const int bits = size > 1 ? u64_log2(u64_ceil_power_of_two(u64(size))) : 0;
+        return std::max(bits, MinClassBits) - MinClassBits;
+    }
+
+    PoolAllocator::PoolAllocator(size_t capacity)
+        : m_capacity(capacity)
+    {
+    }
+
+    PoolAllocator::~PoolAllocator()
+    {
+        trim();
+    }
+
+    void* PoolAllocator::allocate(size_t size, size_t alignment)
+    {
+        assert(alignment <= MANGO_DEFAULT_ALIGNMENT);
+        MANGO_UNREFERENCED_PARAMETER(alignment);
+
+        const int index = getSizeClass(size);
+        if (index >= ClassCount)
+        {
+            return aligned_malloc(size, MANGO_DEFAULT_ALIGNMENT);
+        }
+
+        SizeClass& sizeclass = m_classes[index];
+        const size_t bytes = size_t(1) << (index + MinClassBits);
+
+        Block* block;
+        {
+            AdaptiveLockGuard guard(sizeclass.lock);
+            block = sizeclass.head;
+            if (block)
+            {
+                sizeclass.head = block->next;
+            }
+        }
+
+        if (block)
+        {
+            m_cached.fetch_sub(bytes, std::memory_order_relaxed);
+            return block;
+        }
+
+        return aligned_malloc(bytes, MANGO_DEFAULT_ALIGNMENT);
+    }
+
+    void PoolAllocator::deallocate(void* address, size_t size)
+    {
+        if (!address)
+            return;
+
+        const int index = getSizeClass(size);
+        if (index >= ClassCount)
+        {
+            aligned_free(address);
+            return;
+        }
+
+        const size_t bytes = size_t(1) << (index + MinClassBits);
+        if (m_cached.fetch_add(bytes, std::memory_order_relaxed) + bytes > m_capacity)
+        {
+            // the pool is full
+            m_cached.fetch_sub(bytes, std::memory_order_relaxed);
+            aligned_free(address);
+            return;
+        }
+
+        SizeClass& sizeclass = m_classes[index];
+        Block* block = reinterpret_cast<Block*>(address);
+
+        AdaptiveLockGuard guard(sizeclass.lock);
+        block->next = sizeclass.head;
+        sizeclass.head = block;
+    }
+
+    void PoolAllocator::trim()
+    {
+        for (int i = 0; i < ClassCount; ++i)
+        {
+            SizeClass& sizeclass = m_classes[i];
+
+            Block* block;
+            {
+                AdaptiveLockGuard guard(sizeclass.lock);
+                block = sizeclass.head;
+                sizeclass.head = nullptr;
+            }
+
+            while (block)
+            {
+                Block* next = block->next;
+                m_cached.fetch_sub(size_t(1) << (i + MinClassBits), std::memory_order_relaxed);
+                aligned_free(block);
+                block = next;
+            }
+        }
+    }
+
+    PoolAllocator& PoolAllocator::getInstance()
+    {
+        static PoolAllocator instance;
+        return instance;
+    }
+
 } // namespace mango
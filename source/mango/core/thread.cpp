@@ -3,12 +3,41 @@
     Copyright (C) 2012-2018 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <chrono>
+#include <ctime>
+#include <climits>
 #include <mango/core/thread.hpp>
+#include <mango/core/memory.hpp>
 #include "../../external/concurrentqueue/concurrentqueue.h"
 
 using std::chrono::high_resolution_clock;
+using std::chrono::steady_clock;
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+
+// ------------------------------------------------------------
+// futex
+// ------------------------------------------------------------
+
+#if defined(MANGO_PLATFORM_LINUX)
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+    static void futex_wait(std::atomic<mango::u32>* address, mango::u32 value, const timespec* timeout = nullptr)
+    {
+        // the timeout is relative
+        syscall(SYS_futex, reinterpret_cast<mango::u32*>(address), FUTEX_WAIT_PRIVATE, value, timeout, nullptr, 0);
+    }
+
+    static void futex_wake(std::atomic<mango::u32>* address, int count)
+    {
+        syscall(SYS_futex, reinterpret_cast<mango::u32*>(address), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+    }
+
+#endif
 
 // ------------------------------------------------------------
 // thread affinity
@@ -17,237 +46,1799 @@ using std::chrono::milliseconds;
 #if defined(MANGO_PLATFORM_LINUX) || defined(MANGO_PLATFORM_BSD)
 
 #include <pthread.h>
+#include <sched.h>
 
-    template <typename H>
-    static void set_thread_affinity(H handle, int processor)
+    static void set_thread_affinity(const std::vector<int>& processors)
     {
         cpu_set_t cpuset;
 
         CPU_ZERO(&cpuset);
-        CPU_SET(processor, &cpuset);
-        pthread_setaffinity_np(handle, sizeof(cpu_set_t), &cpuset);
+        for (int processor : processors)
+        {
+            CPU_SET(processor, &cpuset);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
     }
 
-    static void set_current_thread_affinity(int processor)
+    static std::vector<int> get_process_affinity()
     {
-        set_thread_affinity(pthread_self(), processor);
+        std::vector<int> processors;
+
+#if defined(MANGO_PLATFORM_LINUX)
+        cpu_set_t cpuset;
+
+        CPU_ZERO(&cpuset);
+        if (!sched_getaffinity(0, sizeof(cpu_set_t), &cpuset))
+        {
+            for (int processor = 0; processor < CPU_SETSIZE; ++processor)
+            {
+                if (CPU_ISSET(processor, &cpuset))
+                {
+                    processors.push_back(processor);
+                }
+            }
+        }
+#endif
+
+        return processors;
     }
 
 #elif defined(MANGO_PLATFORM_WINDOWS)
 
-    template <typename H>
-    static void set_thread_affinity(H handle, int processor)
+    static void set_thread_affinity(const std::vector<int>& processors)
     {
-        SetThreadAffinityMask(handle, DWORD_PTR(1) << processor);
+        // TODO: processor groups for more than 64 processors
+        DWORD_PTR mask = 0;
+        for (int processor : processors)
+        {
+            if (processor < 64)
+            {
+                mask |= DWORD_PTR(1) << processor;
+            }
+        }
+        SetThreadAffinityMask(GetCurrentThread(), mask);
     }
 
-    static void set_current_thread_affinity(int processor)
+    static std::vector<int> get_process_affinity()
     {
-        set_thread_affinity(GetCurrentThread(), processor);
+        std::vector<int> processors;
+
+        DWORD_PTR process_mask;
+        DWORD_PTR system_mask;
+        if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+        {
+            for (int processor = 0; processor < int(sizeof(DWORD_PTR) * 8); ++processor)
+            {
+                if (process_mask & (DWORD_PTR(1) << processor))
+                {
+                    processors.push_back(processor);
+                }
+            }
+        }
+
+        return processors;
     }
 
 #else
 
     // TODO: iOS, macOS, Android
 
-    template <typename H>
-    static void set_thread_affinity(H handle, int processor)
-    {
-        MANGO_UNREFERENCED_PARAMETER(handle);
-        MANGO_UNREFERENCED_PARAMETER(processor);
+    static void set_thread_affinity(const std::vector<int>& processors)
+    {
+        MANGO_UNREFERENCED_PARAMETER(processors);
+    }
+
+    static std::vector<int> get_process_affinity()
+    {
+        return std::vector<int>();
+    }
+
+#endif
+
+namespace mango
+{
+
+    // ------------------------------------------------------------
+    // EventCount
+    // ------------------------------------------------------------
+
+    u32 EventCount::prepareWait()
+    {
+        m_waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return m_epoch.load(std::memory_order_seq_cst);
+    }
+
+    void EventCount::cancelWait()
+    {
+        m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+#if defined(MANGO_PLATFORM_LINUX)
+
+    void EventCount::wait(u32 key)
+    {
+        while (m_epoch.load(std::memory_order_acquire) == key)
+        {
+            futex_wait(&m_epoch, key);
+        }
+
+        m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void EventCount::notify(int count)
+    {
+        // pairs with the fence in prepareWait(); either the waiter sees the new state
+        // or we see the waiter
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_seq_cst) > 0)
+        {
+            m_epoch.fetch_add(1, std::memory_order_seq_cst);
+            futex_wake(&m_epoch, count);
+        }
+    }
+
+    void EventCount::wait(u32 key, std::chrono::milliseconds timeout)
+    {
+        const auto deadline = steady_clock::now() + timeout;
+
+        while (m_epoch.load(std::memory_order_acquire) == key)
+        {
+            const auto now = steady_clock::now();
+            if (now >= deadline)
+                break;
+
+            const u64 ns = duration_cast<nanoseconds>(deadline - now).count();
+
+            timespec ts;
+            ts.tv_sec = time_t(ns / 1000000000);
+            ts.tv_nsec = long(ns % 1000000000);
+            futex_wait(&m_epoch, key, &ts);
+        }
+
+        m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void EventCount::notifyAll()
+    {
+        notify(INT_MAX);
+    }
+
+#else
+
+    void EventCount::wait(u32 key)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_epoch.load(std::memory_order_acquire) == key)
+        {
+            m_condition.wait(lock);
+        }
+
+        m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void EventCount::wait(u32 key, std::chrono::milliseconds timeout)
+    {
+        const auto deadline = steady_clock::now() + timeout;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_epoch.load(std::memory_order_acquire) == key)
+        {
+            if (m_condition.wait_until(lock, deadline) == std::cv_status::timeout)
+                break;
+        }
+
+        m_waiters.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    void EventCount::notify(int count)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_seq_cst) > 0)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_epoch.fetch_add(1, std::memory_order_seq_cst);
+            for (int i = 0; i < count; ++i)
+            {
+                m_condition.notify_one();
+            }
+        }
+    }
+
+    void EventCount::notifyAll()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_seq_cst) > 0)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_epoch.fetch_add(1, std::memory_order_seq_cst);
+            m_condition.notify_all();
+        }
+    }
+
+#endif
+
+    // ------------------------------------------------------------
+    // parking
+    // ------------------------------------------------------------
+
+    namespace detail
+    {
+
+#if defined(MANGO_PLATFORM_LINUX)
+
+        void parkWait(std::atomic<u32>* address, u32 expected)
+        {
+            futex_wait(address, expected);
+        }
+
+        void parkWake(std::atomic<u32>* address, int count)
+        {
+            futex_wake(address, count);
+        }
+
+#else
+
+        // threads blocked on addresses hashing to the same bucket share the
+        // condition variable; waking is always broadcast so nobody gets lost
+
+        struct ParkingBucket
+        {
+            std::mutex mutex;
+            std::condition_variable condition;
+        };
+
+        static ParkingBucket& getParkingBucket(const void* address)
+        {
+            static ParkingBucket buckets[64];
+            uintptr_t key = reinterpret_cast<uintptr_t>(address);
+            return buckets[(key >> 4) & 63];
+        }
+
+        void parkWait(std::atomic<u32>* address, u32 expected)
+        {
+            ParkingBucket& bucket = getParkingBucket(address);
+            std::unique_lock<std::mutex> lock(bucket.mutex);
+            if (address->load(std::memory_order_seq_cst) == expected)
+            {
+                bucket.condition.wait(lock);
+            }
+        }
+
+        void parkWake(std::atomic<u32>* address, int count)
+        {
+            MANGO_UNREFERENCED_PARAMETER(count);
+            ParkingBucket& bucket = getParkingBucket(address);
+            std::lock_guard<std::mutex> lock(bucket.mutex);
+            bucket.condition.notify_all();
+        }
+
+#endif
+
+    } // namespace detail
+
+    // ------------------------------------------------------------
+    // AdaptiveLock
+    // ------------------------------------------------------------
+
+    void AdaptiveLock::lockSlow()
+    {
+        detail::Backoff backoff;
+
+        while (backoff.spin())
+        {
+            if (m_state.load(std::memory_order_relaxed) == 0 && tryLock())
+                return;
+        }
+
+        // mark the lock contended so that unlock() wakes us up
+        while (m_state.exchange(2, std::memory_order_acquire) != 0)
+        {
+            detail::parkWait(&m_state, 2);
+        }
+    }
+
+    // ------------------------------------------------------------
+    // ReadWriteLock
+    // ------------------------------------------------------------
+
+    void ReadWriteLock::readLockSlow()
+    {
+        detail::Backoff backoff;
+
+        for (;;)
+        {
+            u32 state = m_state.load(std::memory_order_relaxed);
+
+            if (!(state & WRITER))
+            {
+                if (m_state.compare_exchange_weak(state, state + READER, std::memory_order_acquire))
+                    return;
+                continue;
+            }
+
+            if (backoff.spin())
+                continue;
+
+            if (!(state & PARKED))
+            {
+                if (!m_state.compare_exchange_weak(state, state | PARKED, std::memory_order_relaxed))
+                    continue;
+                state |= PARKED;
+            }
+
+            detail::parkWait(&m_state, state);
+        }
+    }
+
+    void ReadWriteLock::writeLockSlow()
+    {
+        detail::Backoff backoff;
+
+        for (;;)
+        {
+            u32 state = m_state.load(std::memory_order_relaxed);
+
+            if (!(state & ~PARKED))
+            {
+                // keep the PARKED bit; the other waiters are woken up when we unlock
+                if (m_state.compare_exchange_weak(state, state | WRITER, std::memory_order_acquire))
+                    return;
+                continue;
+            }
+
+            if (backoff.spin())
+                continue;
+
+            if (!(state & PARKED))
+            {
+                if (!m_state.compare_exchange_weak(state, state | PARKED, std::memory_order_relaxed))
+                    continue;
+                state |= PARKED;
+            }
+
+            detail::parkWait(&m_state, state);
+        }
+    }
+
+    // ------------------------------------------------------------
+    // TicketReadWriteLock
+    // ------------------------------------------------------------
+
+    void TicketReadWriteLock::waitSlow(std::atomic<u32>& serving, u32 ticket)
+    {
+        detail::Backoff backoff;
+
+        while (serving.load(std::memory_order_acquire) != ticket)
+        {
+            if (backoff.spin())
+                continue;
+
+            m_parked.fetch_add(1, std::memory_order_seq_cst);
+
+            u32 value = serving.load(std::memory_order_seq_cst);
+            if (value != ticket)
+            {
+                detail::parkWait(&serving, value);
+            }
+
+            m_parked.fetch_sub(1, std::memory_order_seq_cst);
+        }
+    }
+
+    // ------------------------------------------------------------
+    // TaskQueue
+    // ------------------------------------------------------------
+
+    struct TaskQueue
+    {
+        using Task = ThreadPool::Task;
+        moodycamel::ConcurrentQueue<Task*> tasks;
+    };
+
+    // ------------------------------------------------------------
+    // DeadlineQueue
+    // ------------------------------------------------------------
+
+    // Tasks with a deadline in earliest deadline first order. The queues are empty most
+    // of the time so the size is checked before taking the lock.
+
+    struct DeadlineQueue
+    {
+        using Task = ThreadPool::Task;
+        using Queue = ThreadPool::Queue;
+
+        SpinLock lock;
+        std::vector<Task*> heap;
+        std::atomic<int> size { 0 };
+
+        static bool compare(const Task* a, const Task* b)
+        {
+            return a->deadline > b->deadline;
+        }
+
+        void push(Task* task)
+        {
+            SpinLockGuard guard(lock);
+            heap.push_back(task);
+            std::push_heap(heap.begin(), heap.end(), compare);
+            ++size;
+        }
+
+        // pop the earliest task; with a scope only if it belongs to the scope
+        Task* pop(const Queue* scope)
+        {
+            if (!size.load(std::memory_order_relaxed))
+                return nullptr;
+
+            SpinLockGuard guard(lock);
+
+            if (heap.empty())
+                return nullptr;
+
+            Task* task = heap.front();
+            if (scope && !task->queue->scoped(scope))
+                return nullptr;
+
+            std::pop_heap(heap.begin(), heap.end(), compare);
+            heap.pop_back();
+            --size;
+            return task;
+        }
+    };
+
+    // ------------------------------------------------------------
+    // TaskDeque
+    // ------------------------------------------------------------
+
+    /*
+        Chase-Lev work-stealing deque. The owning worker pushes and pops tasks
+        at the bottom (LIFO) while other threads steal from the top (FIFO).
+
+        "Dynamic Circular Work-Stealing Deque", Chase & Lev, SPAA 2005
+        "Correct and Efficient Work-Stealing for Weak Memory Models", Le et al., PPoPP 2013
+    */
+
+    class TaskDeque : private NonCopyable
+    {
+    protected:
+        using Task = ThreadPool::Task;
+
+        using Queue = ThreadPool::Queue;
+
+        struct Array
+        {
+            s64 capacity;
+            s64 mask;
+            std::atomic<Task*>* data;
+
+            // the queue of each task; thieves can look at it without touching the
+            // task, which might already be gone. The queues are type-stable.
+            std::atomic<Queue*>* queues;
+
+            Array(s64 capacity)
+                : capacity(capacity)
+                , mask(capacity - 1)
+                , data(new std::atomic<Task*>[capacity])
+                , queues(new std::atomic<Queue*>[capacity])
+            {
+            }
+
+            ~Array()
+            {
+                delete[] data;
+                delete[] queues;
+            }
+
+            Task* get(s64 index) const
+            {
+                return data[index & mask].load(std::memory_order_relaxed);
+            }
+
+            Queue* getQueue(s64 index) const
+            {
+                return queues[index & mask].load(std::memory_order_relaxed);
+            }
+
+            void put(s64 index, Task* task, Queue* queue)
+            {
+                data[index & mask].store(task, std::memory_order_relaxed);
+                queues[index & mask].store(queue, std::memory_order_relaxed);
+            }
+
+            void put(s64 index, Task* task)
+            {
+                put(index, task, task->queue);
+            }
+
+            Array* grow(s64 bottom, s64 top) const
+            {
+                Array* array = new Array(capacity * 2);
+                for (s64 i = top; i < bottom; ++i)
+                {
+                    array->put(i, get(i), getQueue(i));
+                }
+                return array;
+            }
+        };
+
+        // keep owner and thieves on separate cache lines
+        std::atomic<s64> m_top { 0 };
+        char m_padding[64 - sizeof(std::atomic<s64>)];
+        std::atomic<s64> m_bottom { 0 };
+        std::atomic<Array*> m_array;
+
+        // thieves can still be reading from the old arrays
+        std::vector<Array*> m_garbage;
+
+    public:
+        TaskDeque()
+        {
+            m_array.store(new Array(256), std::memory_order_relaxed);
+        }
+
+        ~TaskDeque()
+        {
+            delete m_array.load(std::memory_order_relaxed);
+            for (Array* array : m_garbage)
+            {
+                delete array;
+            }
+        }
+
+        bool empty() const
+        {
+            s64 bottom = m_bottom.load(std::memory_order_relaxed);
+            s64 top = m_top.load(std::memory_order_relaxed);
+            return bottom <= top;
+        }
+
+        // owner only
+        void push(Task* task)
+        {
+            s64 bottom = m_bottom.load(std::memory_order_relaxed);
+            s64 top = m_top.load(std::memory_order_acquire);
+            Array* array = m_array.load(std::memory_order_relaxed);
+
+            if (bottom - top > array->capacity - 1)
+            {
+                m_garbage.push_back(array);
+                array = array->grow(bottom, top);
+                m_array.store(array, std::memory_order_release);
+            }
+
+            array->put(bottom, task);
+            std::atomic_thread_fence(std::memory_order_release);
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+
+        // owner only; the tasks are published at once
+        void push(Task** tasks, size_t count)
+        {
+            s64 bottom = m_bottom.load(std::memory_order_relaxed);
+            s64 top = m_top.load(std::memory_order_acquire);
+            Array* array = m_array.load(std::memory_order_relaxed);
+
+            while (bottom - top + s64(count) > array->capacity)
+            {
+                m_garbage.push_back(array);
+                array = array->grow(bottom, top);
+                m_array.store(array, std::memory_order_release);
+            }
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                array->put(bottom + s64(i), tasks[i]);
+            }
+
+            std::atomic_thread_fence(std::memory_order_release);
+            m_bottom.store(bottom + s64(count), std::memory_order_relaxed);
+        }
+
+        // owner only
+        Task* pop()
+        {
+            s64 bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+            Array* array = m_array.load(std::memory_order_relaxed);
+            m_bottom.store(bottom, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            s64 top = m_top.load(std::memory_order_relaxed);
+
+            Task* task = nullptr;
+
+            if (top <= bottom)
+            {
+                task = array->get(bottom);
+                if (top == bottom)
+                {
+                    // last task; race against thieves
+                    if (!m_top.compare_exchange_strong(top, top + 1,
+                        std::memory_order_seq_cst, std::memory_order_relaxed))
+                    {
+                        task = nullptr;
+                    }
+                    m_bottom.store(bottom + 1, std::memory_order_relaxed);
+                }
+            }
+            else
+            {
+                m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            }
+
+            return task;
+        }
+
+        // any thread
+        Task* steal()
+        {
+            s64 top = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            s64 bottom = m_bottom.load(std::memory_order_acquire);
+
+            Task* task = nullptr;
+
+            if (top < bottom)
+            {
+                Array* array = m_array.load(std::memory_order_acquire);
+                task = array->get(top);
+                if (!m_top.compare_exchange_strong(top, top + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    // lost the race to the owner or another thief
+                    task = nullptr;
+                }
+            }
+
+            return task;
+        }
+
+        // any thread; only steals the oldest task when it belongs to the scope
+        Task* steal(const Queue* scope)
+        {
+            s64 top = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            s64 bottom = m_bottom.load(std::memory_order_acquire);
+
+            Task* task = nullptr;
+
+            if (top < bottom)
+            {
+                Array* array = m_array.load(std::memory_order_acquire);
+                Queue* queue = array->getQueue(top);
+                if (!queue || !queue->scoped(scope))
+                    return nullptr;
+
+                task = array->get(top);
+                if (!m_top.compare_exchange_strong(top, top + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    // lost the race to the owner or another thief
+                    task = nullptr;
+                }
+            }
+
+            return task;
+        }
+    };
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+
+    // ------------------------------------------------------------
+    // profiling
+    // ------------------------------------------------------------
+
+    static inline u64 get_profile_time()
+    {
+        return duration_cast<nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static inline int get_profile_bucket(u64 time)
+    {
+        const u64 us = time / 1000;
+        return us < 2 ? 0 : std::min(15, u32_log2(u32(std::min(us, u64(0xffffffff)))));
+    }
+
+    // queue names are interned so that the trace events outlive the queues
+    static std::mutex g_trace_name_mutex;
+    static std::vector<std::string> g_trace_names;
+
+    static u32 get_trace_name(const std::string& name)
+    {
+        std::lock_guard<std::mutex> lock(g_trace_name_mutex);
+
+        for (size_t i = 0; i < g_trace_names.size(); ++i)
+        {
+            if (g_trace_names[i] == name)
+                return u32(i);
+        }
+
+        g_trace_names.push_back(name);
+        return u32(g_trace_names.size() - 1);
+    }
+
+    struct ThreadPool::TraceBuffer
+    {
+        struct Event
+        {
+            u64 begin;
+            u64 end;
+            u32 name;
+        };
+
+        // ring buffer; the oldest events are overwritten
+        static constexpr u64 capacity = 1 << 14;
+
+        std::unique_ptr<Event[]> events;
+        std::atomic<u64> count { 0 };
+
+        void allocate()
+        {
+            if (!events)
+            {
+                events.reset(new Event[capacity]);
+            }
+        }
+
+        void record(u64 begin, u64 end, u32 name)
+        {
+            const u64 index = count.load(std::memory_order_relaxed);
+            Event& event = events[index & (capacity - 1)];
+            event.begin = begin;
+            event.end = end;
+            event.name = name;
+            count.store(index + 1, std::memory_order_release);
+        }
+    };
+
+#endif
+
+    // ------------------------------------------------------------
+    // Worker
+    // ------------------------------------------------------------
+
+    struct ThreadPool::Worker
+    {
+        ThreadPool* pool { nullptr };
+        int index { -1 };
+        int node { -1 };
+        u32 seed { 0 };
+        TaskDeque deques[3];
+
+        // processors of the node the worker is pinned to; empty when not pinned
+        std::vector<int> processors;
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        TraceBuffer trace;
+#endif
+
+        u32 random()
+        {
+            // xorshift32
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return seed;
+        }
+    };
+
+    struct WorkerContext
+    {
+        // worker executing on the current thread; null for non-pool threads
+        ThreadPool::Worker* worker;
+
+        // queue of the task executing on the current thread
+        ThreadPool::Queue* queue;
+    };
+
+    static thread_local WorkerContext g_context = { nullptr, nullptr };
+
+    // ------------------------------------------------------------
+    // ThreadPool
+    // ------------------------------------------------------------
+
+    static ThreadPool::Config g_instance_config;
+    static std::atomic<bool> g_instance_created { false };
+
+    static ThreadPool::Config g_io_instance_config;
+    static std::atomic<bool> g_io_instance_created { false };
+
+    ThreadPool::ThreadPool(size_t size)
+        : m_queue_cache(32)
+    {
+        Config config;
+        config.size = int(size);
+        initialize(config);
+    }
+
+    ThreadPool::ThreadPool(const Config& config)
+        : m_queue_cache(32)
+    {
+        initialize(config);
+    }
+
+    void ThreadPool::initialize(const Config& config)
+    {
+        const CPUTopology& topology = getCPUTopology();
+
+        // processors of each node which we are allowed to run on; a taskset or cpuset
+        // mask must not be widened by pinning the workers
+        const std::vector<int> allowed = get_process_affinity();
+
+        std::vector<std::vector<int>> node_processors;
+        std::vector<int> processors;
+        int allowed_nodes = 0;
+
+        for (auto& node : topology.nodes)
+        {
+            std::vector<int> cpus;
+            for (int cpu : node.cpus)
+            {
+                if (allowed.empty() || std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+
+            allowed_nodes += !cpus.empty();
+            processors.insert(processors.end(), cpus.begin(), cpus.end());
+            node_processors.push_back(cpus);
+        }
+
+        // NUMA awareness only makes a difference with more than one node
+        m_node_count = config.numa && allowed_nodes > 1 ? int(topology.nodes.size()) : 0;
+        m_spin_budget = std::max(config.spin, 0);
+
+        size_t size = config.size;
+        if (!size)
+        {
+            size = std::max(std::thread::hardware_concurrency(), 1U);
+            if (m_node_count)
+            {
+                // one worker per processor we are pinning them to
+                size = processors.size();
+            }
+        }
+
+        m_queues = new TaskQueue[3];
+        m_deadline_queues = new DeadlineQueue[3];
+        m_node_queues = m_node_count ? new TaskQueue[m_node_count * 3] : nullptr;
+        m_workers = new Worker[size];
+        m_threads.resize(size);
+        m_static_queue = createQueue("static", int(Priority::NORMAL));
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        m_external_trace = new TraceBuffer();
+#endif
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            m_workers[i].pool = this;
+            m_workers[i].index = int(i);
+            m_workers[i].seed = u32(i * 0x9e3779b9 + 1);
+
+            if (m_node_count)
+            {
+                // spread the workers over the nodes in proportion to the processors
+                int processor = processors[i * processors.size() / size];
+                m_workers[i].node = topology.getNode(processor);
+                m_workers[i].processors = node_processors[m_workers[i].node];
+            }
+        }
+
+        // NOTE: without NUMA we let OS scheduler shuffle tasks as it sees fit; this gives
+        //       better performance overall than pinning workers to individual processors.
+        //       With NUMA the workers pin themselves to their node before processing any
+        //       tasks so that the memory they touch first is allocated close to them.
+        for (size_t i = 0; i < size; ++i)
+        {
+            m_threads[i] = std::thread([this, i] {
+                thread(i);
+            });
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        m_stop = true;
+        m_event.notifyAll();
+
+        for (auto& thread : m_threads)
+        {
+            thread.join();
+        }
+
+        // discard tasks which were never processed
+        const size_t size = m_threads.size();
+        for (int priority = 0; priority < 3; ++priority)
+        {
+            Task* task;
+            while (m_queues[priority].tasks.try_dequeue(task))
+            {
+                destroyTask(task);
+            }
+
+            while ((task = m_deadline_queues[priority].pop(nullptr)) != nullptr)
+            {
+                destroyTask(task);
+            }
+
+            for (int node = 0; node < m_node_count; ++node)
+            {
+                while (m_node_queues[node * 3 + priority].tasks.try_dequeue(task))
+                {
+                    destroyTask(task);
+                }
+            }
+
+            for (size_t i = 0; i < size; ++i)
+            {
+                while ((task = m_workers[i].deques[priority].steal()) != nullptr)
+                {
+                    destroyTask(task);
+                }
+            }
+        }
+
+        deleteQueue(m_static_queue);
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        delete m_external_trace;
+#endif
+
+        delete[] m_workers;
+        delete[] m_node_queues;
+        delete[] m_deadline_queues;
+        delete[] m_queues;
+    }
+
+    void ThreadPool::configure(const Config& config)
+    {
+        if (g_instance_created)
+        {
+            MANGO_EXCEPTION("[ThreadPool] Instance is already created.");
+        }
+
+        g_instance_config = config;
+    }
+
+    ThreadPool& ThreadPool::getInstance()
+    {
+        static ThreadPool instance(g_instance_config);
+        g_instance_created = true;
+        return instance;
+    }
+
+    void ThreadPool::configureIO(const Config& config)
+    {
+        if (g_io_instance_created)
+        {
+            MANGO_EXCEPTION("[ThreadPool] I/O instance is already created.");
+        }
+
+        g_io_instance_config = config;
+    }
+
+    ThreadPool& ThreadPool::getIOInstance()
+    {
+        static ThreadPool instance([] {
+            Config config = g_io_instance_config;
+            if (!config.size)
+            {
+                // the workers are blocked most of the time; oversubscribe the processors
+                config.size = int(std::max(std::thread::hardware_concurrency(), 1U) * 4);
+            }
+
+            // blocked I/O workers should not burn CPU looking for work
+            config.spin = 0;
+            return config;
+        } ());
+
+        g_io_instance_created = true;
+        return instance;
+    }
+
+    int ThreadPool::getInstanceSize()
+    {
+        ThreadPool& pool = getInstance();
+        return pool.size();
+    }
+
+    int ThreadPool::size() const
+    {
+        return int(m_threads.size());
+    }
+
+    int ThreadPool::idle() const
+    {
+        return m_idle_count.load(std::memory_order_relaxed);
+    }
+
+    int ThreadPool::nodes() const
+    {
+        return m_node_count;
+    }
+
+    void ThreadPool::setSpinBudget(int microseconds)
+    {
+        m_spin_budget = std::max(0, microseconds);
+    }
+
+    int ThreadPool::getWorkerIndex() const
+    {
+        Worker* worker = getCurrentWorker();
+        return worker ? worker->index : -1;
+    }
+
+    ScratchArena& ThreadPool::getScratch()
+    {
+        static thread_local ScratchArena arena;
+        return arena;
+    }
+
+    ThreadPool::Worker* ThreadPool::getCurrentWorker() const
+    {
+        Worker* worker = g_context.worker;
+        return worker && worker->pool == this ? worker : nullptr;
+    }
+
+    void ThreadPool::thread(size_t threadID)
+    {
+        if (!m_workers[threadID].processors.empty())
+        {
+            set_thread_affinity(m_workers[threadID].processors);
+        }
+
+        g_context.worker = &m_workers[threadID];
+
+        auto time0 = high_resolution_clock::now();
+        bool idle = false;
+
+        while (!m_stop.load(std::memory_order_relaxed))
+        {
+            Task* task = dequeue();
+            if (task)
+            {
+                if (idle)
+                {
+                    idle = false;
+                    --m_idle_count;
+                }
+
+                process(task);
+
+                // remember the last time we processed a task
+                time0 = high_resolution_clock::now();
+            }
+            else
+            {
+                if (!idle)
+                {
+                    idle = true;
+                    ++m_idle_count;
+                }
+
+                // don't be too eager to sleep
+                auto time1 = high_resolution_clock::now();
+                auto elapsed = duration_cast<microseconds>(time1 - time0).count();
+                if (elapsed < m_spin_budget.load(std::memory_order_relaxed))
+                {
+                    // no work; yield and try again soon
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                // announce that we are going to sleep and look for work one more time;
+                // a task enqueued after this point will wake us up
+                u32 key = m_event.prepareWait();
+
+                task = dequeue();
+                if (task || m_stop.load(std::memory_order_relaxed))
+                {
+                    m_event.cancelWait();
+                    if (task)
+                    {
+                        idle = false;
+                        --m_idle_count;
+                        process(task);
+                        time0 = high_resolution_clock::now();
+                    }
+                    continue;
+                }
+
+                m_event.wait(key);
+
+                // spin again before going back to sleep
+                time0 = high_resolution_clock::now();
+            }
+        }
+
+        if (idle)
+        {
+            --m_idle_count;
+        }
+
+        g_context.worker = nullptr;
+    }
+
+    ThreadPool::Task* ThreadPool::createTask()
+    {
+        return new (detail::BlockCache<sizeof(Task)>::allocate()) Task();
+    }
+
+    void ThreadPool::destroyTask(Task* task)
+    {
+        task->~Task();
+        detail::BlockCache<sizeof(Task)>::release(task);
+    }
+
+    void ThreadPool::enqueue(Queue* queue, TaskFunction&& func, int node)
+    {
+        Task* task = createTask();
+        task->queue = queue;
+        task->stamp = queue->task_input_count++;
+        task->func = std::move(func);
+
+        submit(task, node);
+    }
+
+    void ThreadPool::submit(Task* task, int node)
+    {
+        Queue* queue = task->queue;
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        task->time = m_profiling.load(std::memory_order_relaxed) ? get_profile_time() : 0;
+#endif
+
+        if (node < 0 || node >= m_node_count)
+        {
+            // no hint or the pool is not NUMA aware
+            node = -1;
+        }
+
+        Worker* worker = getCurrentWorker();
+        if (worker && (node < 0 || node == worker->node))
+        {
+            // submitted from a worker; keep the task local until it is stolen
+            worker->deques[queue->priority].push(task);
+        }
+        else if (node >= 0)
+        {
+            m_node_queues[node * 3 + queue->priority].tasks.enqueue(task);
+        }
+        else
+        {
+            m_queues[queue->priority].tasks.enqueue(task);
+        }
+
+        // wake up one sleeping worker for the new task
+        m_event.notify(1);
+        signal(queue);
+    }
+
+    void ThreadPool::enqueueDeadline(Queue* queue, TaskFunction&& func, u64 deadline)
+    {
+        Task* task = createTask();
+        task->queue = queue;
+        task->stamp = queue->task_input_count++;
+        task->deadline = deadline;
+        task->func = std::move(func);
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        task->time = m_profiling.load(std::memory_order_relaxed) ? get_profile_time() : 0;
+#endif
+
+        m_deadline_queues[queue->priority].push(task);
+        m_event.notify(1);
+        signal(queue);
+    }
+
+    void ThreadPool::submit(Task** tasks, size_t count)
+    {
+        Queue* queue = tasks[0]->queue;
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        const u64 time = m_profiling.load(std::memory_order_relaxed) ? get_profile_time() : 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            tasks[i]->time = time;
+        }
+#endif
+
+        Worker* worker = getCurrentWorker();
+        if (worker)
+        {
+            worker->deques[queue->priority].push(tasks, count);
+        }
+        else
+        {
+            m_queues[queue->priority].tasks.enqueue_bulk(tasks, count);
+        }
+    }
+
+    void ThreadPool::handoff(Queue* queue, TaskFunction&& io, TaskFunction&& func)
+    {
+        // the continuation is counted into the queue right away so that waiting for
+        // the queue also waits for the I/O
+        Task* task = createTask();
+        task->queue = queue;
+        task->stamp = queue->task_input_count++;
+        task->func = std::move(func);
+
+        ThreadPool& pool = getIOInstance();
+
+        pool.enqueue(pool.m_static_queue, [this, task, io = std::move(io)] () mutable {
+            if (task->stamp > task->queue->stamp_cancel)
+            {
+                io();
+            }
+
+            // process() skips the continuation if the queue was cancelled meanwhile
+            submit(task, -1);
+        });
+    }
+
+    TaskFunction ThreadPool::defer(Queue* queue, TaskFunction&& func)
+    {
+        Task* task = createTask();
+        task->queue = queue;
+        task->stamp = queue->task_input_count++;
+        task->func = std::move(func);
+
+        return [this, task] {
+            submit(task, -1);
+        };
+    }
+
+    ThreadPool::Task* ThreadPool::steal(int priority, Worker* worker, const Queue* scope)
+    {
+        const u32 size = u32(m_threads.size());
+
+        // pick a random victim and sweep from there
+        u32 start;
+        if (worker)
+        {
+            start = worker->random();
+        }
+        else
+        {
+            static std::atomic<u32> counter { 0 };
+            start = counter.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // the first pass only visits workers on our own NUMA node
+        const bool local = m_node_count && worker;
+
+        for (int pass = local ? 0 : 1; pass < 2; ++pass)
+        {
+            for (u32 i = 0; i < size; ++i)
+            {
+                Worker& victim = m_workers[(start + i) % size];
+                if (&victim == worker || victim.deques[priority].empty())
+                    continue;
+
+                if (local && (victim.node == worker->node) != (pass == 0))
+                    continue;
+
+                Task* task = scope ? victim.deques[priority].steal(scope) : victim.deques[priority].steal();
+                if (task)
+                {
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+                    if (m_profiling.load(std::memory_order_relaxed))
+                    {
+                        ++task->queue->profile.steals;
+                    }
+#endif
+                    return task;
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    ThreadPool::Task* ThreadPool::inject(int priority, Worker* worker)
+    {
+        Task* task = nullptr;
+
+        // tasks hinted to our node
+        if (worker && worker->node >= 0)
+        {
+            if (m_node_queues[worker->node * 3 + priority].tasks.try_dequeue(task))
+                return task;
+        }
+
+        if (m_queues[priority].tasks.try_dequeue(task))
+            return task;
+
+        // tasks hinted to other nodes; better here than not at all
+        for (int node = 0; node < m_node_count; ++node)
+        {
+            if (worker && worker->node == node)
+                continue;
+
+            if (m_node_queues[node * 3 + priority].tasks.try_dequeue(task))
+                return task;
+        }
+
+        return nullptr;
+    }
+
+    void ThreadPool::process(Task* task)
+    {
+        Queue* queue = task->queue;
+
+        bool execute = task->stamp > queue->stamp_cancel && !queue->token.cancelled();
+
+        if (execute && task->deadline)
+        {
+            if (CancellationToken::getTime(CancellationToken::Clock::now()) > task->deadline)
+            {
+                ++queue->expired_count;
+                execute = false;
+            }
+        }
+
+        // check if the task is cancelled
+        if (execute)
+        {
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+            const bool profiling = m_profiling.load(std::memory_order_acquire);
+            const u64 begin = profiling ? get_profile_time() : 0;
+#endif
+
+            // the queue and its ancestors see that they are making progress; the chain
+            // is remembered because a recycled ancestor can be given a new parent
+            Queue* chain[16];
+            int depth = 0;
+            for (Queue* q = queue; q && depth < 16; q = q->parent.load(std::memory_order_relaxed))
+            {
+                ++q->task_active_count;
+                chain[depth++] = q;
+            }
+
+            // process task
+            Queue* previous = g_context.queue;
+            g_context.queue = queue;
+            {
+                ScratchArena::Scope scope(getScratch());
+                task->func();
+            }
+            g_context.queue = previous;
+
+            while (depth > 0)
+            {
+                --chain[--depth]->task_active_count;
+            }
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+            if (profiling)
+            {
+                profile(task, begin, get_profile_time());
+            }
+#endif
+        }
+
+        destroyTask(task);
+
+        ++queue->task_complete_count;
+
+        // the queue can be recycled as soon as the task is counted as completed; the
+        // worst that can happen is a spurious wakeup since the queues are type-stable
+        signal(queue);
+    }
+
+    void ThreadPool::signal(Queue* queue)
+    {
+        // wake up the threads waiting for the queue or any of its ancestors
+        for (int depth = 0; queue && depth < 16; ++depth)
+        {
+            queue->event.notifyAll();
+            queue = queue->parent.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool ThreadPool::pending() const
+    {
+        for (int priority = 0; priority < 3; ++priority)
+        {
+            if (m_queues[priority].tasks.size_approx() > 0 ||
+                m_deadline_queues[priority].size.load(std::memory_order_relaxed) > 0)
+            {
+                return true;
+            }
+        }
+
+        for (int i = 0; i < m_node_count * 3; ++i)
+        {
+            if (m_node_queues[i].tasks.size_approx() > 0)
+                return true;
+        }
+
+        for (size_t i = 0; i < m_threads.size(); ++i)
+        {
+            for (int priority = 0; priority < 3; ++priority)
+            {
+                if (!m_workers[i].deques[priority].empty())
+                    return true;
+            }
+        }
+
+        return false;
+    }
+
+    ThreadPool::Task* ThreadPool::dequeue()
+    {
+        Worker* worker = getCurrentWorker();
+
+        // scan task queues in priority order
+        for (int priority = 0; priority < 3; ++priority)
+        {
+            // tasks with a deadline go ahead of the backlog
+            Task* task = m_deadline_queues[priority].pop(nullptr);
+
+            if (!task && worker)
+            {
+                task = worker->deques[priority].pop();
+            }
+
+            if (!task)
+            {
+                task = inject(priority, worker);
+            }
+
+            if (!task)
+            {
+                task = steal(priority, worker);
+            }
+
+            if (task)
+            {
+                return task;
+            }
+        }
+
+        return nullptr;
+    }
+
+    ThreadPool::Task* ThreadPool::dequeue(Queue* scope)
+    {
+        // Our own deque is searched from the bottom and the foreign tasks are pushed back
+        // in the original order. The other deques are only stolen from when the oldest
+        // task belongs to the scope. The injection queues cannot be inspected before a
+        // task is removed so the foreign tasks go back into the queue they came from.
+        const int limit = 4;
+
+        Worker* worker = getCurrentWorker();
+
+        Task* foreign[limit];
+        int count;
+
+        for (int priority = 0; priority < 3; ++priority)
+        {
+            Task* result = m_deadline_queues[priority].pop(scope);
+
+            if (worker && !result)
+            {
+                count = 0;
+                while (count < limit)
+                {
+                    Task* task = worker->deques[priority].pop();
+                    if (!task)
+                        break;
+
+                    if (task->queue->scoped(scope))
+                    {
+                        result = task;
+                        break;
+                    }
+
+                    foreign[count++] = task;
+                }
+
+                while (count > 0)
+                {
+                    worker->deques[priority].push(foreign[--count]);
+                }
+            }
+
+            if (!result)
+            {
+                result = steal(priority, worker, scope);
+            }
+
+            for (int node = -1; node < m_node_count && !result; ++node)
+            {
+                TaskQueue& queue = node < 0 ? m_queues[priority] : m_node_queues[node * 3 + priority];
+
+                count = 0;
+                while (count < limit)
+                {
+                    Task* task;
+                    if (!queue.tasks.try_dequeue(task))
+                        break;
+
+                    if (task->queue->scoped(scope))
+                    {
+                        result = task;
+                        break;
+                    }
+
+                    foreign[count++] = task;
+                }
+
+                if (count > 0)
+                {
+                    // a worker might have found the queue empty meanwhile
+                    queue.tasks.enqueue_bulk(foreign, count);
+                    m_event.notify(count);
+                }
+            }
+
+            if (result)
+            {
+                return result;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void ThreadPool::wait(Queue* queue, WaitMode mode)
+    {
+        auto time0 = high_resolution_clock::now();
+
+        // the scope makes progress while its completion count advances
+        int progress = queue->task_complete_count;
+
+        // NOTE: we might be waiting here a while if other threads keep enqueuing tasks
+        for (;;)
+        {
+            Task* task = nullptr;
+
+            if (mode == WaitMode::SCOPED)
+            {
+                // announce ourselves before looking so that a completion or a new task
+                // in the scope cannot slip past
+                u32 key = queue->event.prepareWait();
+
+                if (queue->task_complete_count >= queue->task_input_count)
+                {
+                    queue->event.cancelWait();
+                    break;
+                }
+
+                task = dequeue(queue);
+
+                if (!task)
+                {
+                    const int complete = queue->task_complete_count;
+                    if (complete != progress)
+                    {
+                        progress = complete;
+                        time0 = high_resolution_clock::now();
+                    }
+
+                    const bool busy = pending();
+                    const auto elapsed = high_resolution_clock::now() - time0;
+
+                    if (!busy)
+                    {
+                        // everything in the scope is being processed; the completions
+                        // wake us up
+                        ++queue->wait_park_count;
+                        queue->event.wait(key);
+                        continue;
+                    }
+
+                    if (elapsed < milliseconds(100) || queue->task_active_count > 0)
+                    {
+                        // the tasks we are passing over might be holding up ours; a task
+                        // of the scope which is still running is progress, however long
+                        const auto timeout = elapsed < milliseconds(100) ? milliseconds(100) - elapsed : milliseconds(100);
+                        ++queue->wait_park_count;
+                        queue->event.wait(key, duration_cast<milliseconds>(timeout));
+                        continue;
+                    }
+
+                    // the scope has not moved for a long time and none of its tasks are
+                    // running; every thread in the pool might be waiting for tasks we
+                    // are holding up so help with anything
+                    task = dequeue();
+                }
+
+                queue->event.cancelWait();
+            }
+            else
+            {
+                if (queue->task_complete_count >= queue->task_input_count)
+                    break;
+
+                task = dequeue();
+            }
+
+            if (task)
+            {
+                if (task->queue->scoped(queue))
+                {
+                    ++queue->wait_local_count;
+                }
+                else
+                {
+                    ++queue->wait_foreign_count;
+                }
+
+                process(task);
+                time0 = high_resolution_clock::now();
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
     }
 
-    static void set_current_thread_affinity(int processor)
+    QueueStatistics ThreadPool::getStatistics(const Queue* queue) const
     {
-        MANGO_UNREFERENCED_PARAMETER(processor);
-    }
+        QueueStatistics stats;
 
-#endif
-
-// MinGW usually uses winpthreads as std::thread backend, so we need
-// to convert winpthreads' pthread_t to Win32 HANDLE.
-#if defined(__WINPTHREADS_VERSION)
+        stats.wait_local = queue->wait_local_count.load(std::memory_order_relaxed);
+        stats.wait_foreign = queue->wait_foreign_count.load(std::memory_order_relaxed);
+        stats.wait_park = queue->wait_park_count.load(std::memory_order_relaxed);
+        stats.enqueued = u32(queue->task_input_count.load(std::memory_order_relaxed));
+        stats.completed = u32(queue->task_complete_count.load(std::memory_order_relaxed));
+        stats.expired = queue->expired_count.load(std::memory_order_relaxed);
 
-#include <pthread.h>
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        const Profile& profile = queue->profile;
 
-    static auto get_native_handle(std::thread& t)
-    {
-        // Note: this function is documented as private.
-        return pthread_gethandle(t.native_handle());
-    }
+        stats.steals = profile.steals.load(std::memory_order_relaxed);
+        stats.wait_time = profile.wait_time.load(std::memory_order_relaxed);
+        stats.exec_time = profile.exec_time.load(std::memory_order_relaxed);
 
+        for (int i = 0; i < 16; ++i)
+        {
+            stats.wait_histogram[i] = profile.wait_histogram[i].load(std::memory_order_relaxed);
+            stats.exec_histogram[i] = profile.exec_histogram[i].load(std::memory_order_relaxed);
+        }
 #else
+        stats.steals = 0;
+        stats.wait_time = 0;
+        stats.exec_time = 0;
 
-    static auto get_native_handle(std::thread& t)
-    {
-        return t.native_handle();
-    }
-
+        for (int i = 0; i < 16; ++i)
+        {
+            stats.wait_histogram[i] = 0;
+            stats.exec_histogram[i] = 0;
+        }
 #endif
 
-namespace mango
-{
+        return stats;
+    }
 
-    // ------------------------------------------------------------
-    // TaskQueue
-    // ------------------------------------------------------------
+#ifdef MANGO_ENABLE_THREAD_PROFILE
 
-    struct TaskQueue
+    void ThreadPool::profile(Task* task, u64 begin, u64 end)
     {
-        using Task = ThreadPool::Task;
-        moodycamel::ConcurrentQueue<Task> tasks;
-    };
+        Profile& profile = task->queue->profile;
 
-    // ------------------------------------------------------------
-    // ThreadPool
-    // ------------------------------------------------------------
+        if (task->time)
+        {
+            const u64 wait = begin > task->time ? begin - task->time : 0;
+            profile.wait_time += wait;
+            ++profile.wait_histogram[get_profile_bucket(wait)];
+        }
 
-    ThreadPool::ThreadPool(size_t size)
-        : m_queue_cache(32)
-        , m_queues(nullptr)
-        , m_threads(size)
-    {
-        m_queues = new TaskQueue[3];
-        m_static_queue = createQueue("static", int(Priority::NORMAL));
+        profile.exec_time += end - begin;
+        ++profile.exec_histogram[get_profile_bucket(end - begin)];
 
-        // NOTE: let OS scheduler shuffle tasks as it sees fit
-        //       this gives better performance overall UNTIL we have some practical
-        //       use for the affinity (eg. dependent tasks using same cache)
-        const bool affinity = false;//std::thread::hardware_concurrency() > 1;
-		if (affinity)
+        Worker* worker = getCurrentWorker();
+        if (worker)
         {
-            set_current_thread_affinity(0);
+            worker->trace.record(begin, end, profile.name);
         }
-
-        for (size_t i = 0; i < size; ++i)
+        else
         {
-            m_threads[i] = std::thread([this, i] {
-                thread(i);
-            });
-
-			if (affinity)
-            {
-                set_thread_affinity(get_native_handle(m_threads[i]), int(i + 1));
-            }
+            SpinLockGuard guard(m_trace_lock);
+            m_external_trace->record(begin, end, profile.name);
         }
     }
 
-    ThreadPool::~ThreadPool()
+    void ThreadPool::setProfiling(bool enable)
     {
-        m_stop = true;
-        m_condition.notify_all();
-
-        for (auto& thread : m_threads)
+        if (enable)
         {
-            thread.join();
+            SpinLockGuard guard(m_trace_lock);
+
+            // the buffers are allocated before the workers can see the flag
+            for (size_t i = 0; i < m_threads.size(); ++i)
+            {
+                m_workers[i].trace.allocate();
+            }
+
+            m_external_trace->allocate();
         }
 
-        deleteQueue(m_static_queue);
-        delete[] m_queues;
+        m_profiling.store(enable, std::memory_order_release);
     }
 
-    ThreadPool& ThreadPool::getInstance()
+    std::string ThreadPool::getTrace() const
     {
-        static ThreadPool instance(std::max(std::thread::hardware_concurrency() - 0, 1U));
-        return instance;
-    }
+        std::vector<std::string> names;
+        {
+            std::lock_guard<std::mutex> lock(g_trace_name_mutex);
+            names = g_trace_names;
+        }
 
-    int ThreadPool::getInstanceSize()
-    {
-        ThreadPool& pool = getInstance();
-        return pool.size();
-    }
+        // collect the buffers; the external threads are shown as the last thread
+        const size_t size = m_threads.size();
 
-    int ThreadPool::size() const
-    {
-        return int(m_threads.size());
-    }
+        std::vector<const TraceBuffer*> buffers;
+        for (size_t i = 0; i < size; ++i)
+        {
+            buffers.push_back(&m_workers[i].trace);
+        }
+        buffers.push_back(m_external_trace);
 
-    void ThreadPool::thread(size_t threadID)
-    {
-        auto time0 = high_resolution_clock::now();
+        u64 origin = ~0ull;
 
-        while (!m_stop.load(std::memory_order_relaxed))
+        for (auto buffer : buffers)
         {
-            if (dequeue_and_process())
-            {
-                // remember the last time we processed a task
-                time0 = high_resolution_clock::now();
-            }
-            else
+            const u64 count = buffer->count.load(std::memory_order_acquire);
+            const u64 first = count > TraceBuffer::capacity ? count - TraceBuffer::capacity : 0;
+            for (u64 i = first; i < count; ++i)
             {
-                // don't be too eager to sleep
-                auto time1 = high_resolution_clock::now();
-                auto elapsed = duration_cast<milliseconds>(time1 - time0).count();
-                if (elapsed >= milliseconds(2).count())
-                {
-                    // sleep but check what's happening after a while unless signaled
-                    ++m_sleep_count;
-                    std::unique_lock<std::mutex> lock(m_queue_mutex);
-                    m_condition.wait_for(lock, milliseconds(32));
-                    --m_sleep_count;
-                }
-                else
-                {
-                    // no work; yield and try again soon
-                    std::this_thread::yield();
-                }
+                origin = std::min(origin, buffer->events[i & (TraceBuffer::capacity - 1)].begin);
             }
         }
-    }
-
-    void ThreadPool::enqueue(Queue* queue, std::function<void()>&& func)
-    {
-        Task task;
-        task.queue = queue;
-        task.stamp = queue->task_input_count++;
-        task.func = std::move(func);
 
-        m_queues[queue->priority].tasks.enqueue(std::move(task));
+        std::string trace = "{\"traceEvents\":[";
+        bool separator = false;
 
-        if (m_sleep_count > 0)
+        for (size_t tid = 0; tid < buffers.size(); ++tid)
         {
-            m_condition.notify_one();
-        }
-    }
+            const TraceBuffer* buffer = buffers[tid];
+            const u64 count = buffer->count.load(std::memory_order_acquire);
+            const u64 first = count > TraceBuffer::capacity ? count - TraceBuffer::capacity : 0;
 
-    bool ThreadPool::dequeue_and_process()
-    {
-        // scan task queues in priority order
-        for (size_t priority = 0; priority < 3; ++priority)
-        {
-            Task task;
-            if (m_queues[priority].tasks.try_dequeue(task))
+            for (u64 i = first; i < count; ++i)
             {
-                Queue* queue = task.queue;
+                const TraceBuffer::Event& event = buffer->events[i & (TraceBuffer::capacity - 1)];
 
-                // check if the task is cancelled
-                if (task.stamp > queue->stamp_cancel)
+                // escape the name for JSON
+                std::string name;
+                for (char c : names[event.name])
                 {
-                    // process task
-                    task.func();
+                    if (c == '"' || c == '\\')
+                        name += '\\';
+                    name += u8(c) < 0x20 ? ' ' : c;
                 }
 
-                ++queue->task_complete_count;
-                return true;
+                trace += separator ? ",\n{\"name\":\"" : "\n{\"name\":\"";
+                trace += name;
+                trace += makeString("\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    int(tid), double(event.begin - origin) / 1000.0, double(event.end - event.begin) / 1000.0);
+                separator = true;
             }
         }
 
-        return false;
+        trace += "\n]}\n";
+        return trace;
     }
 
-    void ThreadPool::wait(Queue* queue)
+#else
+
+    void ThreadPool::setProfiling(bool enable)
     {
-        // NOTE: we might be waiting here a while if other threads keep enqueuing tasks
-        while (queue->task_complete_count < queue->task_input_count)
-        {
-            if (!dequeue_and_process())
-            {
-                std::this_thread::yield();
-            }
-        }
+        MANGO_UNREFERENCED_PARAMETER(enable);
+    }
+
+    std::string ThreadPool::getTrace() const
+    {
+        return "{\"traceEvents\":[]}\n";
     }
 
+#endif
+
     void ThreadPool::cancel(Queue* queue)
     {
         queue->stamp_cancel = queue->task_input_count.load() - 1;
@@ -258,17 +1849,41 @@ namespace mango
         Queue* queue = m_queue_cache.acquire();
 
         queue->pool = this;
+        queue->parent.store(g_context.queue, std::memory_order_relaxed);
         queue->priority = priority;
         queue->task_input_count = 0;
         queue->task_complete_count = 0;
+        queue->task_active_count = 0;
         queue->stamp_cancel = -1;
+        queue->wait_local_count = 0;
+        queue->wait_foreign_count = 0;
+        queue->wait_park_count = 0;
+        queue->expired_count = 0;
         queue->name = name;
+        queue->token = CancellationToken(nullptr);
+
+#ifdef MANGO_ENABLE_THREAD_PROFILE
+        Profile& profile = queue->profile;
+
+        profile.steals = 0;
+        profile.wait_time = 0;
+        profile.exec_time = 0;
+
+        for (int i = 0; i < 16; ++i)
+        {
+            profile.wait_histogram[i] = 0;
+            profile.exec_histogram[i] = 0;
+        }
+
+        profile.name = get_trace_name(name);
+#endif
 
         return queue;
     }
 
     void ThreadPool::deleteQueue(Queue* queue)
     {
+        queue->token = CancellationToken(nullptr);
         m_queue_cache.discard(queue);
     }
 
@@ -288,6 +1903,12 @@ namespace mango
         m_queue = m_pool.createQueue(name, int(priority));
     }
 
+    ConcurrentQueue::ConcurrentQueue(ThreadPool& pool, const std::string& name, Priority priority)
+        : m_pool(pool)
+    {
+        m_queue = m_pool.createQueue(name, int(priority));
+    }
+
     ConcurrentQueue::~ConcurrentQueue()
     {
         wait();
@@ -299,9 +1920,102 @@ namespace mango
         m_pool.cancel(m_queue);
     }
 
-    void ConcurrentQueue::wait()
+    void ConcurrentQueue::wait(WaitMode mode)
+    {
+        m_pool.wait(m_queue, mode);
+    }
+
+    void ConcurrentQueue::setCancellationToken(const CancellationToken& token)
+    {
+        m_queue->token = token;
+    }
+
+    QueueStatistics ConcurrentQueue::getStatistics() const
+    {
+        return m_pool.getStatistics(m_queue);
+    }
+
+    // ------------------------------------------------------------
+    // TaskGraph
+    // ------------------------------------------------------------
+
+    TaskGraph::TaskGraph()
+        : m_pool(ThreadPool::getInstance())
+    {
+        m_queue = m_pool.createQueue("graph.default", int(Priority::NORMAL));
+    }
+
+    TaskGraph::TaskGraph(const std::string& name, Priority priority)
+        : m_pool(ThreadPool::getInstance())
+    {
+        m_queue = m_pool.createQueue(name, int(priority));
+    }
+
+    TaskGraph::~TaskGraph()
+    {
+        wait();
+        m_pool.deleteQueue(m_queue);
+    }
+
+    void TaskGraph::edge(Node* from, Node* to)
+    {
+        from->m_successors.push_back(to);
+        ++to->m_predecessors;
+    }
+
+    void TaskGraph::schedule(Node* node)
+    {
+        m_pool.enqueue(m_queue, [this, node] {
+            execute(node);
+        });
+    }
+
+    void TaskGraph::execute(Node* node)
+    {
+        node->m_func();
+
+        // release the successors; the last predecessor to complete schedules the node.
+        // NOTE: the successors are enqueued before this task is counted as completed
+        //       so the queue cannot drain in between and wait() stays correct.
+        for (Node* successor : node->m_successors)
+        {
+            if (successor->m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                schedule(successor);
+            }
+        }
+    }
+
+    void TaskGraph::run()
+    {
+        if (!m_queue->empty())
+        {
+            MANGO_EXCEPTION("[TaskGraph] Graph is already running.");
+        }
+
+        for (auto& node : m_nodes)
+        {
+            node->m_pending.store(node->m_predecessors, std::memory_order_relaxed);
+        }
+
+        for (auto& node : m_nodes)
+        {
+            if (!node->m_predecessors)
+            {
+                schedule(node.get());
+            }
+        }
+    }
+
+    void TaskGraph::cancel()
+    {
+        // cancelled nodes do not release their successors
+        m_pool.cancel(m_queue);
+    }
+
+    void TaskGraph::wait(WaitMode mode)
     {
-        m_pool.wait(m_queue);
+        m_pool.wait(m_queue, mode);
     }
 
     // ------------------------------------------------------------
@@ -309,67 +2023,177 @@ namespace mango
     // ------------------------------------------------------------
 
     SerialQueue::SerialQueue()
-        : m_name("serial.default")
+        : SerialQueue("serial.default")
     {
-        m_thread = std::thread([this] {
-            thread();
-        });
     }
 
-    SerialQueue::SerialQueue(const std::string& name)
-        : m_name(name)
+    SerialQueue::SerialQueue(const std::string& name, SerialMode mode)
+        : m_pool(ThreadPool::getInstance())
+        , m_queue(nullptr)
+        , m_mode(mode)
     {
-        m_thread = std::thread([this] {
-            thread();
-        });
+        // the list always has a node at the tail; the tasks are in the nodes after it
+        Node* node = new (detail::BlockCache<sizeof(Node)>::allocate()) Node();
+        node->next = nullptr;
+        m_head = node;
+        m_tail = node;
+
+        if (m_mode == SerialMode::STRAND)
+        {
+            m_queue = m_pool.createQueue(name, int(Priority::NORMAL));
+        }
+        else
+        {
+            m_thread = std::thread([this] {
+                thread();
+            });
+        }
     }
 
     SerialQueue::~SerialQueue()
     {
         wait();
 
-        m_stop = true;
-        m_condition.notify_one();
-        m_thread.join();
+        if (m_mode == SerialMode::STRAND)
+        {
+            m_pool.deleteQueue(m_queue);
+        }
+        else
+        {
+            m_stop = true;
+            m_event.notifyAll();
+            m_thread.join();
+        }
+
+        m_tail->~Node();
+        detail::BlockCache<sizeof(Node)>::release(m_tail);
     }
 
-    void SerialQueue::thread()
+    void SerialQueue::push(TaskFunction&& func)
     {
-        while (!m_stop.load(std::memory_order_relaxed))
+        Node* node = new (detail::BlockCache<sizeof(Node)>::allocate()) Node();
+        node->next.store(nullptr, std::memory_order_relaxed);
+        node->stamp = m_task_input_count++;
+        node->func = std::move(func);
+
+        Node* previous = m_head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+
+        if (!m_task_counter.fetch_add(1, std::memory_order_acq_rel))
         {
-            std::unique_lock<std::mutex> queue_lock(m_queue_mutex);
-            if (!m_task_queue.empty())
+            schedule();
+        }
+    }
+
+    bool SerialQueue::drain(int count)
+    {
+        // only one thread at a time gets here; the one which found the queue empty
+        // in push() or the dedicated thread
+        for (;;)
+        {
+            Node* tail = m_tail;
+            Node* next = tail->next.load(std::memory_order_acquire);
+            while (!next)
             {
-                auto task = m_task_queue.front();
-                m_task_queue.pop_front();
-                queue_lock.unlock();
+                // the producer has taken the head but not linked the node yet
+                std::this_thread::yield();
+                next = tail->next.load(std::memory_order_acquire);
+            }
 
-                task();
-                --m_task_counter;
+            // the next node becomes the new tail once the task is moved out of it
+            TaskFunction func = std::move(next->func);
+            const int stamp = next->stamp;
+            m_tail = next;
+
+            tail->~Node();
+            detail::BlockCache<sizeof(Node)>::release(tail);
+
+            if (stamp > m_stamp_cancel)
+            {
+                func();
             }
-            else
+
+            if (m_task_counter.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                if (m_mode == SerialMode::THREAD)
+                {
+                    m_event.notifyAll();
+                }
+                return false;
+            }
+
+            if (--count == 0)
+                return true;
+        }
+    }
+
+    void SerialQueue::schedule()
+    {
+        if (m_mode == SerialMode::STRAND)
+        {
+            // the strand yields the worker after a batch of tasks so that a busy queue
+            // does not starve the other work in the pool
+            m_pool.enqueue(m_queue, [this] {
+                if (drain(64))
+                {
+                    schedule();
+                }
+            });
+        }
+        else
+        {
+            m_event.notifyAll();
+        }
+    }
+
+    void SerialQueue::thread()
+    {
+        for (;;)
+        {
+            if (m_task_counter.load(std::memory_order_acquire) > 0)
+            {
+                drain(INT_MAX);
+                continue;
+            }
+
+            if (m_stop.load(std::memory_order_relaxed))
+                break;
+
+            u32 key = m_event.prepareWait();
+            if (m_task_counter.load(std::memory_order_acquire) > 0 || m_stop.load(std::memory_order_relaxed))
             {
-                m_condition.wait_for(queue_lock, milliseconds(32));
+                m_event.cancelWait();
+                continue;
             }
+
+            m_event.wait(key);
         }
     }
 
     void SerialQueue::cancel()
     {
-        std::unique_lock<std::mutex> queue_lock(m_queue_mutex);
-        m_task_counter -= u32(m_task_queue.size());
-        m_task_queue.clear();
+        m_stamp_cancel = m_task_input_count.load() - 1;
     }
 
-    void SerialQueue::wait()
+    void SerialQueue::wait(WaitMode mode)
     {
-        for (;;)
+        if (m_mode == SerialMode::STRAND)
+        {
+            // a pending drain task keeps the queue busy until every task has completed
+            m_pool.wait(m_queue, mode);
+            return;
+        }
+
+        while (m_task_counter.load(std::memory_order_acquire) > 0)
         {
-            if (!m_task_counter.load(std::memory_order_relaxed))
+            u32 key = m_event.prepareWait();
+            if (!m_task_counter.load(std::memory_order_acquire))
+            {
+                m_event.cancelWait();
                 break;
+            }
 
-            // NOTE: we are wasting CPU here and we know it
-            std::this_thread::sleep_for(std::chrono::microseconds(10));
+            m_event.wait(key);
         }
     }
 
@@ -0,0 +1,669 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mango/core/exception.hpp>
+#include <mango/filesystem/file.hpp>
+#include <mango/filesystem/asyncreader.hpp>
+
+#if defined(MANGO_PLATFORM_LINUX) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #include <cerrno>
+        #include <cstring>
+        #include <fcntl.h>
+        #include <unistd.h>
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+        #include <sys/syscall.h>
+        #include <linux/io_uring.h>
+        #if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+            // kernel 5.6 headers: OPENAT, READ and CLOSE opcodes
+            #define MANGO_ENABLE_IO_URING
+        #endif
+    #endif
+#endif
+
+#define ID "[AsyncReader] "
+
+namespace mango {
+namespace filesystem {
+
+    // -----------------------------------------------------------------
+    // AsyncFile
+    // -----------------------------------------------------------------
+
+    AsyncFile::AsyncFile(const std::string& filename)
+        : m_filename(filename)
+    {
+    }
+
+    AsyncFile::~AsyncFile()
+    {
+        if (m_memory.address)
+        {
+            large_free(m_memory.address, m_memory.size);
+        }
+    }
+
+    void AsyncFile::allocate(size_t size)
+    {
+        u8* address = size ? reinterpret_cast<u8*>(large_malloc(size)) : nullptr;
+        if (size && !address)
+        {
+            MANGO_EXCEPTION(ID"Memory allocation failed for \"%s\".", m_filename.c_str());
+        }
+
+        m_memory = Memory(address, size);
+    }
+
+    void AsyncFile::load()
+    {
+        try
+        {
+            FileStream file(m_filename, Stream::READ, 0);
+
+            allocate(size_t(file.size()));
+            m_success = file.readAt(0, m_memory.address, m_memory.size) == m_memory.size;
+        }
+        catch (Exception&)
+        {
+            m_success = false;
+        }
+    }
+
+    const std::string& AsyncFile::filename() const
+    {
+        return m_filename;
+    }
+
+    bool AsyncFile::success() const
+    {
+        return m_success;
+    }
+
+    AsyncFile::operator Memory () const
+    {
+        return m_memory;
+    }
+
+    const u8* AsyncFile::data() const
+    {
+        return m_memory.address;
+    }
+
+    size_t AsyncFile::size() const
+    {
+        return m_memory.size;
+    }
+
+    // -----------------------------------------------------------------
+    // Request
+    // -----------------------------------------------------------------
+
+    struct AsyncReader::Request
+    {
+        AsyncFile* file;
+        TaskFunction trigger;
+        int fd { -1 };
+        size_t offset { 0 };
+    };
+
+#ifdef MANGO_ENABLE_IO_URING
+
+    // -----------------------------------------------------------------
+    // Ring
+    // -----------------------------------------------------------------
+
+    /*
+        The requests go through the open -> read -> close stages; the stage is stored
+        in the low bits of the completion user data. The files are opened and read
+        by the kernel; the thread only reaps the completions and queues the next
+        stages, which are submitted in one batch per wake-up.
+    */
+
+    struct AsyncReader::Ring
+    {
+        enum Operation : u64
+        {
+            WAKE  = 0,
+            OPEN  = 1,
+            READ  = 2,
+            CLOSE = 3,
+            MASK  = 3
+        };
+
+        AsyncReader& reader;
+        int fd { -1 };
+
+        // submission queue
+        u32* sq_head;
+        u32* sq_tail;
+        u32* sq_array;
+        u32 sq_mask;
+        u32 sq_entries;
+        u32 sq_local_tail;
+        io_uring_sqe* sqes;
+
+        // completion queue
+        u32* cq_head;
+        u32* cq_tail;
+        u32 cq_mask;
+        io_uring_cqe* cqes;
+
+        void* sq_ptr { MAP_FAILED };
+        void* cq_ptr { MAP_FAILED };
+        void* sqes_ptr { MAP_FAILED };
+        size_t sq_size { 0 };
+        size_t cq_size { 0 };
+        size_t sqes_size { 0 };
+
+        // entries which did not fit into the submission queue
+        std::deque<io_uring_sqe> overflow;
+
+        // completions being processed; only used by the reaper thread
+        std::vector<io_uring_cqe> completions;
+
+        std::mutex mutex;
+        std::deque<Request*> backlog;
+        std::vector<TaskFunction> triggers;
+        int depth;
+        int active { 0 };
+        int closing { 0 };
+        bool stop { false };
+
+        std::thread thread;
+
+        Ring(AsyncReader& reader, int depth)
+            : reader(reader)
+            , depth(depth)
+        {
+        }
+
+        ~Ring()
+        {
+            if (thread.joinable())
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                stop = true;
+                prepare(IORING_OP_NOP, WAKE);
+                flush();
+                lock.unlock();
+
+                thread.join();
+            }
+
+            if (sqes_ptr != MAP_FAILED)
+                ::munmap(sqes_ptr, sqes_size);
+            if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+                ::munmap(cq_ptr, cq_size);
+            if (sq_ptr != MAP_FAILED)
+                ::munmap(sq_ptr, sq_size);
+            if (fd >= 0)
+                ::close(fd);
+        }
+
+        static int enter(int fd, u32 submit, u32 complete, u32 flags)
+        {
+            return int(::syscall(__NR_io_uring_enter, fd, submit, complete, flags, nullptr, 0));
+        }
+
+        template <typename T>
+        T* pointer(void* base, u32 offset) const
+        {
+            return reinterpret_cast<T*>(reinterpret_cast<u8*>(base) + offset);
+        }
+
+        bool initialize()
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+
+            fd = int(::syscall(__NR_io_uring_setup, u32(depth * 2), &params));
+            if (fd < 0)
+            {
+                // not supported by the kernel or blocked by a sandbox
+                return false;
+            }
+
+            // check that the kernel implements the operations we use
+            u8 buffer[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)] = { 0 };
+            io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer);
+
+            if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            {
+                return false;
+            }
+
+            for (u8 op : { u8(IORING_OP_OPENAT), u8(IORING_OP_READ), u8(IORING_OP_CLOSE) })
+            {
+                if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                {
+                    return false;
+                }
+            }
+
+            sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+            cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+            const bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single)
+            {
+                sq_size = std::max(sq_size, cq_size);
+                cq_size = sq_size;
+            }
+
+            sq_ptr = ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (sq_ptr == MAP_FAILED)
+                return false;
+
+            cq_ptr = single ? sq_ptr : ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED)
+                return false;
+
+            sqes_ptr = ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (sqes_ptr == MAP_FAILED)
+                return false;
+
+            sq_head = pointer<u32>(sq_ptr, params.sq_off.head);
+            sq_tail = pointer<u32>(sq_ptr, params.sq_off.tail);
+            sq_array = pointer<u32>(sq_ptr, params.sq_off.array);
+            sq_mask = *pointer<u32>(sq_ptr, params.sq_off.ring_mask);
+            sq_entries = params.sq_entries;
+            sq_local_tail = *sq_tail;
+            sqes = reinterpret_cast<io_uring_sqe*>(sqes_ptr);
+
+            cq_head = pointer<u32>(cq_ptr, params.cq_off.head);
+            cq_tail = pointer<u32>(cq_ptr, params.cq_off.tail);
+            cq_mask = *pointer<u32>(cq_ptr, params.cq_off.ring_mask);
+            cqes = pointer<io_uring_cqe>(cq_ptr, params.cq_off.cqes);
+
+            thread = std::thread([this] {
+                run();
+            });
+
+            return true;
+        }
+
+        // submit the prepared entries to the kernel
+        void flush()
+        {
+            // move the entries which did not fit earlier into the free slots
+            while (!overflow.empty() && sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) < sq_entries)
+            {
+                const u32 index = sq_local_tail & sq_mask;
+                sqes[index] = overflow.front();
+                sq_array[index] = index;
+                ++sq_local_tail;
+                overflow.pop_front();
+            }
+
+            __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+            for (;;)
+            {
+                const u32 count = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+                if (!count)
+                    break;
+
+                int status = enter(fd, count, 0, 0);
+                if (status < 0 && errno != EINTR)
+                {
+                    // the completion queue is full; the entries are submitted after the
+                    // completions have been reaped
+                    break;
+                }
+            }
+        }
+
+        io_uring_sqe* prepare(u8 opcode, u64 data)
+        {
+            if (overflow.empty() && sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+            {
+                flush();
+            }
+
+            io_uring_sqe* sqe;
+
+            if (!overflow.empty() || sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries)
+            {
+                // the kernel has not consumed the queue; the slot at the head is still
+                // in use so the entry waits until flush() finds room for it
+                overflow.emplace_back();
+                sqe = &overflow.back();
+            }
+            else
+            {
+                const u32 index = sq_local_tail & sq_mask;
+                sqe = sqes + index;
+                sq_array[index] = index;
+                ++sq_local_tail;
+            }
+
+            std::memset(sqe, 0, sizeof(io_uring_sqe));
+            sqe->opcode = opcode;
+            sqe->user_data = data;
+            return sqe;
+        }
+
+        u64 getData(Request* request, Operation operation) const
+        {
+            return u64(reinterpret_cast<uintptr_t>(request)) | operation;
+        }
+
+        void open(Request* request)
+        {
+            io_uring_sqe* sqe = prepare(IORING_OP_OPENAT, getData(request, OPEN));
+            sqe->fd = AT_FDCWD;
+            sqe->addr = u64(reinterpret_cast<uintptr_t>(request->file->m_filename.c_str()));
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        }
+
+        void read(Request* request)
+        {
+            const Memory& memory = request->file->m_memory;
+            const size_t size = std::min(memory.size - request->offset, size_t(1) << 30);
+
+            io_uring_sqe* sqe = prepare(IORING_OP_READ, getData(request, READ));
+            sqe->fd = request->fd;
+            sqe->addr = u64(reinterpret_cast<uintptr_t>(memory.address + request->offset));
+            sqe->len = u32(size);
+            sqe->off = u64(request->offset);
+        }
+
+        void close(int file)
+        {
+            io_uring_sqe* sqe = prepare(IORING_OP_CLOSE, CLOSE);
+            sqe->fd = file;
+            ++closing;
+        }
+
+        void finish(Request* request, bool success)
+        {
+            if (request->fd >= 0)
+            {
+                close(request->fd);
+            }
+
+            request->file->m_success = success;
+            triggers.push_back(std::move(request->trigger));
+            delete request;
+
+            // start the next file in the backlog
+            if (backlog.empty())
+            {
+                --active;
+            }
+            else
+            {
+                open(backlog.front());
+                backlog.pop_front();
+            }
+        }
+
+        void submit(Request* request)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (active < depth)
+            {
+                ++active;
+                open(request);
+                flush();
+            }
+            else
+            {
+                backlog.push_back(request);
+            }
+        }
+
+        void process(u64 data, int result)
+        {
+            Request* request = reinterpret_cast<Request*>(uintptr_t(data & ~u64(MASK)));
+
+            switch (data & MASK)
+            {
+                case OPEN:
+                {
+                    // the memory is allocated by opened() without holding the lock
+                    if (result < 0)
+                    {
+                        finish(request, false);
+                        break;
+                    }
+
+                    if (request->file->m_memory.size)
+                    {
+                        read(request);
+                    }
+                    else
+                    {
+                        finish(request, true);
+                    }
+                    break;
+                }
+
+                case READ:
+                {
+                    if (result <= 0)
+                    {
+                        // read error or the file was truncated meanwhile
+                        finish(request, false);
+                        break;
+                    }
+
+                    request->offset += size_t(result);
+                    if (request->offset < request->file->m_memory.size)
+                    {
+                        read(request);
+                    }
+                    else
+                    {
+                        finish(request, true);
+                    }
+                    break;
+                }
+
+                case CLOSE:
+                    --closing;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        // the file was opened; returns the result of the completion
+        int opened(Request* request, int result)
+        {
+            request->fd = result;
+
+            struct stat st;
+            if (::fstat(request->fd, &st) < 0 || !S_ISREG(st.st_mode))
+            {
+                return -EINVAL;
+            }
+
+            try
+            {
+                request->file->allocate(size_t(st.st_size));
+            }
+            catch (Exception&)
+            {
+                return -ENOMEM;
+            }
+
+            return result;
+        }
+
+        void run()
+        {
+            for (;;)
+            {
+                // wait for at least one completion
+                enter(fd, 0, 1, IORING_ENTER_GETEVENTS);
+
+                bool done = false;
+
+                // the completion queue is only consumed on this thread
+                u32 head = *cq_head;
+                const u32 tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+                completions.clear();
+                for ( ; head != tail; ++head)
+                {
+                    completions.push_back(cqes[head & cq_mask]);
+                }
+
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+                // the opened requests are not visible to the submitters, so the files
+                // are allocated without blocking them
+                for (io_uring_cqe& cqe : completions)
+                {
+                    if ((cqe.user_data & MASK) == OPEN && cqe.res >= 0)
+                    {
+                        Request* request = reinterpret_cast<Request*>(uintptr_t(cqe.user_data & ~u64(MASK)));
+                        cqe.res = opened(request, cqe.res);
+                    }
+                }
+
+                std::unique_lock<std::mutex> lock(mutex);
+
+                for (const io_uring_cqe& cqe : completions)
+                {
+                    process(cqe.user_data, cqe.res);
+                }
+
+                // submit the next stages in one batch
+                flush();
+
+                done = stop && !active && !closing;
+
+                std::vector<TaskFunction> ready;
+                ready.swap(triggers);
+                lock.unlock();
+
+                // the decoding can start
+                for (auto& trigger : ready)
+                {
+                    trigger();
+                    reader.complete();
+                }
+
+                if (done)
+                    break;
+            }
+        }
+    };
+
+#else
+
+    struct AsyncReader::Ring
+    {
+        Ring(AsyncReader& reader, int depth)
+        {
+            MANGO_UNREFERENCED_PARAMETER(reader);
+            MANGO_UNREFERENCED_PARAMETER(depth);
+        }
+
+        bool initialize()
+        {
+            return false;
+        }
+
+        void submit(Request* request)
+        {
+            MANGO_UNREFERENCED_PARAMETER(request);
+        }
+    };
+
+#endif
+
+    // -----------------------------------------------------------------
+    // AsyncReader
+    // -----------------------------------------------------------------
+
+    AsyncReader::AsyncReader(ConcurrentQueue& queue, int depth)
+        : m_queue(queue)
+    {
+        if (depth > 0)
+        {
+            m_ring.reset(new Ring(*this, depth));
+            if (!m_ring->initialize())
+            {
+                m_ring.reset();
+            }
+        }
+    }
+
+    AsyncReader::~AsyncReader()
+    {
+        wait();
+        m_ring.reset();
+    }
+
+    void AsyncReader::complete()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!--m_pending)
+        {
+            m_condition.notify_all();
+        }
+    }
+
+    void AsyncReader::read(const std::string& filename, Callback callback)
+    {
+        AsyncFile* file = new AsyncFile(filename);
+        std::unique_ptr<AsyncFile> owner(file);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_pending;
+        }
+
+        // the file is released with the task, also when the queue is cancelled
+        auto func = [owner = std::move(owner), callback = std::move(callback)] {
+            callback(*owner);
+        };
+
+        if (m_ring)
+        {
+            Request* request = new Request;
+            request->file = file;
+            request->trigger = m_queue.defer(std::move(func));
+            m_ring->submit(request);
+        }
+        else
+        {
+            // the read is counted as completed when the I/O task is released, which
+            // also happens when the queue is cancelled before it runs
+            std::shared_ptr<void> pending(nullptr, [this] (void*) {
+                complete();
+            });
+
+            m_queue.enqueue_io([file, pending] {
+                file->load();
+            }, std::move(func));
+        }
+    }
+
+    void AsyncReader::wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait(lock, [this] {
+            return m_pending == 0;
+        });
+    }
+
+    bool AsyncReader::isNative() const
+    {
+        return m_ring != nullptr;
+    }
+
+} // namespace filesystem
+} // namespace mango
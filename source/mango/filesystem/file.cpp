@@ -15,7 +15,7 @@ namespace filesystem {
     // File
     // -----------------------------------------------------------------
 
-    File::File(const std::string& s)
+    File::File(const std::string& s, u32 flags)
     {
         // split s into pathname + filename
         size_t n = s.find_last_of("/\\:");
@@ -24,10 +24,10 @@ namespace filesystem {
 
         m_filename = filename;
 
-        // create a internal path
-        m_path.reset(new Path(filepath));
+        // create a internal mapper; the folder doesn't have to be indexed like in a Path
+        m_mapper = std::make_shared<Mapper>(filepath, "");
 
-        Mapper* path_mapper = m_path->m_mapper.get();
+        Mapper* path_mapper = m_mapper.get();
         if (!path_mapper)
         {
             MANGO_EXCEPTION(ID"Mapper interface missing.");
@@ -36,12 +36,12 @@ namespace filesystem {
         AbstractMapper* mapper = *path_mapper;
         if (mapper)
         {
-            VirtualMemory* vmemory = mapper->mmap(path_mapper->basepath() + m_filename);
+            VirtualMemory* vmemory = mapper->mmap(path_mapper->basepath() + m_filename, flags);
             m_memory = UniqueObject<VirtualMemory>(vmemory);
         }
     }
 
-    File::File(const Path& path, const std::string& s)
+    File::File(const Path& path, const std::string& s, u32 flags)
     {
         // split s into pathname + filename
         size_t n = s.find_last_of("/\\:");
@@ -50,10 +50,10 @@ namespace filesystem {
 
         m_filename = filename;
 
-        // create a internal path
-        m_path.reset(new Path(path, filepath));
+        // create a internal mapper
+        m_mapper = std::make_shared<Mapper>(path.m_mapper, filepath, "");
 
-        Mapper* path_mapper = m_path->m_mapper.get();
+        Mapper* path_mapper = m_mapper.get();
         if (!path_mapper)
         {
             MANGO_EXCEPTION(ID"Mapper interface missing.");
@@ -62,7 +62,7 @@ namespace filesystem {
         AbstractMapper* mapper = *path_mapper;
         if (mapper)
         {
-            VirtualMemory* vmemory = mapper->mmap(path_mapper->basepath() + m_filename);
+            VirtualMemory* vmemory = mapper->mmap(path_mapper->basepath() + m_filename, flags);
             m_memory = UniqueObject<VirtualMemory>(vmemory);
         }
     }
@@ -71,10 +71,10 @@ namespace filesystem {
     {
         std::string password;
 
-        // create a internal path
-        m_path.reset(new Path(memory, extension, password));
+        // create a internal mapper
+        m_mapper = std::make_shared<Mapper>(memory, extension, password);
 
-        Mapper* path_mapper = m_path->m_mapper.get();
+        Mapper* path_mapper = m_mapper.get();
         if (!path_mapper)
         {
             MANGO_EXCEPTION(ID"Mapper interface missing.");
@@ -104,7 +104,7 @@ namespace filesystem {
 
     const std::string& File::pathname() const
     {
-        return m_path->m_mapper->pathname();
+        return m_mapper->pathname();
     }
 
     File::operator Memory () const
@@ -3,6 +3,8 @@
     Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
 #include <vector>
+#include <list>
+#include <mutex>
 #include <algorithm>
 #include <mango/core/string.hpp>
 #include <mango/filesystem/mapper.hpp>
@@ -63,6 +65,137 @@ namespace filesystem {
 #endif
     };
 
+    // -----------------------------------------------------------------
+    // ContainerCache
+    // -----------------------------------------------------------------
+
+    struct CachedContainer
+    {
+        std::string key;
+
+        // the mapper refers to the memory so it must be destroyed first
+        std::unique_ptr<VirtualMemory> memory;
+        std::unique_ptr<AbstractMapper> mapper;
+    };
+
+    class ContainerCache
+    {
+    protected:
+        std::mutex m_mutex;
+
+        // most recently used first
+        std::list<std::shared_ptr<CachedContainer>> m_containers;
+
+        u64 m_memory_limit { 1024ull * 1024 * 1024 };
+        size_t m_handle_limit { 64 };
+
+        void evictLocked()
+        {
+            u64 memory = 0;
+            size_t handles = 0;
+
+            for (auto i = m_containers.begin(); i != m_containers.end(); )
+            {
+                const auto& container = *i;
+                const u64 size = (*container->memory)->size;
+
+                const bool unused = container.use_count() == 1;
+                const bool fits = memory + size <= m_memory_limit && handles + 1 <= m_handle_limit;
+
+                if (unused && !fits)
+                {
+                    i = m_containers.erase(i);
+                }
+                else
+                {
+                    memory += size;
+                    handles += 1;
+                    ++i;
+                }
+            }
+        }
+
+    public:
+        template <typename CreateFunc>
+        std::shared_ptr<CachedContainer> get(const std::string& key, CreateFunc create)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                for (auto i = m_containers.begin(); i != m_containers.end(); ++i)
+                {
+                    if ((*i)->key == key)
+                    {
+                        // move to the front of the list
+                        m_containers.splice(m_containers.begin(), m_containers, i);
+                        return *i;
+                    }
+                }
+            }
+
+            // parse the container without holding the lock
+            std::shared_ptr<CachedContainer> container = std::make_shared<CachedContainer>();
+            container->key = key;
+            create(*container);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            for (auto& current : m_containers)
+            {
+                if (current->key == key)
+                {
+                    // another thread opened the same container
+                    return current;
+                }
+            }
+
+            m_containers.push_front(container);
+            evictLocked();
+
+            return container;
+        }
+
+        void evict()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            evictLocked();
+        }
+
+        void setLimits(u64 memory, size_t handles)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_memory_limit = memory;
+            m_handle_limit = handles;
+            evictLocked();
+        }
+
+        void purge()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_containers.remove_if([] (const std::shared_ptr<CachedContainer>& container)
+            {
+                return container.use_count() == 1;
+            });
+        }
+    };
+
+    static ContainerCache& getContainerCache()
+    {
+        // never destroyed; the Mappers in static objects may outlive the cache otherwise
+        static ContainerCache* cache = new ContainerCache();
+        return *cache;
+    }
+
+    void setContainerCacheLimits(u64 memory, size_t handles)
+    {
+        getContainerCache().setLimits(memory, handles);
+    }
+
+    void purgeContainerCache()
+    {
+        getContainerCache().purge();
+    }
+
     // -----------------------------------------------------------------
     // FileInfo
     // -----------------------------------------------------------------
@@ -124,7 +257,8 @@ namespace filesystem {
     // Mapper
     // -----------------------------------------------------------------
 
-    Mapper::Mapper(const std::string& pathname, const std::string& password)
+    Mapper::Mapper(const std::string& pathname, const std::string& password, u32 flags)
+        : m_flags(flags)
     {
 		// parse and create mappers
         std::string temp = pathname.empty() ? "./" : pathname;
@@ -139,7 +273,8 @@ namespace filesystem {
 #endif
     }
 
-    Mapper::Mapper(std::shared_ptr<Mapper> mapper, const std::string& pathname, const std::string& password)
+    Mapper::Mapper(std::shared_ptr<Mapper> mapper, const std::string& pathname, const std::string& password, u32 flags)
+        : m_flags(flags)
     {
         // use parent's mapper
         m_parent_mapper = mapper;
@@ -166,6 +301,13 @@ namespace filesystem {
     Mapper::~Mapper()
     {
 		delete m_parent_memory;
+
+        // the released containers may now be over the cache limits
+        if (!m_containers.empty())
+        {
+            m_containers.clear();
+            getContainerCache().evict();
+        }
     }
 
     std::string Mapper::parse(std::string& pathname, const std::string& password)
@@ -212,9 +354,28 @@ namespace filesystem {
 
                 if (m_mapper->isFile(container))
                 {
-                    m_parent_memory = m_mapper->mmap(container);
-                    mapper = extension.createMapper(*m_parent_memory, password);
-                    m_mappers.emplace_back(mapper);
+                    std::string identity = m_mapper->getIdentity(container);
+                    if (!identity.empty())
+                    {
+                        // the container is in the filesystem; share it through the cache
+                        const std::string key = identity + "|" + extension.extension + "|" + password;
+
+                        std::shared_ptr<CachedContainer> cached = getContainerCache().get(key, [&] (CachedContainer& c)
+                        {
+                            c.memory.reset(m_mapper->mmap(container, m_flags));
+                            c.mapper.reset(extension.createMapper(*c.memory, password));
+                        });
+
+                        m_containers.push_back(cached);
+                        mapper = cached->mapper.get();
+                    }
+                    else
+                    {
+                        m_parent_memory = m_mapper->mmap(container, m_flags);
+                        mapper = extension.createMapper(*m_parent_memory, password);
+                        m_mappers.emplace_back(mapper);
+                    }
+
                     m_mapper = mapper;
 
                     filename = postfix;
@@ -184,6 +184,37 @@ namespace
 namespace mango {
 namespace filesystem {
 
+    // -----------------------------------------------------------------
+    // memory
+    // -----------------------------------------------------------------
+
+    static MemoryTag g_mgx_tag("mgx.decompress");
+
+    static u8* mgx_malloc(size_t size)
+    {
+        u8* address = reinterpret_cast<u8*>(large_malloc(size));
+        if (!address)
+        {
+            if (size)
+            {
+                MANGO_EXCEPTION(ID"Memory allocation failed.");
+            }
+            return nullptr;
+        }
+
+        g_mgx_tag.allocate(size);
+        return address;
+    }
+
+    static void mgx_free(u8* address, size_t size)
+    {
+        if (address)
+        {
+            g_mgx_tag.deallocate(size);
+            large_free(address, size);
+        }
+    }
+
     // -----------------------------------------------------------------
     // VirtualMemoryMGX
     // -----------------------------------------------------------------
@@ -202,7 +233,7 @@ namespace filesystem {
 
         ~VirtualMemoryMGX()
         {
-            delete [] m_delete_address;
+            mgx_free(m_delete_address, m_memory.size);
         }
     };
 
@@ -259,7 +290,7 @@ namespace filesystem {
             }
         }
 
-        VirtualMemory* mmap(const std::string& filename) override
+        VirtualMemory* mmap(const std::string& filename, u32 flags) override
         {
             const FileHeader* ptrHeader = m_header.m_folders.getHeader(filename);
             if (!ptrHeader)
@@ -288,7 +319,7 @@ namespace filesystem {
                         // TODO: decompression cache for small-file blocks
 #if 0
                         // simulate almost-zero-cost (AZC) decompression
-                        u8* ptr = new u8[file.size];
+                        u8* ptr = mgx_malloc(file.size);
                         std::memset(ptr, 0, file.size);
                         VirtualMemoryMGX* vm = new VirtualMemoryMGX(ptr, ptr, file.size);
                         return vm;
@@ -307,6 +338,8 @@ namespace filesystem {
                         MANGO_EXCEPTION(ID"File \"%s\" has mapped region outside of parent memory.", filename.c_str());
                     }
 
+                    advise(Memory(ptr, file.size), flags);
+
                     VirtualMemoryMGX* vm = new VirtualMemoryMGX(ptr, nullptr, file.size);
                     return vm;
                 }
@@ -314,7 +347,7 @@ namespace filesystem {
 
             // generic compression case
 
-            u8* ptr = new u8[file.size];
+            u8* ptr = mgx_malloc(file.size);
             u8* x = ptr;
 
             ConcurrentQueue q("mgx.decompessor", Priority::HIGH);
@@ -328,6 +361,10 @@ namespace filesystem {
                     Compressor compressor = getCompressor(Compressor::Method(block.method));
                     Memory src(m_header.m_memory.address + block.offset, block.compressed);
 
+                    // the compressed blocks are read once, front-to-back; start reading
+                    // them while the previous blocks are being decompressed
+                    advise(src, Mapping::SEQUENTIAL | Mapping::WILLNEED);
+
                     q.enqueue([=, &block, &segment] {
                         if (block.uncompressed == segment.size && segment.offset == 0)
                         {
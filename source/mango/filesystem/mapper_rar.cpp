@@ -28,13 +28,49 @@ namespace
 
     using mango::Memory;
     using mango::VirtualMemory;
+    using mango::large_malloc;
+    using mango::large_free;
+    using mango::MemoryTag;
     using mango::filesystem::Indexer;
+    using mango::filesystem::Mapping;
+    using mango::filesystem::advise;
 
     using mango::u8;
     using mango::u16;
     using mango::u32;
     using mango::u64;
 
+    // -----------------------------------------------------------------
+    // memory
+    // -----------------------------------------------------------------
+
+    static MemoryTag g_rar_tag("rar.decompress");
+
+    static u8* rar_malloc(size_t size)
+    {
+        u8* address = reinterpret_cast<u8*>(large_malloc(size));
+        if (!address)
+        {
+            if (size)
+            {
+                MANGO_EXCEPTION(ID"Memory allocation failed.");
+            }
+            return nullptr;
+        }
+
+        g_rar_tag.allocate(size);
+        return address;
+    }
+
+    static void rar_free(u8* address, size_t size)
+    {
+        if (address)
+        {
+            g_rar_tag.deallocate(size);
+            large_free(address, size);
+        }
+    }
+
     class VirtualMemoryRAR : public mango::VirtualMemory
     {
     protected:
@@ -49,7 +85,7 @@ namespace
 
         ~VirtualMemoryRAR()
         {
-            delete [] m_delete_address;
+            rar_free(m_delete_address, m_memory.size);
         }
     };
     
@@ -371,24 +407,27 @@ namespace
             return method != 0x30;
         }
 
-        VirtualMemory* mmap() const
+        VirtualMemory* mmap(u32 flags) const
         {
             VirtualMemory* memory;
 
             if (!compressed())
             {
                 // no compression
+                advise(Memory(data, size_t(unpacked_size)), flags);
                 memory = new VirtualMemoryRAR(data, nullptr, size_t(unpacked_size));
             }
             else
             {
                 size_t size = size_t(unpacked_size);
-                u8* buffer = new u8[size];
+                u8* buffer = rar_malloc(size);
+
+                advise(Memory(data, size_t(packed_size)), Mapping::SEQUENTIAL | Mapping::WILLNEED);
 
                 bool status = decompress(buffer, data, unpacked_size, packed_size, version);
                 if (!status)
                 {
-                    delete[] buffer;
+                    rar_free(buffer, size);
                     MANGO_EXCEPTION(ID"Decompression failed.");
                 }
 
@@ -729,7 +768,7 @@ namespace filesystem {
             }
         }
 
-        VirtualMemory* mmap(const std::string& filename) override
+        VirtualMemory* mmap(const std::string& filename, u32 flags) override
         {
             const FileHeader* ptrHeader = m_folders.getHeader(filename);
             if (!ptrHeader)
@@ -738,7 +777,7 @@ namespace filesystem {
             }
 
             const FileHeader& header = *ptrHeader;
-            return header.mmap();
+            return header.mmap(flags);
         }
     };
 
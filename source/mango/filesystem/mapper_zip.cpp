@@ -539,6 +539,39 @@ namespace
 namespace mango {
 namespace filesystem {
 
+    // -----------------------------------------------------------------
+    // memory
+    // -----------------------------------------------------------------
+
+    static MemoryTag g_zip_tag("zip.decompress");
+
+    static void zip_free(u8* address, size_t size)
+    {
+        if (address)
+        {
+            g_zip_tag.deallocate(size);
+            large_free(address, size);
+        }
+    }
+
+    static u8* zip_malloc(size_t size, u8* pending = nullptr, size_t pending_size = 0)
+    {
+        u8* address = reinterpret_cast<u8*>(large_malloc(size));
+        if (!address)
+        {
+            if (size)
+            {
+                // release the previous stage buffer before unwinding
+                zip_free(pending, pending_size);
+                MANGO_EXCEPTION(ID"Memory allocation failed.");
+            }
+            return nullptr;
+        }
+
+        g_zip_tag.allocate(size);
+        return address;
+    }
+
     // -----------------------------------------------------------------
     // VirtualMemoryZIP
     // -----------------------------------------------------------------
@@ -547,17 +580,19 @@ namespace filesystem {
     {
     protected:
         u8* m_delete_address;
+        size_t m_delete_size;
 
     public:
-        VirtualMemoryZIP(u8* address, u8* delete_address, size_t size)
+        VirtualMemoryZIP(u8* address, u8* delete_address, size_t size, size_t delete_size = 0)
             : m_delete_address(delete_address)
+            , m_delete_size(delete_size)
         {
             m_memory = Memory(address, size);
         }
 
         ~VirtualMemoryZIP()
         {
-            delete [] m_delete_address;
+            zip_free(m_delete_address, m_delete_size);
         }
     };
 
@@ -611,7 +646,7 @@ namespace filesystem {
         {
         }
 
-        VirtualMemory* mmap(const FileHeader& header, u8* start, const std::string& password)
+        VirtualMemory* mmap(const FileHeader& header, u8* start, const std::string& password, u32 flags)
         {
             LittleEndianPointer p = start + header.localOffset;
 
@@ -627,6 +662,18 @@ namespace filesystem {
             u64 size = 0;
 
             u8* buffer = nullptr; // remember allocated memory
+            size_t buffer_size = 0;
+
+            if (header.compression == COMPRESSION_NONE && header.encryption == ENCRYPTION_NONE)
+            {
+                // the file is a slice of the parent mapping
+                advise(Memory(address, size_t(header.uncompressedSize)), flags);
+            }
+            else
+            {
+                // the compressed data is read once, front-to-back
+                advise(Memory(address, size_t(header.compressedSize)), Mapping::SEQUENTIAL | Mapping::WILLNEED);
+            }
 
             //printf("[ZIP] compression: %d, encryption: %d \n", header.compression, header.encryption);
 
@@ -643,13 +690,14 @@ namespace filesystem {
 
                     // NOTE: decryption capability reduced on 32 bit platforms
                     const size_t compressed_size = size_t(header.compressedSize);
-                    buffer = new u8[compressed_size];
+                    buffer = zip_malloc(compressed_size);
+                    buffer_size = compressed_size;
 
                     bool status = zip_decrypt(buffer, address, header.compressedSize, dcheader,
                                             header.versionUsed & 0xff, header.crc, password);
                     if (!status)
                     {
-                        delete[] buffer;
+                        zip_free(buffer, buffer_size);
                         MANGO_EXCEPTION(ID"Decryption failed (probably incorrect password).");
                     }
 
@@ -694,17 +742,18 @@ namespace filesystem {
                 case COMPRESSION_DEFLATE:
                 {
                     const size_t uncompressed_size = size_t(header.uncompressedSize);
-                    u8* uncompressed_buffer = new u8[uncompressed_size];
+                    u8* uncompressed_buffer = zip_malloc(uncompressed_size, buffer, buffer_size);
 
                     u64 outsize = zip_decompress(address, uncompressed_buffer, header.compressedSize, header.uncompressedSize);
 
-                    delete[] buffer;
+                    zip_free(buffer, buffer_size);
                     buffer = uncompressed_buffer;
+                    buffer_size = uncompressed_size;
 
                     if (outsize != header.uncompressedSize)
                     {
                         // incorrect output size
-                        delete[] buffer;
+                        zip_free(buffer, buffer_size);
                         MANGO_EXCEPTION(ID"Incorrect decompressed size.");
                     }
 
@@ -717,7 +766,7 @@ namespace filesystem {
                 case COMPRESSION_LZMA:
                 {
                     const size_t uncompressed_size = size_t(header.uncompressedSize);
-                    u8* uncompressed_buffer = new u8[uncompressed_size];
+                    u8* uncompressed_buffer = zip_malloc(uncompressed_size, buffer, buffer_size);
 
                     // parse LZMA compression header
                     p = address;
@@ -725,7 +774,8 @@ namespace filesystem {
                     u16 lzma_propsize = p.read16();
                     if (lzma_propsize != 5)
                     {
-                        delete[] buffer;
+                        zip_free(uncompressed_buffer, uncompressed_size);
+                        zip_free(buffer, buffer_size);
                         MANGO_EXCEPTION(ID"Incorrect LZMA header.");
                     }
                     address = p;
@@ -733,8 +783,9 @@ namespace filesystem {
 
                     lzma::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)), Memory(address, size_t(compressed_size)));
 
-                    delete[] buffer;
+                    zip_free(buffer, buffer_size);
                     buffer = uncompressed_buffer;
+                    buffer_size = uncompressed_size;
 
                     // use decode_buffer as memory map
                     address = buffer;
@@ -745,12 +796,13 @@ namespace filesystem {
                 case COMPRESSION_PPMD:
                 {
                     const std::size_t uncompressed_size = static_cast<std::size_t>(header.uncompressedSize);
-                    u8* uncompressed_buffer = new u8[uncompressed_size];
+                    u8* uncompressed_buffer = zip_malloc(uncompressed_size, buffer, buffer_size);
 
                     ppmd8::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)), Memory(address, size_t(header.compressedSize)));
 
-                    delete[] buffer;
+                    zip_free(buffer, buffer_size);
                     buffer = uncompressed_buffer;
+                    buffer_size = uncompressed_size;
 
                     // use decode_buffer as memory map
                     address = buffer;
@@ -761,12 +813,13 @@ namespace filesystem {
                 case COMPRESSION_BZIP2:
                 {
                     const std::size_t uncompressed_size = static_cast<std::size_t>(header.uncompressedSize);
-                    u8* uncompressed_buffer = new u8[uncompressed_size];
+                    u8* uncompressed_buffer = zip_malloc(uncompressed_size, buffer, buffer_size);
 
                     bzip2::decompress(Memory(uncompressed_buffer, size_t(header.uncompressedSize)), Memory(address, size_t(header.compressedSize)));
 
-                    delete[] buffer;
+                    zip_free(buffer, buffer_size);
                     buffer = uncompressed_buffer;
+                    buffer_size = uncompressed_size;
 
                     // use decode_buffer as memory map
                     address = buffer;
@@ -786,7 +839,7 @@ namespace filesystem {
             VirtualMemory* memory;
             if (buffer)
             {
-                memory = new VirtualMemoryZIP(buffer, buffer, size_t(size));
+                memory = new VirtualMemoryZIP(buffer, buffer, size_t(size), buffer_size);
             }
             else
             {
@@ -839,7 +892,7 @@ namespace filesystem {
             }
         }
 
-        VirtualMemory* mmap(const std::string& filename) override
+        VirtualMemory* mmap(const std::string& filename, u32 flags) override
         {
             const FileHeader* ptrHeader = m_folders.getHeader(filename);
             if (!ptrHeader)
@@ -848,7 +901,7 @@ namespace filesystem {
             }
 
             const FileHeader& header = *ptrHeader;
-            return mmap(header, m_parent_memory.address, m_password);
+            return mmap(header, m_parent_memory.address, m_password, flags);
         }
     };
 
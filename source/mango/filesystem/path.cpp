@@ -12,8 +12,8 @@ namespace filesystem {
     // Path
     // -----------------------------------------------------------------
 
-    Path::Path(const std::string& pathname, const std::string& password)
-        : m_mapper(std::make_shared<Mapper>(pathname, password))
+    Path::Path(const std::string& pathname, const std::string& password, u32 flags)
+        : m_mapper(std::make_shared<Mapper>(pathname, password, flags))
     {
         AbstractMapper* mapper = *m_mapper;
         if (mapper)
@@ -22,8 +22,8 @@ namespace filesystem {
         }
     }
 
-    Path::Path(const Path& path, const std::string& pathname, const std::string& password)
-        : m_mapper(std::make_shared<Mapper>(path.m_mapper, pathname, password))
+    Path::Path(const Path& path, const std::string& pathname, const std::string& password, u32 flags)
+        : m_mapper(std::make_shared<Mapper>(path.m_mapper, pathname, password, flags))
     {
         AbstractMapper* mapper = *m_mapper;
         if (mapper)
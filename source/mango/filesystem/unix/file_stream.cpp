@@ -5,9 +5,14 @@
 #if __ANDROID_API__ < __ANDROID_API_N__
 #define _FILE_OFFSET_BITS 64 /* LFS: 64 bit off_t */
 #endif
-#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <mango/core/string.hpp>
 #include <mango/core/exception.hpp>
@@ -15,6 +20,10 @@
 
 #define ID "[FileStream] "
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 namespace mango {
 namespace filesystem {
 
@@ -24,18 +33,52 @@ namespace filesystem {
 
 	struct FileHandle
 	{
-		FILE* m_file;
-        std::string m_filename;
+        // O_DIRECT requires the buffer, offset and size to be aligned
+        static constexpr size_t DIRECT_ALIGNMENT = 4096;
 
-        FileHandle(const std::string& filename, const char* mode)
-            : m_file(std::fopen(filename.c_str(), mode))
-            , m_filename(filename)
+        std::string m_filename;
+        int m_file;
+        bool m_write;
+        bool m_readable;
+        bool m_direct;
+
+        // pending writes or the read-ahead data
+        u8* m_buffer;
+        size_t m_capacity;
+        size_t m_begin { 0 };
+        size_t m_end { 0 };
+
+        FileHandle(const std::string& filename, int file, bool write, bool readable, size_t buffer_size, bool direct)
+            : m_filename(filename)
+            , m_file(file)
+            , m_write(write)
+            , m_readable(readable)
+            , m_direct(direct)
 		{
+            size_t alignment = MANGO_DEFAULT_ALIGNMENT;
+
+            if (m_direct)
+            {
+                alignment = DIRECT_ALIGNMENT;
+                buffer_size = std::max(buffer_size, alignment);
+                buffer_size = (buffer_size + alignment - 1) & ~(alignment - 1);
+            }
+
+            m_buffer = reinterpret_cast<u8*>(aligned_malloc(buffer_size, alignment));
+            m_capacity = buffer_size;
 		}
 
 		~FileHandle()
 		{
-            std::fclose(m_file);
+            if (m_write && m_end)
+            {
+                // errors can't be reported from the destructor
+                disableDirectIfUnaligned(m_end);
+                writeFile(m_buffer, m_end);
+            }
+
+            ::close(m_file);
+            aligned_free(m_buffer);
 		}
 
         const std::string& filename() const
@@ -43,55 +86,311 @@ namespace filesystem {
             return m_filename;
         }
 
+        void disableDirect()
+        {
+            if (m_direct)
+            {
+                m_direct = false;
+#if defined(O_DIRECT)
+                int flags = ::fcntl(m_file, F_GETFL);
+                ::fcntl(m_file, F_SETFL, flags & ~O_DIRECT);
+#elif defined(F_NOCACHE)
+                ::fcntl(m_file, F_NOCACHE, 0);
+#endif
+            }
+        }
+
+        void disableDirectIfUnaligned(u64 value)
+        {
+            if (value & (DIRECT_ALIGNMENT - 1))
+            {
+                disableDirect();
+            }
+        }
+
+        bool writeFile(const u8* data, size_t size)
+        {
+            while (size)
+            {
+                ssize_t bytes = ::write(m_file, data, size);
+                if (bytes < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+
+                data += bytes;
+                size -= size_t(bytes);
+            }
+
+            return true;
+        }
+
+        size_t readFile(u8* dest, size_t size)
+        {
+            size_t total = 0;
+
+            while (total < size)
+            {
+                ssize_t bytes = ::read(m_file, dest + total, size - total);
+                if (bytes < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    MANGO_EXCEPTION(ID"read() failed for \"%s\".", m_filename.c_str());
+                }
+
+                if (!bytes)
+                {
+                    // end of file
+                    break;
+                }
+
+                total += size_t(bytes);
+            }
+
+            return total;
+        }
+
+        void flush()
+        {
+            if (m_write)
+            {
+                if (m_end)
+                {
+                    disableDirectIfUnaligned(m_end);
+                    if (!writeFile(m_buffer, m_end))
+                    {
+                        MANGO_EXCEPTION(ID"write() failed for \"%s\".", m_filename.c_str());
+                    }
+                }
+            }
+            else
+            {
+                // move the file offset back to the first byte which was not consumed
+                if (m_end > m_begin)
+                {
+                    ::lseek(m_file, -off_t(m_end - m_begin), SEEK_CUR);
+                }
+                m_begin = 0;
+            }
+
+            m_end = 0;
+        }
+
         u64 size() const
 		{
             struct stat sb;
-            int fd = ::fileno(m_file);
-            ::fflush(m_file);
-            ::fstat(fd, &sb);
-            return sb.st_size;
+            ::fstat(m_file, &sb);
+            return std::max(u64(sb.st_size), offset());
 		}
 
 		u64 offset() const
 		{
-	        return ftello(m_file);
+            const u64 position = u64(::lseek(m_file, 0, SEEK_CUR));
+            return m_write ? position + m_end : position - (m_end - m_begin);
 		}
 
 		void seek(u64 distance, int method)
 		{
-	        fseeko(m_file, distance, method);
+            flush();
+
+            off_t position = ::lseek(m_file, off_t(distance), method);
+            if (position < 0)
+            {
+                MANGO_EXCEPTION(ID"lseek() failed for \"%s\".", m_filename.c_str());
+            }
+
+            if (m_direct)
+            {
+                disableDirectIfUnaligned(u64(position));
+            }
 		}
 
 	    void read(void* dest, size_t size)
 	    {
-    	    size_t status = std::fread(dest, 1, size, m_file);
-	        MANGO_UNREFERENCED_PARAMETER(status);
+            u8* d = reinterpret_cast<u8*>(dest);
+
+            // consume the read-ahead data first
+            size_t bytes = std::min(size, m_end - m_begin);
+            std::memcpy(d, m_buffer + m_begin, bytes);
+            m_begin += bytes;
+            d += bytes;
+            size -= bytes;
+
+            if (!size)
+            {
+                return;
+            }
+
+            if (size >= m_capacity)
+            {
+                // large reads skip the buffer
+                readFile(d, size);
+                return;
+            }
+
+            m_begin = 0;
+            m_end = readFile(m_buffer, m_capacity);
+
+            bytes = std::min(size, m_end);
+            std::memcpy(d, m_buffer, bytes);
+            m_begin = bytes;
 	    }
 
 	    void write(const void* data, size_t size)
 	    {
-	        size_t status = std::fwrite(data, 1, size, m_file);
-	        MANGO_UNREFERENCED_PARAMETER(status);
+            const u8* source = reinterpret_cast<const u8*>(data);
+
+            while (size)
+            {
+                if (!m_end && size >= m_capacity && !m_direct)
+                {
+                    // large writes skip the buffer
+                    if (!writeFile(source, size))
+                    {
+                        MANGO_EXCEPTION(ID"write() failed for \"%s\".", m_filename.c_str());
+                    }
+                    return;
+                }
+
+                const size_t bytes = std::min(size, m_capacity - m_end);
+                std::memcpy(m_buffer + m_end, source, bytes);
+                m_end += bytes;
+                source += bytes;
+                size -= bytes;
+
+                if (m_end == m_capacity)
+                {
+                    flush();
+                }
+            }
 	    }
+
+        void writev(const Memory* segments, size_t count)
+        {
+            flush();
+
+            iovec vectors[64];
+
+            while (count)
+            {
+                const int n = int(std::min(count, std::min(size_t(64), size_t(IOV_MAX))));
+                for (int i = 0; i < n; ++i)
+                {
+                    vectors[i].iov_base = segments[i].address;
+                    vectors[i].iov_len = segments[i].size;
+                }
+
+                segments += n;
+                count -= n;
+
+                iovec* vector = vectors;
+                int remain = n;
+
+                while (remain)
+                {
+                    ssize_t bytes = ::writev(m_file, vector, remain);
+                    if (bytes < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        MANGO_EXCEPTION(ID"writev() failed for \"%s\".", m_filename.c_str());
+                    }
+
+                    // skip the segments which were written completely
+                    while (remain && size_t(bytes) >= vector->iov_len)
+                    {
+                        bytes -= vector->iov_len;
+                        ++vector;
+                        --remain;
+                    }
+
+                    if (remain)
+                    {
+                        vector->iov_base = reinterpret_cast<u8*>(vector->iov_base) + bytes;
+                        vector->iov_len -= size_t(bytes);
+                    }
+                }
+            }
+        }
+
+        size_t readAt(u64 offset, void* dest, size_t size) const
+        {
+            if (!m_readable)
+            {
+                MANGO_EXCEPTION(ID"\"%s\" is opened without read access.", m_filename.c_str());
+            }
+
+            u8* d = reinterpret_cast<u8*>(dest);
+            size_t total = 0;
+
+            while (total < size)
+            {
+                ssize_t bytes = ::pread(m_file, d + total, size - total, off_t(offset + total));
+                if (bytes < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    MANGO_EXCEPTION(ID"pread() failed for \"%s\".", m_filename.c_str());
+                }
+
+                if (!bytes)
+                {
+                    // end of file
+                    break;
+                }
+
+                total += size_t(bytes);
+            }
+
+            return total;
+        }
+
+        void writeAt(u64 offset, const void* data, size_t size)
+        {
+            const u8* source = reinterpret_cast<const u8*>(data);
+
+            while (size)
+            {
+                ssize_t bytes = ::pwrite(m_file, source, size, off_t(offset));
+                if (bytes < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    MANGO_EXCEPTION(ID"pwrite() failed for \"%s\".", m_filename.c_str());
+                }
+
+                source += bytes;
+                offset += u64(bytes);
+                size -= size_t(bytes);
+            }
+        }
 	};
 
     // -----------------------------------------------------------------
     // FileStream
     // -----------------------------------------------------------------
 
-    FileStream::FileStream(const std::string& filename, OpenMode openmode)
+    FileStream::FileStream(const std::string& filename, OpenMode openmode, size_t buffer_size, u32 flags)
         : m_handle(nullptr)
     {
-		const char* mode;
+        int oflags;
+        bool write = false;
+        bool direct = false;
 
        	switch (openmode)
         {
    	        case READ:
-                mode = "rb";
+                oflags = O_RDONLY;
                 break;
 
    	        case WRITE:
-       	        mode = "wb";
+                // read access for readAt()
+                oflags = O_RDWR | O_CREAT | O_TRUNC;
+                write = true;
+                direct = (flags & DIRECT) != 0;
            	    break;
 
             default:
@@ -99,7 +398,50 @@ namespace filesystem {
                 break;
         }
 
-		m_handle = new FileHandle(filename, mode);
+#if defined(O_DIRECT)
+        if (direct)
+        {
+            oflags |= O_DIRECT;
+        }
+#endif
+
+#if defined(O_CLOEXEC)
+        oflags |= O_CLOEXEC;
+#endif
+
+        int file = ::open(filename.c_str(), oflags, 0666);
+
+        if (file < 0 && write && errno == EACCES)
+        {
+            // the target only permits writing; readAt() is not available
+            oflags = (oflags & ~O_RDWR) | O_WRONLY;
+            file = ::open(filename.c_str(), oflags, 0666);
+        }
+
+        const bool readable = (oflags & O_ACCMODE) != O_WRONLY;
+
+#if defined(O_DIRECT)
+        if (file < 0 && direct && errno == EINVAL)
+        {
+            // the filesystem does not support direct I/O
+            direct = false;
+            file = ::open(filename.c_str(), oflags & ~O_DIRECT, 0666);
+        }
+#elif defined(F_NOCACHE)
+        if (file >= 0 && direct)
+        {
+            ::fcntl(file, F_NOCACHE, 1);
+        }
+#else
+        direct = false;
+#endif
+
+        if (file < 0)
+        {
+            MANGO_EXCEPTION(ID"open() failed for \"%s\".", filename.c_str());
+        }
+
+		m_handle = new FileHandle(filename, file, write, readable, buffer_size, direct);
     }
 
     FileStream::~FileStream()
@@ -112,6 +454,21 @@ namespace filesystem {
         return m_handle->filename();
     }
 
+    void FileStream::flush()
+    {
+        m_handle->flush();
+    }
+
+    size_t FileStream::readAt(u64 offset, void* dest, size_t size) const
+    {
+        return m_handle->readAt(offset, dest, size);
+    }
+
+    void FileStream::writeAt(u64 offset, const void* data, size_t size)
+    {
+        m_handle->writeAt(offset, data, size);
+    }
+
     u64 FileStream::size() const
     {
 		return m_handle->size();
@@ -157,5 +514,18 @@ namespace filesystem {
 		m_handle->write(data, size);
     }
 
+    void FileStream::writev(const Memory* segments, size_t count)
+    {
+        if (m_handle->m_direct)
+        {
+            // the segments are not aligned; stage them in the buffer
+            Stream::writev(segments, count);
+        }
+        else
+        {
+            m_handle->writev(segments, count);
+        }
+    }
+
 } // namespace filesystem
 } // namespace mango
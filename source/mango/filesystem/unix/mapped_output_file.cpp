@@ -0,0 +1,374 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#if __ANDROID_API__ < __ANDROID_API_N__
+#define _FILE_OFFSET_BITS 64 /* LFS: 64 bit off_t */
+#endif
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <mango/core/string.hpp>
+#include <mango/core/exception.hpp>
+#include <mango/filesystem/file.hpp>
+
+#define ID "[MappedOutputFile] "
+
+namespace mango {
+namespace filesystem {
+
+    // -----------------------------------------------------------------
+    // MappedHandle
+    // -----------------------------------------------------------------
+
+    struct MappedHandle
+    {
+        // the mapping grows at least this much at a time
+        static constexpr u64 CHUNK_SIZE = 4 * 1024 * 1024;
+
+        // the pages of the larger writes are faulted in before copying
+        static constexpr size_t POPULATE_THRESHOLD = 256 * 1024;
+
+        std::string m_filename;
+        int m_file;
+
+        u8* m_address { nullptr };
+        u64 m_capacity { 0 };
+        u64 m_size { 0 };
+        u64 m_offset { 0 };
+
+        MappedHandle(const std::string& filename, int file, u64 reserve)
+            : m_filename(filename)
+            , m_file(file)
+        {
+            if (reserve)
+            {
+                remap(reserve);
+            }
+        }
+
+        ~MappedHandle()
+        {
+            // errors can't be reported from the destructor
+            close(false);
+        }
+
+        const std::string& filename() const
+        {
+            return m_filename;
+        }
+
+        bool allocate(u64 capacity)
+        {
+#if defined(MANGO_PLATFORM_LINUX) || defined(MANGO_PLATFORM_ANDROID)
+            // reserve the disk blocks now so that a full disk is an error here
+            // instead of SIGBUS when the mapping is written
+            if (!::fallocate(m_file, 0, off_t(m_capacity), off_t(capacity - m_capacity)))
+            {
+                return true;
+            }
+
+            if (errno != EOPNOTSUPP && errno != ENOSYS)
+            {
+                return false;
+            }
+
+            // the filesystem doesn't support preallocation; posix_fallocate() writes
+            // the blocks instead, which is slower but still reserves them
+            return ::posix_fallocate(m_file, off_t(m_capacity), off_t(capacity - m_capacity)) == 0;
+#else
+            return ::ftruncate(m_file, off_t(capacity)) == 0;
+#endif
+        }
+
+        void grow(u64 required)
+        {
+            u64 capacity = std::max(required, m_capacity * 2);
+            capacity = std::max(capacity, CHUNK_SIZE);
+            remap(capacity);
+        }
+
+        void remap(u64 capacity)
+        {
+            const u64 page_mask = u64(::sysconf(_SC_PAGESIZE) - 1);
+            capacity = (capacity + page_mask) & ~page_mask;
+
+            if (capacity != u64(size_t(capacity)))
+            {
+                MANGO_EXCEPTION(ID"\"%s\" is too large to be mapped.", m_filename.c_str());
+            }
+
+            if (!allocate(capacity))
+            {
+                MANGO_EXCEPTION(ID"Extending \"%s\" failed.", m_filename.c_str());
+            }
+
+            void* address;
+
+#if defined(MREMAP_MAYMOVE)
+            if (m_address)
+            {
+                address = ::mremap(m_address, size_t(m_capacity), size_t(capacity), MREMAP_MAYMOVE);
+            }
+            else
+#endif
+            {
+                if (m_address)
+                {
+                    ::munmap(m_address, size_t(m_capacity));
+                    m_address = nullptr;
+                    m_capacity = 0;
+                }
+
+                address = ::mmap(nullptr, size_t(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+            }
+
+            if (address == MAP_FAILED)
+            {
+                MANGO_EXCEPTION(ID"Memory mapping \"%s\" failed.", m_filename.c_str());
+            }
+
+            m_address = reinterpret_cast<u8*>(address);
+            m_capacity = capacity;
+        }
+
+        bool close(bool report)
+        {
+            if (m_file < 0)
+            {
+                return true;
+            }
+
+            bool status = true;
+
+            if (m_address)
+            {
+                ::munmap(m_address, size_t(m_capacity));
+                m_address = nullptr;
+            }
+
+            // drop the preallocated tail
+            if (::ftruncate(m_file, off_t(m_size)))
+            {
+                status = false;
+            }
+
+            if (::close(m_file))
+            {
+                status = false;
+            }
+
+            m_file = -1;
+
+            if (!status && report)
+            {
+                MANGO_EXCEPTION(ID"Closing \"%s\" failed.", m_filename.c_str());
+            }
+
+            return status;
+        }
+
+        void check() const
+        {
+            if (m_file < 0)
+            {
+                MANGO_EXCEPTION(ID"\"%s\" is closed.", m_filename.c_str());
+            }
+        }
+
+        u8* acquire(size_t size)
+        {
+            check();
+
+            const u64 required = m_offset + size;
+            if (required > m_capacity)
+            {
+                grow(required);
+            }
+
+            return m_address + m_offset;
+        }
+
+        void commit(size_t size)
+        {
+            m_offset += size;
+            m_size = std::max(m_size, m_offset);
+        }
+
+        void populate(u8* address, size_t size)
+        {
+#if defined(MADV_POPULATE_WRITE)
+            if (size >= POPULATE_THRESHOLD)
+            {
+                // fault in the pages with one call instead of one fault per page
+                const uintptr_t page_mask = uintptr_t(::sysconf(_SC_PAGESIZE) - 1);
+                const uintptr_t begin = reinterpret_cast<uintptr_t>(address) & ~page_mask;
+                const uintptr_t end = reinterpret_cast<uintptr_t>(address) + size;
+                ::madvise(reinterpret_cast<void*>(begin), size_t(end - begin), MADV_POPULATE_WRITE);
+            }
+#else
+            MANGO_UNREFERENCED_PARAMETER(address);
+            MANGO_UNREFERENCED_PARAMETER(size);
+#endif
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // MappedOutputFile
+    // -----------------------------------------------------------------
+
+    bool MappedOutputFile::isMappable(const std::string& filename)
+    {
+#if defined(MANGO_PLATFORM_LINUX) || defined(MANGO_PLATFORM_ANDROID)
+        struct stat s;
+        if (::stat(filename.c_str(), &s))
+        {
+            // the file will be created
+            return errno == ENOENT;
+        }
+
+        // pipes and devices can't be mapped
+        return S_ISREG(s.st_mode);
+#else
+        // without preallocation a full disk would raise SIGBUS
+        MANGO_UNREFERENCED_PARAMETER(filename);
+        return false;
+#endif
+    }
+
+    MappedOutputFile::MappedOutputFile(const std::string& filename, u64 reserve)
+        : m_handle(nullptr)
+    {
+        int oflags = O_RDWR | O_CREAT | O_TRUNC;
+
+#if defined(O_CLOEXEC)
+        oflags |= O_CLOEXEC;
+#endif
+
+        int file = ::open(filename.c_str(), oflags, 0666);
+        if (file < 0)
+        {
+            MANGO_EXCEPTION(ID"open() failed for \"%s\".", filename.c_str());
+        }
+
+        try
+        {
+            m_handle = new MappedHandle(filename, file, reserve);
+        }
+        catch (...)
+        {
+            ::close(file);
+            throw;
+        }
+    }
+
+    MappedOutputFile::~MappedOutputFile()
+    {
+        delete m_handle;
+    }
+
+    const std::string& MappedOutputFile::filename() const
+    {
+        return m_handle->filename();
+    }
+
+    void MappedOutputFile::close()
+    {
+        m_handle->close(true);
+    }
+
+    u64 MappedOutputFile::size() const
+    {
+        return m_handle->m_size;
+    }
+
+    u64 MappedOutputFile::offset() const
+    {
+        return m_handle->m_offset;
+    }
+
+    void MappedOutputFile::seek(u64 distance, SeekMode mode)
+    {
+        m_handle->check();
+
+        switch (mode)
+        {
+            case BEGIN:
+                m_handle->m_offset = distance;
+                break;
+
+            case CURRENT:
+                m_handle->m_offset += distance;
+                break;
+
+            case END:
+                m_handle->m_offset = m_handle->m_size - distance;
+                break;
+
+            default:
+                MANGO_EXCEPTION(ID"Invalid seek mode.");
+        }
+    }
+
+    void MappedOutputFile::read(void* dest, size_t size)
+    {
+        m_handle->check();
+
+        const u64 offset = m_handle->m_offset;
+        if (offset + size > m_handle->m_size)
+        {
+            MANGO_EXCEPTION(ID"Reading past the end of \"%s\".", m_handle->m_filename.c_str());
+        }
+
+        std::memcpy(dest, m_handle->m_address + offset, size);
+        m_handle->m_offset += size;
+    }
+
+    void MappedOutputFile::write(const void* data, size_t size)
+    {
+        u8* dest = m_handle->acquire(size);
+        m_handle->populate(dest, size);
+        std::memcpy(dest, data, size);
+        m_handle->commit(size);
+    }
+
+    void MappedOutputFile::writev(const Memory* segments, size_t count)
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            bytes += segments[i].size;
+        }
+
+        u8* dest = m_handle->acquire(bytes);
+        m_handle->populate(dest, bytes);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            std::memcpy(dest, segments[i].address, segments[i].size);
+            dest += segments[i].size;
+        }
+
+        m_handle->commit(bytes);
+    }
+
+    u8* MappedOutputFile::acquire(size_t size)
+    {
+        u8* address = m_handle->acquire(size);
+        m_handle->populate(address, size);
+        return address;
+    }
+
+    void MappedOutputFile::commit(size_t size)
+    {
+        m_handle->check();
+        m_handle->commit(size);
+    }
+
+} // namespace filesystem
+} // namespace mango
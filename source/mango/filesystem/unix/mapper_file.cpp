@@ -9,6 +9,7 @@
 
 #define ID "[mapper.file] "
 
+#include <cstdlib>
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -44,7 +45,7 @@ namespace
 		void* m_address;
 
     public:
-        FileMemory(const std::string& filename, u64 x_offset, u64 x_size)
+        FileMemory(const std::string& filename, u64 x_offset, u64 x_size, u32 flags)
             : m_file(-1)
             , m_size(0)
             , m_address(nullptr)
@@ -74,22 +75,37 @@ namespace
 						page_offset = page_number * page_size;
 					}
 
-					m_size = file_size - file_offset;
+					size_t size = file_size - file_offset;
 					if (x_size > 0)
 					{
-						m_size = std::min(size_t(x_size), m_size);
+						size = std::min(size_t(x_size), size);
 					}
 
-                    if (m_size > 0)
+                    if (size > 0)
                     {
-                        m_address = ::mmap(nullptr, m_size, PROT_READ, MAP_FILE | MAP_SHARED, m_file, page_offset);
+                        int mflags = MAP_FILE | MAP_SHARED;
+#ifdef MAP_POPULATE
+                        if (flags & Mapping::POPULATE)
+                        {
+                            // the kernel faults in the mapping; advise() doesn't have to
+                            mflags |= MAP_POPULATE;
+                            flags &= ~Mapping::POPULATE;
+                        }
+#endif
+
+                        // the mapping starts from the page boundary
+                        m_size = size + (file_offset - page_offset);
+                        m_address = ::mmap(nullptr, m_size, PROT_READ, mflags, m_file, page_offset);
 
                         if (m_address == MAP_FAILED)
                         {
+                            m_address = nullptr;
                             MANGO_EXCEPTION(ID"Memory mapping \"%s\" failed.", filename.c_str());
                         }
 
-                        m_memory.size = m_size;
+                        advise(Memory(reinterpret_cast<u8*>(m_address), m_size), flags);
+
+                        m_memory.size = size;
                         m_memory.address = reinterpret_cast<u8*>(m_address) + (file_offset - page_offset);
                     }
                     else
@@ -234,11 +250,47 @@ namespace
 
 #endif
 
-        VirtualMemory* mmap(const std::string& filename) override
+        VirtualMemory* mmap(const std::string& filename, u32 flags) override
         {
-            VirtualMemory* memory = new FileMemory(m_basepath + filename, 0, 0);
+            VirtualMemory* memory = new FileMemory(m_basepath + filename, 0, 0, flags);
             return memory;
         }
+
+        std::string getIdentity(const std::string& filename) const override
+        {
+            std::string testname = m_basepath + filename;
+
+            char* path = ::realpath(testname.c_str(), nullptr);
+            if (!path)
+            {
+                return std::string();
+            }
+
+            std::string canonical(path);
+            ::free(path);
+
+            struct stat s;
+            if (::stat(canonical.c_str(), &s) != 0)
+            {
+                return std::string();
+            }
+
+            // nanosecond timestamps catch rewrites within the same second and the
+            // change time catches the writers which restore the modification time
+#if defined(MANGO_PLATFORM_OSX) || defined(MANGO_PLATFORM_IOS)
+            const struct timespec& mtime = s.st_mtimespec;
+            const struct timespec& ctime = s.st_ctimespec;
+#else
+            const struct timespec& mtime = s.st_mtim;
+            const struct timespec& ctime = s.st_ctim;
+#endif
+
+            return makeString("%s|%llx|%llx|%llx.%lx|%llx.%lx|%llx", canonical.c_str(),
+                (unsigned long long)s.st_dev, (unsigned long long)s.st_ino,
+                (unsigned long long)mtime.tv_sec, (unsigned long)mtime.tv_nsec,
+                (unsigned long long)ctime.tv_sec, (unsigned long)ctime.tv_nsec,
+                (unsigned long long)s.st_size);
+        }
     };
 
 } // namespace
@@ -246,6 +298,66 @@ namespace
 namespace mango {
 namespace filesystem {
 
+    // -----------------------------------------------------------------
+    // advise()
+    // -----------------------------------------------------------------
+
+    void advise(Memory memory, u32 flags)
+    {
+        if (!memory.address || !memory.size)
+        {
+            return;
+        }
+
+        // madvise() requires page aligned address
+        const uintptr_t page_mask = uintptr_t(get_pagesize() - 1);
+        const uintptr_t begin = reinterpret_cast<uintptr_t>(memory.address) & ~page_mask;
+        const uintptr_t end = reinterpret_cast<uintptr_t>(memory.address) + memory.size;
+
+        void* address = reinterpret_cast<void*>(begin);
+        const size_t size = size_t(end - begin);
+
+        // the hints are best effort; errors are ignored
+
+        if (flags & Mapping::SEQUENTIAL)
+        {
+            ::posix_madvise(address, size, POSIX_MADV_SEQUENTIAL);
+        }
+        else if (flags & Mapping::RANDOM)
+        {
+            ::posix_madvise(address, size, POSIX_MADV_RANDOM);
+        }
+
+        if (flags & Mapping::WILLNEED)
+        {
+            ::posix_madvise(address, size, POSIX_MADV_WILLNEED);
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (flags & Mapping::HUGEPAGE)
+        {
+            ::madvise(address, size, MADV_HUGEPAGE);
+        }
+#endif
+
+        if (flags & Mapping::POPULATE)
+        {
+#ifdef MADV_POPULATE_READ
+            if (!::madvise(address, size, MADV_POPULATE_READ))
+            {
+                return;
+            }
+#endif
+            // touch every page to fault in the range
+            const size_t page_size = size_t(get_pagesize());
+            volatile const u8* p = reinterpret_cast<volatile const u8*>(address);
+            for (size_t offset = 0; offset < size; offset += page_size)
+            {
+                (void) p[offset];
+            }
+        }
+    }
+
     // -----------------------------------------------------------------
     // Mapper::createFileMapper()
     // -----------------------------------------------------------------
@@ -2,6 +2,8 @@
     MANGO Multimedia Development Platform
     Copyright (C) 2012-2016 Twilight Finland 3D Oy Ltd. All rights reserved.
 */
+#include <algorithm>
+#include <mutex>
 #include <mango/core/string.hpp>
 #include <mango/core/exception.hpp>
 #include <mango/filesystem/file.hpp>
@@ -19,15 +21,25 @@ namespace filesystem {
 	{
         std::string m_filename;
 		HANDLE m_handle;
+        DWORD m_access;
 
-		FileHandle(const std::string& filename, HANDLE handle)
+        std::mutex m_positional_mutex;
+        HANDLE m_positional { INVALID_HANDLE_VALUE };
+
+		FileHandle(const std::string& filename, HANDLE handle, DWORD access)
 		    : m_filename(filename)
             , m_handle(handle)
+            , m_access(access)
 		{
 		}
 
 		~FileHandle()
 		{
+            if (m_positional != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(m_positional);
+            }
+
             CloseHandle(m_handle);
 		}
 
@@ -75,15 +87,114 @@ namespace filesystem {
 			MANGO_UNREFERENCED_PARAMETER(status);
 			MANGO_UNREFERENCED_PARAMETER(bytes_written);
 	    }
+
+        // the positional calls use a separate handle because ReadFile() and WriteFile()
+        // move the file pointer of a synchronous handle even when the offset is given
+        HANDLE positional()
+        {
+            std::lock_guard<std::mutex> lock(m_positional_mutex);
+            if (m_positional == INVALID_HANDLE_VALUE)
+            {
+                m_positional = ReOpenFile(m_handle, m_access, FILE_SHARE_READ | FILE_SHARE_WRITE, FILE_FLAG_OVERLAPPED);
+                if (m_positional == INVALID_HANDLE_VALUE)
+                {
+                    MANGO_EXCEPTION(ID"ReOpenFile() failed.");
+                }
+            }
+            return m_positional;
+        }
+
+        size_t readAt(u64 offset, void* dest, size_t size)
+        {
+            if (!(m_access & GENERIC_READ))
+            {
+                MANGO_EXCEPTION(ID"\"%s\" is opened without read access.", m_filename.c_str());
+            }
+
+            HANDLE handle = positional();
+            u8* d = reinterpret_cast<u8*>(dest);
+            size_t total = 0;
+
+            while (total < size)
+            {
+                OVERLAPPED overlapped = { 0 };
+                overlapped.Offset = DWORD(offset + total);
+                overlapped.OffsetHigh = DWORD((offset + total) >> 32);
+                overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+                DWORD bytes_read = 0;
+                DWORD bytes = DWORD(std::min(size - total, size_t(0x40000000)));
+                BOOL status = ReadFile(handle, d + total, bytes, NULL, &overlapped);
+                if (status || GetLastError() == ERROR_IO_PENDING)
+                {
+                    status = GetOverlappedResult(handle, &overlapped, &bytes_read, TRUE);
+                }
+                DWORD error = status ? ERROR_SUCCESS : GetLastError();
+                CloseHandle(overlapped.hEvent);
+
+                if (!status && error != ERROR_HANDLE_EOF)
+                {
+                    MANGO_EXCEPTION(ID"ReadFile() failed.");
+                }
+
+                if (!bytes_read)
+                {
+                    // end of file
+                    break;
+                }
+
+                total += bytes_read;
+            }
+
+            return total;
+        }
+
+        void writeAt(u64 offset, const void* data, size_t size)
+        {
+            HANDLE handle = positional();
+            const u8* source = reinterpret_cast<const u8*>(data);
+
+            while (size)
+            {
+                OVERLAPPED overlapped = { 0 };
+                overlapped.Offset = DWORD(offset);
+                overlapped.OffsetHigh = DWORD(offset >> 32);
+                overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+                DWORD bytes_written = 0;
+                DWORD bytes = DWORD(std::min(size, size_t(0x40000000)));
+                BOOL status = WriteFile(handle, source, bytes, NULL, &overlapped);
+                if (status || GetLastError() == ERROR_IO_PENDING)
+                {
+                    status = GetOverlappedResult(handle, &overlapped, &bytes_written, TRUE);
+                }
+                CloseHandle(overlapped.hEvent);
+
+                if (!status)
+                {
+                    MANGO_EXCEPTION(ID"WriteFile() failed.");
+                }
+
+                source += bytes_written;
+                offset += bytes_written;
+                size -= bytes_written;
+            }
+        }
 	};
 
     // -----------------------------------------------------------------
     // FileStream
     // -----------------------------------------------------------------
 
-    FileStream::FileStream(const std::string& filename, OpenMode mode)
+    // The writes go to the file without user-space buffering on Windows, so the
+    // buffer size and the flags are not used.
+
+    FileStream::FileStream(const std::string& filename, OpenMode mode, size_t buffer_size, u32 flags)
         : m_handle(nullptr)
     {
+        MANGO_UNREFERENCED_PARAMETER(buffer_size);
+        MANGO_UNREFERENCED_PARAMETER(flags);
+
         DWORD access;
         DWORD disposition;
 
@@ -95,7 +206,8 @@ namespace filesystem {
                 break;
 
             case WRITE:
-                access = GENERIC_WRITE;
+                // read access for readAt()
+                access = GENERIC_READ | GENERIC_WRITE;
                 disposition = CREATE_ALWAYS;
                 break;
 
@@ -105,13 +217,21 @@ namespace filesystem {
         }
 
         // TODO: mode parameter
-        HANDLE handle = CreateFileW(u16_fromBytes(filename).c_str(), access, 0, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+        // share access with the handle of the positional calls
+        HANDLE handle = CreateFileW(u16_fromBytes(filename).c_str(), access, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (handle == INVALID_HANDLE_VALUE && mode == WRITE && GetLastError() == ERROR_ACCESS_DENIED)
+        {
+            // the target only permits writing; readAt() is not available
+            access = GENERIC_WRITE;
+            handle = CreateFileW(u16_fromBytes(filename).c_str(), access, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL);
+        }
+
         if (handle == INVALID_HANDLE_VALUE)
         {
             MANGO_EXCEPTION(ID"CreateFileW() failed.");
         }
 
-		m_handle = new FileHandle(filename, handle);
+		m_handle = new FileHandle(filename, handle, access);
     }
 
     FileStream::~FileStream()
@@ -124,6 +244,21 @@ namespace filesystem {
         return m_handle->filename();
     }
 
+    void FileStream::flush()
+    {
+        // nothing is buffered
+    }
+
+    size_t FileStream::readAt(u64 offset, void* dest, size_t size) const
+    {
+        return m_handle->readAt(offset, dest, size);
+    }
+
+    void FileStream::writeAt(u64 offset, const void* data, size_t size)
+    {
+        m_handle->writeAt(offset, data, size);
+    }
+
     u64 FileStream::size() const
     {
         return m_handle->size();
@@ -169,5 +304,10 @@ namespace filesystem {
 		m_handle->write(data, size);
     }
 
+    void FileStream::writev(const Memory* segments, size_t count)
+    {
+        Stream::writev(segments, count);
+    }
+
 } // namespace filesystem
 } // namespace mango
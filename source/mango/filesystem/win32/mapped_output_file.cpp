@@ -0,0 +1,310 @@
+/*
+    MANGO Multimedia Development Platform
+    Copyright (C) 2012-2019 Twilight Finland 3D Oy Ltd. All rights reserved.
+*/
+#include <algorithm>
+#include <cstring>
+#include <mango/core/string.hpp>
+#include <mango/core/exception.hpp>
+#include <mango/filesystem/file.hpp>
+
+#define ID "[MappedOutputFile] "
+
+namespace mango {
+namespace filesystem {
+
+    // -----------------------------------------------------------------
+    // MappedHandle
+    // -----------------------------------------------------------------
+
+    struct MappedHandle
+    {
+        // the mapping grows at least this much at a time
+        static constexpr u64 CHUNK_SIZE = 4 * 1024 * 1024;
+
+        std::string m_filename;
+        HANDLE m_file;
+        HANDLE m_map { nullptr };
+
+        u8* m_address { nullptr };
+        u64 m_capacity { 0 };
+        u64 m_size { 0 };
+        u64 m_offset { 0 };
+
+        MappedHandle(const std::string& filename, HANDLE file, u64 reserve)
+            : m_filename(filename)
+            , m_file(file)
+        {
+            if (reserve)
+            {
+                remap(reserve);
+            }
+        }
+
+        ~MappedHandle()
+        {
+            // errors can't be reported from the destructor
+            close(false);
+        }
+
+        const std::string& filename() const
+        {
+            return m_filename;
+        }
+
+        void unmap()
+        {
+            if (m_address)
+            {
+                UnmapViewOfFile(m_address);
+                m_address = nullptr;
+            }
+
+            if (m_map)
+            {
+                CloseHandle(m_map);
+                m_map = nullptr;
+            }
+        }
+
+        void grow(u64 required)
+        {
+            u64 capacity = std::max(required, m_capacity * 2);
+            capacity = std::max(capacity, CHUNK_SIZE);
+            remap(capacity);
+        }
+
+        void remap(u64 capacity)
+        {
+            SYSTEM_INFO info;
+            ::GetSystemInfo(&info);
+            const u64 granularity_mask = u64(info.dwAllocationGranularity - 1);
+            capacity = (capacity + granularity_mask) & ~granularity_mask;
+
+            if (capacity != u64(size_t(capacity)))
+            {
+                MANGO_EXCEPTION(ID"\"%s\" is too large to be mapped.", m_filename.c_str());
+            }
+
+            // a view can't be extended; the file mapping of the larger size
+            // extends the file and the view is mapped again
+            unmap();
+            m_capacity = 0;
+
+            m_map = CreateFileMappingW(m_file, NULL, PAGE_READWRITE, DWORD(capacity >> 32), DWORD(capacity & 0xffffffff), NULL);
+            if (!m_map)
+            {
+                MANGO_EXCEPTION(ID"Extending \"%s\" failed.", m_filename.c_str());
+            }
+
+            m_address = reinterpret_cast<u8*>(MapViewOfFile(m_map, FILE_MAP_WRITE, 0, 0, size_t(capacity)));
+            if (!m_address)
+            {
+                MANGO_EXCEPTION(ID"Memory mapping \"%s\" failed.", m_filename.c_str());
+            }
+
+            m_capacity = capacity;
+        }
+
+        bool close(bool report)
+        {
+            if (m_file == INVALID_HANDLE_VALUE)
+            {
+                return true;
+            }
+
+            unmap();
+
+            // drop the preallocated tail
+            LARGE_INTEGER position;
+            position.QuadPart = LONGLONG(m_size);
+
+            bool status = SetFilePointerEx(m_file, position, NULL, FILE_BEGIN) && SetEndOfFile(m_file);
+
+            if (!CloseHandle(m_file))
+            {
+                status = false;
+            }
+
+            m_file = INVALID_HANDLE_VALUE;
+
+            if (!status && report)
+            {
+                MANGO_EXCEPTION(ID"Closing \"%s\" failed.", m_filename.c_str());
+            }
+
+            return status;
+        }
+
+        void check() const
+        {
+            if (m_file == INVALID_HANDLE_VALUE)
+            {
+                MANGO_EXCEPTION(ID"\"%s\" is closed.", m_filename.c_str());
+            }
+        }
+
+        u8* acquire(size_t size)
+        {
+            check();
+
+            const u64 required = m_offset + size;
+            if (required > m_capacity)
+            {
+                grow(required);
+            }
+
+            return m_address + m_offset;
+        }
+
+        void commit(size_t size)
+        {
+            m_offset += size;
+            m_size = std::max(m_size, m_offset);
+        }
+    };
+
+    // -----------------------------------------------------------------
+    // MappedOutputFile
+    // -----------------------------------------------------------------
+
+    bool MappedOutputFile::isMappable(const std::string& filename)
+    {
+        // pipes and devices such as \\.\pipe\name can't be mapped
+        if (filename.compare(0, 4, "\\\\.\\") == 0)
+        {
+            return false;
+        }
+
+        DWORD attributes = GetFileAttributesW(u16_fromBytes(filename).c_str());
+        if (attributes == INVALID_FILE_ATTRIBUTES)
+        {
+            // the file will be created
+            DWORD error = GetLastError();
+            return error == ERROR_FILE_NOT_FOUND;
+        }
+
+        return !(attributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_DEVICE));
+    }
+
+    MappedOutputFile::MappedOutputFile(const std::string& filename, u64 reserve)
+        : m_handle(nullptr)
+    {
+        HANDLE file = CreateFileW(u16_fromBytes(filename).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            MANGO_EXCEPTION(ID"CreateFileW() failed for \"%s\".", filename.c_str());
+        }
+
+        try
+        {
+            m_handle = new MappedHandle(filename, file, reserve);
+        }
+        catch (...)
+        {
+            CloseHandle(file);
+            throw;
+        }
+    }
+
+    MappedOutputFile::~MappedOutputFile()
+    {
+        delete m_handle;
+    }
+
+    const std::string& MappedOutputFile::filename() const
+    {
+        return m_handle->filename();
+    }
+
+    void MappedOutputFile::close()
+    {
+        m_handle->close(true);
+    }
+
+    u64 MappedOutputFile::size() const
+    {
+        return m_handle->m_size;
+    }
+
+    u64 MappedOutputFile::offset() const
+    {
+        return m_handle->m_offset;
+    }
+
+    void MappedOutputFile::seek(u64 distance, SeekMode mode)
+    {
+        m_handle->check();
+
+        switch (mode)
+        {
+            case BEGIN:
+                m_handle->m_offset = distance;
+                break;
+
+            case CURRENT:
+                m_handle->m_offset += distance;
+                break;
+
+            case END:
+                m_handle->m_offset = m_handle->m_size - distance;
+                break;
+
+            default:
+                MANGO_EXCEPTION(ID"Invalid seek mode.");
+        }
+    }
+
+    void MappedOutputFile::read(void* dest, size_t size)
+    {
+        m_handle->check();
+
+        const u64 offset = m_handle->m_offset;
+        if (offset + size > m_handle->m_size)
+        {
+            MANGO_EXCEPTION(ID"Reading past the end of \"%s\".", m_handle->m_filename.c_str());
+        }
+
+        std::memcpy(dest, m_handle->m_address + offset, size);
+        m_handle->m_offset += size;
+    }
+
+    void MappedOutputFile::write(const void* data, size_t size)
+    {
+        u8* dest = m_handle->acquire(size);
+        std::memcpy(dest, data, size);
+        m_handle->commit(size);
+    }
+
+    void MappedOutputFile::writev(const Memory* segments, size_t count)
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            bytes += segments[i].size;
+        }
+
+        u8* dest = m_handle->acquire(bytes);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            std::memcpy(dest, segments[i].address, segments[i].size);
+            dest += segments[i].size;
+        }
+
+        m_handle->commit(bytes);
+    }
+
+    u8* MappedOutputFile::acquire(size_t size)
+    {
+        return m_handle->acquire(size);
+    }
+
+    void MappedOutputFile::commit(size_t size)
+    {
+        m_handle->check();
+        m_handle->commit(size);
+    }
+
+} // namespace filesystem
+} // namespace mango
@@ -30,12 +30,23 @@ namespace
         HANDLE  m_map;
 
     public:
-        FileMemory(const std::string& filename, u64 x_offset, u64 x_size)
+        FileMemory(const std::string& filename, u64 x_offset, u64 x_size, u32 flags)
             : m_address(nullptr)
             , m_file(INVALID_HANDLE_VALUE)
             , m_map(nullptr)
         {
-			m_file = CreateFileW(u16_fromBytes(filename).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            // the access pattern hints are given to the cache manager when opening the file
+            DWORD attributes = FILE_ATTRIBUTE_NORMAL;
+            if (flags & Mapping::SEQUENTIAL)
+            {
+                attributes |= FILE_FLAG_SEQUENTIAL_SCAN;
+            }
+            else if (flags & Mapping::RANDOM)
+            {
+                attributes |= FILE_FLAG_RANDOM_ACCESS;
+            }
+
+			m_file = CreateFileW(u16_fromBytes(filename).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, attributes, NULL);
 
 			// special handling when too long filename
 			if (m_file == INVALID_HANDLE_VALUE)
@@ -194,11 +205,48 @@ namespace
             }
         }
 
-        VirtualMemory* mmap(const std::string& filename) override
+        VirtualMemory* mmap(const std::string& filename, u32 flags) override
         {
-            VirtualMemory* memory = new FileMemory(m_basepath + filename, 0, 0);
+            VirtualMemory* memory = new FileMemory(m_basepath + filename, 0, 0, flags);
             return memory;
         }
+
+        std::string getIdentity(const std::string& filename) const override
+        {
+            std::wstring testname = u16_fromBytes(m_basepath + filename);
+
+            wchar_t path[MAX_PATH];
+            DWORD length = GetFullPathNameW(testname.c_str(), MAX_PATH, path, NULL);
+            if (!length || length >= MAX_PATH)
+            {
+                return std::string();
+            }
+
+            HANDLE file = CreateFileW(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE)
+            {
+                return std::string();
+            }
+
+            BY_HANDLE_FILE_INFORMATION info;
+            BOOL status = GetFileInformationByHandle(file, &info);
+            CloseHandle(file);
+
+            if (!status)
+            {
+                return std::string();
+            }
+
+            // the filenames are case insensitive
+            std::string canonical = toLower(u16_toBytes(std::wstring(path, length)));
+
+            return makeString("%s|%x|%x%08x|%x%08x|%x%08x", canonical.c_str(),
+                info.dwVolumeSerialNumber,
+                info.nFileIndexHigh, info.nFileIndexLow,
+                info.ftLastWriteTime.dwHighDateTime, info.ftLastWriteTime.dwLowDateTime,
+                info.nFileSizeHigh, info.nFileSizeLow);
+        }
     };
 
 } // namespace
@@ -206,6 +254,18 @@ namespace
 namespace mango {
 namespace filesystem {
 
+    // -----------------------------------------------------------------
+    // advise()
+    // -----------------------------------------------------------------
+
+    void advise(Memory memory, u32 flags)
+    {
+        // Windows doesn't have hints for a range of a mapping; the SEQUENTIAL
+        // and RANDOM flags are applied when the file is opened
+        MANGO_UNREFERENCED_PARAMETER(memory);
+        MANGO_UNREFERENCED_PARAMETER(flags);
+    }
+
     // -----------------------------------------------------------------
     // Mapper::createFileMapper()
     // -----------------------------------------------------------------
@@ -547,18 +547,19 @@ namespace mango
         if (!encode)
             return;
 
-        ConcurrentQueue queue;
-
         u8* address = memory.address;
 
         const int xblocks = ceil_div(surface.width, width);
         const int yblocks = ceil_div(surface.height, height);
 
-        for (int y = 0; y < yblocks; ++y)
+        parallel_for(0, yblocks, 1, [this, xblocks, &surface, address] (int y0, int y1)
         {
-            queue.enqueue([this, y, xblocks, &surface, address]
+            const int stride = width * format.bytes();
+            u8* scratch = ThreadPool::getScratch().allocate<u8>(stride * height);
+            Surface temp(width, height, format, stride, scratch);
+
+            for (int y = y0; y < y1; ++y)
             {
-                Bitmap temp(width, height, format);
                 u8* data = address + y * xblocks * bytes;
 
                 for (int x = 0; x < xblocks; ++x)
@@ -570,10 +571,8 @@ namespace mango
                     encode(*this, data, image, temp.stride);
                     data += bytes;
                 }
-            });
-        }
-
-        queue.wait();
+            }
+        });
     }
 
 } // namespace mango
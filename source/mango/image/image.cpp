@@ -195,6 +195,16 @@ namespace mango
         return Memory();
     }
 
+    void ImageDecoderInterface::setCancellationToken(const CancellationToken& token)
+    {
+        m_token = token;
+    }
+
+    void ImageDecoderInterface::setAllocator(Allocator& allocator)
+    {
+        m_allocator = &allocator;
+    }
+
     // ----------------------------------------------------------------------------
     // ImageDecoder
     // ----------------------------------------------------------------------------
@@ -236,6 +246,16 @@ namespace mango
         m_interface->decode(dest, palette, level, depth, face);
     }
 
+    void ImageDecoder::setCancellationToken(const CancellationToken& token)
+    {
+        m_interface->setCancellationToken(token);
+    }
+
+    void ImageDecoder::setAllocator(Allocator& allocator)
+    {
+        m_interface->setAllocator(allocator);
+    }
+
     // ----------------------------------------------------------------------------
     // ImageEncoder
     // ----------------------------------------------------------------------------
@@ -1052,6 +1052,16 @@ namespace
         s.write32(0x000000ff);  // blue mask
         s.write32(0xff000000);  // alpha mask
 
+        u8* image = stream.acquire(imagesize);
+        if (image)
+        {
+            // convert directly into the output stream; the scanlines are stored bottom-up
+            Surface dest(width, height, format, -stride, image + (height - 1) * stride);
+            dest.blit(0, 0, surface);
+            stream.commit(imagesize);
+            return;
+        }
+
         Bitmap temp(width, height, format);
         temp.blit(0, 0, surface);
 
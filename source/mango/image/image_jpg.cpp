@@ -62,7 +62,8 @@ namespace
             MANGO_UNREFERENCED_PARAMETER(depth);
             MANGO_UNREFERENCED_PARAMETER(face);
 
-            jpeg::Status s = m_parser.decode(dest);
+            m_parser.setAllocator(*m_allocator);
+            jpeg::Status s = m_parser.decode(dest, m_token);
             MANGO_UNREFERENCED_PARAMETER(s);
         }
     };
@@ -52,11 +52,6 @@ using stbi__uint32 = u32;
 
 #define STBI_NOTUSED(v)  (void)(v)
 
-static void *stbi__malloc(size_t size)
-{
-    return STBI_MALLOC(size);
-}
-
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
 #define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
@@ -448,20 +443,15 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    return stbi__parse_zlib(a, parse_header);
 }
 
-STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
+STBIDEF int stbi_zlib_decode_buffer_headerflag(char *obuffer, int olen, const char *ibuffer, int ilen, int parse_header)
 {
    stbi__zbuf a;
-   char *p = (char *) stbi__malloc(initial_size);
-   if (p == NULL) return NULL;
-   a.zbuffer = (stbi_uc *) buffer;
-   a.zbuffer_end = (stbi_uc *) buffer + len;
-   if (stbi__do_zlib(&a, p, initial_size, 1, parse_header)) {
-      if (outlen) *outlen = (int) (a.zout - a.zout_start);
-      return a.zout_start;
-   } else {
-      STBI_FREE(a.zout_start);
-      return NULL;
-   }
+   a.zbuffer = (stbi_uc *) ibuffer;
+   a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
+   if (stbi__do_zlib(&a, obuffer, olen, 0, parse_header))
+      return (int) (a.zout - a.zout_start);
+   else
+      return -1;
 }
 
 #endif // DECODE_WITH_MINIZ
@@ -537,6 +527,10 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
         float2 blue;
     };
 
+    static MemoryTag g_png_inflate_tag("png.inflate");
+    static MemoryTag g_png_interlace_tag("png.interlace");
+    static MemoryTag g_png_convert_tag("png.convert");
+
     class ParserPNG
     {
     protected:
@@ -580,6 +574,8 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
         // sRGB
         u8 m_srgb_render_intent = -1;
 
+        Allocator* m_allocator { &Allocator::getDefault() };
+
         void setError(const char* error);
 
         void read_IHDR(BigEndianPointer p, u32 size);
@@ -618,6 +614,9 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
 
         ImageHeader header() const;
         const char* decode(Surface& dest, Palette* palette);
+
+        // the temporary buffers of decode() are allocated from the allocator
+        void setAllocator(Allocator& allocator);
     };
 
     // ------------------------------------------------------------
@@ -1597,18 +1596,21 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
     void ParserPNG::process(u8* image, int stride, u8* buffer, Palette* ptr_palette)
     {
         u8* temp = nullptr;
+        size_t temp_size = 0;
 
         if (m_interlace)
         {
             const int stride = FILTER_BYTE + m_bytes_per_line;
-            temp = new u8[m_height * stride];
+            temp_size = size_t(m_height) * stride;
+            temp = m_allocator->allocate<u8>(temp_size);
             if (!temp)
             {
                 setError("Memory allocation failed.");
                 return;
             }
 
-            std::memset(temp, 0, m_height * stride);
+            g_png_interlace_tag.allocate(temp_size);
+            std::memset(temp, 0, temp_size);
 
             // deinterlace does filter for each pass
             if (m_bit_depth < 8)
@@ -1627,7 +1629,11 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
 
         if (m_error)
         {
-            delete [] temp;
+            if (temp)
+            {
+                g_png_interlace_tag.deallocate(temp_size);
+                m_allocator->deallocate(temp, temp_size);
+            }
             return;
         }
 
@@ -1669,7 +1675,11 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
                 process_rgba16(image, stride, buffer);
         }
 
-        delete [] temp;
+        if (temp)
+        {
+            g_png_interlace_tag.deallocate(temp_size);
+            m_allocator->deallocate(temp, temp_size);
+        }
     }
 
     const char* ParserPNG::decode(Surface& dest, Palette* ptr_palette)
@@ -1703,13 +1713,15 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
 #ifdef DECODE_WITH_MINIZ
             // allocate output buffer
             debugPrint("  buffer bytes: %d\n", buffer_size);
-            u8* buffer = new u8[buffer_size];
+            u8* buffer = m_allocator->allocate<u8>(buffer_size);
             if (!buffer)
             {
                 setError("Memory allocation failed.");
                 return m_error;
             }
 
+            g_png_inflate_tag.allocate(buffer_size);
+
             // decompress stream
             mz_stream stream;
             int status;
@@ -1737,30 +1749,52 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
 
             // process image
             process(dest.image, dest.stride, buffer, ptr_palette);
-            delete[] buffer;
+
+            g_png_inflate_tag.deallocate(buffer_size);
+            m_allocator->deallocate(buffer, buffer_size);
 #else
+            // the size is known so decompress straight into a recycled buffer
+            u8* buffer = m_allocator->allocate<u8>(buffer_size);
+            if (!buffer)
+            {
+                setError("Memory allocation failed.");
+                return m_error;
+            }
+
+            g_png_inflate_tag.allocate(buffer_size);
+
             Memory mem = m_compressed;
-            int raw_len = buffer_size;
-            u8 *buffer = (u8*) stbi_zlib_decode_malloc_guesssize_headerflag(
+            int raw_len = stbi_zlib_decode_buffer_headerflag(
+                reinterpret_cast<char *>(buffer),
+                buffer_size,
                 reinterpret_cast<const char *>(mem.address),
                 int(mem.size),
-                raw_len,
-                &raw_len,
                 1);
-            if (buffer)
+            if (raw_len >= 0)
             {
                 debugPrint("  # total_out: %d \n", raw_len);
 
                 // process image
                 process(dest.image, dest.stride, buffer, ptr_palette);
-                STBI_FREE(buffer);
             }
+            else
+            {
+                setError("Incorrect compressed data.");
+            }
+
+            g_png_inflate_tag.deallocate(buffer_size);
+            m_allocator->deallocate(buffer, buffer_size);
 #endif
         }
 
         return m_error;
     }
 
+    void ParserPNG::setAllocator(Allocator& allocator)
+    {
+        m_allocator = &allocator;
+    }
+
     // ------------------------------------------------------------
     // writePNG()
     // ------------------------------------------------------------
@@ -1803,13 +1837,47 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
         z_stream z = { 0 };
         deflateInit(&z, -1);
 
-        z.avail_out = (unsigned int)deflateBound(&z, bytes);
-        Buffer buffer(4 + z.avail_out);
+        // compress directly into the output stream when it can provide the memory
+        Buffer buffer;
+        Stream* output = &stream;
+
+        // chunk: size + chunkID + compressed data + crc
+        const size_t bound = 4 + 4 + deflateBound(&z, bytes) + 4;
+        size_t capacity = std::min(bound, size_t(1024 * 1024));
 
-        BigEndianStream s(buffer);
-        s.write32(u32_mask_rev('I', 'D', 'A', 'T'));
+        u8* chunk = output->acquire(capacity);
+        if (!chunk)
+        {
+            output = &buffer;
+            chunk = output->acquire(capacity);
+        }
+
+        ustore32be(chunk + 4, u32_mask_rev('I', 'D', 'A', 'T'));
 
-        z.next_out = buffer + 4;
+        z.next_out = chunk + 8;
+        z.avail_out = (unsigned int)(capacity - 12);
+
+        auto compress = [&] (const u8* data, int size, int flush)
+        {
+            z.next_in = const_cast<u8*>(data);
+            z.avail_in = size;
+
+            for (;;)
+            {
+                int status = deflate(&z, flush);
+                if (z.avail_in == 0 && (flush != Z_FINISH || status == Z_STREAM_END))
+                {
+                    break;
+                }
+
+                // the output is full; acquire more memory (the address may change)
+                const size_t used = size_t(z.next_out - chunk);
+                capacity = std::min(bound, capacity * 2);
+                chunk = output->acquire(capacity);
+                z.next_out = chunk + used;
+                z.avail_out = (unsigned int)(capacity - 4 - used);
+            }
+        };
 
         for (int y = 0; y < surface.height; ++y)
         {
@@ -1817,23 +1885,26 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
 
             // compress filler byte
             u8 zero = 0;
-            z.avail_in = 1;
-            z.next_in = &zero;
-            deflate(&z, Z_NO_FLUSH);
+            compress(&zero, 1, Z_NO_FLUSH);
 
             // compress scanline
-            z.avail_in = bytesPerLine;
-            z.next_in = surface.address<u8>(0, y);
-            deflate(&z, last_scan ? Z_FINISH : Z_NO_FLUSH);
+            compress(surface.address<u8>(0, y), bytesPerLine, last_scan ? Z_FINISH : Z_NO_FLUSH);
         }
 
-        // compressed size includes chunkID
-        const size_t compressed_size = int(z.next_out - buffer);
+        const size_t compressed_size = size_t(z.next_out - (chunk + 8));
 
         deflateEnd(&z);
 
-        // write chunkdID + compressed data
-        writeChunk(stream, Memory(buffer, compressed_size));
+        // crc includes chunkID
+        ustore32be(chunk, u32(compressed_size));
+        ustore32be(chunk + 8 + compressed_size, crc32(0, Memory(chunk + 4, 4 + compressed_size)));
+
+        output->commit(4 + 4 + compressed_size + 4);
+
+        if (output == &buffer)
+        {
+            stream.write(buffer);
+        }
     }
 
     void writePNG(Stream& stream, const Surface& surface, u8 color_bits, ColorType color_type)
@@ -1895,6 +1966,8 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
 
             const char* error = nullptr;
 
+            m_parser.setAllocator(*m_allocator);
+
             if (dest.format == m_header.format &&
                 dest.width >= m_header.width &&
                 dest.height >= m_header.height &&
@@ -1913,9 +1986,17 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, i
                 else
                 {
                     // indirect
-                    Bitmap temp(m_header.width, m_header.height, m_header.format);
+                    const int stride = m_header.width * m_header.format.bytes();
+                    const size_t bytes = size_t(stride) * m_header.height;
+
+                    Surface temp(m_header.width, m_header.height, m_header.format, stride, m_allocator->allocate<u8>(bytes));
+                    g_png_convert_tag.allocate(bytes);
+
                     error = m_parser.decode(temp, nullptr);
                     dest.blit(0, 0, temp);
+
+                    g_png_convert_tag.deallocate(bytes);
+                    m_allocator->deallocate(temp.image, bytes);
                 }
             }
 
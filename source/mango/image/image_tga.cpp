@@ -442,9 +442,23 @@ namespace
         // write image
         if (format != surface.format)
         {
-            Bitmap temp(width, height, format);
-            temp.blit(0, 0, surface);
-            stream.write(temp.image, width * height * format.bytes());
+            const int stride = width * format.bytes();
+            const size_t bytes = size_t(stride) * height;
+
+            u8* image = stream.acquire(bytes);
+            if (image)
+            {
+                // convert directly into the output stream
+                Surface dest(width, height, format, stride, image);
+                dest.blit(0, 0, surface);
+                stream.commit(bytes);
+            }
+            else
+            {
+                Bitmap temp(width, height, format);
+                temp.blit(0, 0, surface);
+                stream.write(temp.image, bytes);
+            }
         }
         else
         {
@@ -12,6 +12,8 @@
 #include <mango/simd/simd.hpp>
 #include <mango/image/image.hpp>
 
+#define ID "[Surface] "
+
 namespace
 {
     using namespace mango;
@@ -172,6 +174,36 @@ namespace
         return size;
     }
 
+    // ----------------------------------------------------------------------------
+    // image memory
+    // ----------------------------------------------------------------------------
+
+    static MemoryTag g_bitmap_tag("image.bitmap");
+
+    // empty images are not allocated so that a non-zero size means large_malloc() memory
+    u8* allocate_image(const Surface& surface)
+    {
+        const size_t size = size_t(surface.stride) * surface.height;
+        if (!size)
+        {
+            return nullptr;
+        }
+
+        u8* image = reinterpret_cast<u8*>(large_malloc(size));
+        if (!image)
+        {
+            MANGO_EXCEPTION(ID"Memory allocation failed.");
+        }
+
+        g_bitmap_tag.allocate(size);
+        return image;
+    }
+
+    size_t get_image_size(const Surface& surface)
+    {
+        return surface.image ? size_t(surface.stride) * surface.height : 0;
+    }
+
     // ----------------------------------------------------------------------------
     // load_surface()
     // ----------------------------------------------------------------------------
@@ -190,7 +222,7 @@ namespace
             surface.height = header.height;
             surface.format = format ? *format : header.format;
             surface.stride = surface.width * surface.format.bytes();
-            surface.image  = new u8[surface.height * surface.stride];
+            surface.image  = allocate_image(surface);
 
             // decode
             decoder.decode(surface, nullptr, 0, 0, 0);
@@ -223,7 +255,7 @@ namespace
                 surface.height = header.height;
                 surface.format = Format(8, 0xff, 0);
                 surface.stride = surface.width;
-                surface.image  = new u8[surface.height * surface.stride];
+                surface.image  = allocate_image(surface);
 
                 // decode
                 decoder.decode(surface, &palette, 0, 0, 0);
@@ -298,8 +330,21 @@ namespace mango
         ImageEncoder encoder(filename);
         if (encoder.isEncoder())
         {
-            filesystem::FileStream file(filename, Stream::WRITE);
-            encoder.encode(file, *this, quality);
+            // the mapping pays off for the large images; the uncompressed size is
+            // the expected size of the file and the unused part is truncated away
+            const u64 estimate = u64(width) * u64(height) * u64(format.bytes());
+
+            if (estimate >= 4 * 1024 * 1024 && filesystem::MappedOutputFile::isMappable(filename))
+            {
+                filesystem::MappedOutputFile file(filename, estimate);
+                encoder.encode(file, *this, quality);
+                file.close();
+            }
+            else
+            {
+                filesystem::FileStream file(filename, Stream::WRITE);
+                encoder.encode(file, *this, quality);
+            }
         }
     }
 
@@ -404,58 +449,24 @@ namespace mango
         rect.width = dest.width;
         rect.height = dest.height;
 
-        ConcurrentQueue queue("blit", Priority::HIGH);
-
         Blitter blitter(dest.format, source.format);
 
-        const int threads = ThreadPool::getInstanceSize();
-        const int tasksize = (rect.width * rect.height) / threads;
-
-        const bool fast = dest.format == source.format;
-
         // don't use thread pool for:
         // - really small tasks
         // - when the pixel formats are identical ("fast mode")
-        const int N = (tasksize < 8192) || fast ? 1 : threads;
-        const int section = rect.height / N;
-
-        int ypos = 0;
+        const bool fast = dest.format == source.format;
+        const int grain = fast ? rect.height : std::max(1, 8192 / rect.width);
 
-        // queue conversion tasks
-        for (int i = 0; i < N; ++i)
+        parallel_for(0, rect.height, grain, [&] (int y0, int y1)
         {
-            const bool last = (i == (N - 1));
-            const int ycount = last ? rect.height - ypos : section;
-
-            if (N == 1)
-            {
-                // execute on main thread
-                BlitRect temp = rect;
-
-                temp.dest.address += ypos * rect.dest.stride;
-                temp.src.address += ypos * rect.src.stride;
-                temp.height = ycount;
-
-                blitter.convert(temp);
-            }
-            else
-            {
-                queue.enqueue([=, &blitter]
-                {
-                    BlitRect temp = rect;
-
-                    temp.dest.address += ypos * rect.dest.stride;
-                    temp.src.address += ypos * rect.src.stride;
-                    temp.height = ycount;
+            BlitRect temp = rect;
 
-                    blitter.convert(temp);
-                });
-            }
-
-            ypos += section;
-        }
+            temp.dest.address += y0 * rect.dest.stride;
+            temp.src.address += y0 * rect.src.stride;
+            temp.height = y1 - y0;
 
-        queue.wait();
+            blitter.convert(temp);
+        });
     }
 
     void Surface::xflip()
@@ -533,65 +544,99 @@ namespace mango
 
         if (!image)
         {
-            image = new u8[stride * height];
+            image = allocate_image(*this);
+            m_size = get_image_size(*this);
         }
     }
 
+    // the load_surface() functions allocate the image with allocate_image()
+
     Bitmap::Bitmap(Memory memory, const std::string& extension)
         : Surface(load_surface(memory, extension, nullptr))
     {
+        m_size = get_image_size(*this);
     }
 
     Bitmap::Bitmap(Memory memory, const std::string& extension, const Format& format)
         : Surface(load_surface(memory, extension, &format))
     {
+        m_size = get_image_size(*this);
     }
 
     Bitmap::Bitmap(const std::string& filename)
         : Surface(load_surface(filename, nullptr))
     {
+        m_size = get_image_size(*this);
     }
 
     Bitmap::Bitmap(const std::string& filename, const Format& format)
         : Surface(load_surface(filename, &format))
     {
+        m_size = get_image_size(*this);
     }
 
     Bitmap::Bitmap(Memory memory, const std::string& extension, Palette& palette)
         : Surface(load_palette_surface(memory, extension, palette))
     {
+        m_size = get_image_size(*this);
     }
 
     Bitmap::Bitmap(const std::string& filename, Palette& palette)
         : Surface(load_palette_surface(filename, palette))
     {
+        m_size = get_image_size(*this);
     }
 
     Bitmap::Bitmap(Bitmap&& bitmap)
         : Surface(bitmap)
+        , m_size(bitmap.m_size)
     {
         // move image ownership
         bitmap.image = nullptr;
+        bitmap.m_size = 0;
     }
 
     Bitmap::~Bitmap()
     {
-        delete[] image;
+        release();
     }
 
     Bitmap& Bitmap::operator = (Bitmap&& bitmap)
     {
-        // copy surface
-        format = bitmap.format;
-        image = bitmap.image;
-        stride = bitmap.stride;
-        width = bitmap.width;
-        height = bitmap.height;
-
-        // move image ownership
-        bitmap.image = nullptr;
+        if (this != &bitmap)
+        {
+            release();
+
+            // copy surface
+            format = bitmap.format;
+            image = bitmap.image;
+            stride = bitmap.stride;
+            width = bitmap.width;
+            height = bitmap.height;
+            m_size = bitmap.m_size;
+
+            // move image ownership
+            bitmap.image = nullptr;
+            bitmap.m_size = 0;
+        }
 
         return *this;
     }
 
+    void Bitmap::release()
+    {
+        if (m_size)
+        {
+            g_bitmap_tag.deallocate(m_size);
+            large_free(image, m_size);
+        }
+        else
+        {
+            delete[] image;
+        }
+
+        image = nullptr;
+        m_size = 0;
+    }
+
 } // namespace mango
@@ -22,6 +22,7 @@
 #define JPEG_AC_STAT_BINS        256 // ...
 #define JPEG_HUFF_LOOKUP_BITS    8   // Huffman look-ahead table log2 size
 #define JPEG_HUFF_LOOKUP_SIZE    (1 << JPEG_HUFF_LOOKUP_BITS)
+#define JPEG_MT_MCU_GRAIN        256 // Minimum # of MCUs worth processing in the ThreadPool
 
 #ifdef JPEG_ENABLE_SIMD
 
@@ -335,6 +336,8 @@ namespace jpeg {
 
         std::string m_info;
         Surface* m_surface;
+        CancellationToken m_token { nullptr };
+        Allocator* m_allocator { &Allocator::getDefault() };
         u64 cpu_flags;
 
         int width;  // Image width, does include alignment
@@ -406,7 +409,11 @@ namespace jpeg {
         Parser(Memory memory);
         ~Parser();
 
-        Status decode(Surface& target);
+        // the decoding stops between MCU rows when the token is cancelled
+        Status decode(Surface& target, const CancellationToken& token = CancellationToken(nullptr));
+
+        // the temporary buffers of decode() are allocated from the allocator
+        void setAllocator(Allocator& allocator);
     };
 
     // ----------------------------------------------------------------------------
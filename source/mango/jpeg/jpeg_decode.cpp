@@ -23,6 +23,9 @@ namespace jpeg {
         53, 60, 61, 54, 47, 55, 62, 63,
     };
 
+    static MemoryTag g_jpeg_blocks_tag("jpeg.blocks");
+    static MemoryTag g_jpeg_convert_tag("jpeg.convert");
+
     // ----------------------------------------------------------------------------
     // markers
     // ----------------------------------------------------------------------------
@@ -262,7 +265,11 @@ namespace jpeg {
 
     Parser::~Parser()
     {
-        aligned_free(blockVector);
+    }
+
+    void Parser::setAllocator(Allocator& allocator)
+    {
+        m_allocator = &allocator;
     }
 
     bool Parser::isJPEG(Memory memory) const
@@ -1178,6 +1185,11 @@ namespace jpeg {
                     if (decode)
                     {
                         p = processSOS(p, end);
+
+                        if (m_token.cancelled())
+                        {
+                            p = end; // terminate parsing
+                        }
                     }
                     break;
 
@@ -1451,13 +1463,14 @@ namespace jpeg {
         debugPrint("  Decoder: %s\n", id.c_str());
     }
 
-    Status Parser::decode(Surface& target)
+    Status Parser::decode(Surface& target, const CancellationToken& token)
     {
         Status status;
         status.success = true;
         status.enableDirectDecode = true;
 
         m_info = "";
+        m_token = token;
 
         if (!scan_memory.address)
         {
@@ -1465,9 +1478,12 @@ namespace jpeg {
             return status;
         }
 
+        Allocator& allocator = *m_allocator;
+
         // allocate blocks
-        int count = mcus * blocks_in_mcu * 64;
-        blockVector = reinterpret_cast<s16*>(aligned_malloc(count * sizeof(s16)));
+        const size_t count = size_t(mcus) * blocks_in_mcu * 64;
+        blockVector = allocator.allocate<s16>(count);
+        g_jpeg_blocks_tag.allocate(count * sizeof(s16));
 
         // find best matching format
         SampleFormat sf = getSampleFormat(target.format);
@@ -1513,24 +1529,44 @@ namespace jpeg {
 
             parse(scan_memory, true);
 
-            if (is_progressive)
+            if (is_progressive && !m_token.cancelled())
 			{
 	            finishProgressive();
 			}
         }
         else
         {
-            Bitmap temp(width, height, header.format);
+            const int stride = width * header.format.bytes();
+            const size_t bytes = size_t(stride) * height;
+
+            Surface temp(width, height, header.format, stride, allocator.allocate<u8>(bytes));
+            g_jpeg_convert_tag.allocate(bytes);
             m_surface = &temp;
 
             parse(scan_memory, true);
 
-            if (is_progressive)
+            if (is_progressive && !m_token.cancelled())
 			{
 	            finishProgressive();
 			}
 
-            target.blit(0, 0, temp);
+            if (!m_token.cancelled())
+            {
+                target.blit(0, 0, temp);
+            }
+
+            g_jpeg_convert_tag.deallocate(bytes);
+            allocator.deallocate(temp.image, bytes);
+        }
+
+        g_jpeg_blocks_tag.deallocate(count * sizeof(s16));
+        allocator.deallocate(blockVector, count);
+        blockVector = nullptr;
+
+        if (m_token.cancelled())
+        {
+            status.success = false;
+            m_info += "Decoding was cancelled.";
         }
 
         status.info = m_info;
@@ -1648,7 +1684,8 @@ namespace jpeg {
 #else
         const int count = 1;
 #endif
-        if (count > 1)
+        // small images are not worth the ThreadPool overhead
+        if (count > 1 && mcus > JPEG_MT_MCU_GRAIN)
         {
             decodeSequentialMT();
         }
@@ -1669,6 +1706,9 @@ namespace jpeg {
 
         for (int y = 0; y < ymcu; ++y)
         {
+            if (m_token.cancelled())
+                break;
+
             u8* dest = image;
 
             ProcessFunc process = processState.process;
@@ -1709,19 +1749,24 @@ namespace jpeg {
 
         ConcurrentQueue queue("jpeg.sequential", Priority::HIGH);
 
+        // the tasks which have not started are dropped when the decoding is cancelled
+        queue.setCancellationToken(m_token);
+
         if (!restartInterval)
         {
             s16* data = blockVector;
             const int mcu_data_size = blocks_in_mcu * 64;
 
-            const int pool_size = ThreadPool::getInstanceSize();
-
-            const int S = pool_size > 1 ? 4 * pool_size : 1;
-            const int N = std::max(ymcu / S, pool_size);
+            // the entropy decoding is serial; hand the decoded strips to the ThreadPool
+            // as soon as they have enough work to be worth a task
+            const int N = std::max(1, JPEG_MT_MCU_GRAIN / xmcu);
 
             // use threadpool to process blocks
             for (int y = 0; y < ymcu; y += N)
             {
+                if (m_token.cancelled())
+                    break;
+
                 const int y0 = y;
                 const int y1 = std::min(y + N, ymcu);
                 const int count = (y1 - y0) * xmcu;
@@ -1772,11 +1817,11 @@ namespace jpeg {
         {
             u8* p = decodeState.buffer.ptr;
 
-            for (int i = 0; i < mcus; i += restartInterval)
+            for (int i = 0; i < mcus && !m_token.cancelled(); i += restartInterval)
             {
                 // enqueue task
                 queue.enqueue([=] {
-                    s16 data[640]; // TODO: alignment
+                    s16* data = ThreadPool::getScratch().allocate<s16>(640);
                     DecodeState state = decodeState;
                     state.buffer.ptr = p;
 
@@ -1872,6 +1917,9 @@ namespace jpeg {
 
         for (int y = 0; y < ys; ++y)
         {
+            if (m_token.cancelled())
+                break;
+
             int mcu_yoffset = (y >> vsf) * xmcu;
             int block_yoffset = ((y & VMask) << hsf) + scan_offset;
 
@@ -1895,7 +1943,7 @@ namespace jpeg {
 #else
         const int count = 1;
 #endif
-        if (count > 1)
+        if (count > 1 && mcus > JPEG_MT_MCU_GRAIN)
         {
             finishProgressiveMT();
         }
@@ -1917,6 +1965,9 @@ namespace jpeg {
 
         for (int y = 0; y < ymcu; ++y)
         {
+            if (m_token.cancelled())
+                break;
+
             u8* dest = image + y * ystride;
 
             ProcessFunc process = processState.process;
@@ -1954,54 +2005,44 @@ namespace jpeg {
         const int mcu_data_size = blocks_in_mcu * 64;
         s16* data = blockVector;
 
-        ConcurrentQueue queue("jpeg.progressive", Priority::HIGH);
-        const int pool_size = ThreadPool::getInstanceSize();
+        // process in chunks of at least JPEG_MT_MCU_GRAIN MCUs
+        const int grain = std::max(1, JPEG_MT_MCU_GRAIN / xmcu);
 
-        const int S = pool_size > 1 ? 4 * pool_size : 1;
-        const int N = std::max(ymcu / S, pool_size);
+        parallel_for(0, ymcu, grain, [=] (int y0, int y1) {
+            if (m_token.cancelled())
+                return;
 
-        // use threadpool to process blocks
-        for (int y = 0; y < ymcu; y += N)
-        {
-            const int y0 = y;
-            const int y1 = std::min(y + N, ymcu);
-            debugPrint("  Process: [%d, %d] --> ThreadPool.\n", y0, y1 - 1);
+            debugPrint("  Process: [%d, %d]\n", y0, y1 - 1);
 
-            // enqueue task
-            queue.enqueue([=] {
-                for (int y = y0; y < y1; ++y)
-                {
-                    u8* dest = image + y * ystride;
-                    s16* source = data + y * xmcu * mcu_data_size;
+            for (int y = y0; y < y1; ++y)
+            {
+                u8* dest = image + y * ystride;
+                s16* source = data + y * xmcu * mcu_data_size;
 
-                    ProcessFunc process = processState.process;
-                    int width = xblock;
-                    int height = yblock;
+                ProcessFunc process = processState.process;
+                int width = xblock;
+                int height = yblock;
 
-                    if (yclip && y == ymcu - 1)
+                if (yclip && y == ymcu - 1)
+                {
+                    process = processState.clipped;
+                    height = yclip;
+                }
+
+                for (int x = 0; x < xmcu; ++x)
+                {
+                    if (xclip && x == xmcu - 1)
                     {
                         process = processState.clipped;
-                        height = yclip;
+                        width = xclip;
                     }
 
-                    for (int x = 0; x < xmcu; ++x)
-                    {
-                        if (xclip && x == xmcu - 1)
-                        {
-                            process = processState.clipped;
-                            width = xclip;
-                        }
-
-                        process(dest, stride, source, &processState, width, height);
-                        source += mcu_data_size;
-                        dest += xstride;
-                    }
+                    process(dest, stride, source, &processState, width, height);
+                    source += mcu_data_size;
+                    dest += xstride;
                 }
-            });
-        }
-
-        // synchronize
-        queue.wait();
+            }
+        });
     }
 
 } // namespace jpeg
@@ -1248,8 +1248,10 @@ namespace
 
         ConcurrentQueue queue;
 
+        const size_t stride = surface.stride;
+
         // encode MCUs
-        for (int y = 0; y < jp.vertical_mcus; ++y)
+        queue.enqueue_n(jp.vertical_mcus, [&jp, buffers, input, stride] (int y)
         {
             int rows;
 
@@ -1264,67 +1266,62 @@ namespace
                 rows = jp.rows_in_bottom_mcus;
             }
 
-            queue.enqueue([&jp, y, buffers, input, rows]
-            {
-                u8* image = input;
-
-                HuffmanEncoder huffman;
+            u8* image = input + y * jp.mcu_height * stride;
 
-                constexpr int buffer_size = 2048;
-                constexpr int flush_threshold = buffer_size - 512;
+            HuffmanEncoder huffman;
 
-                u8 huff_temp[buffer_size]; // encoding buffer
-                u8* ptr = huff_temp;
+            constexpr int buffer_size = 2048;
+            constexpr int flush_threshold = buffer_size - 512;
 
-                const int right_mcu = jp.horizontal_mcus - 1;
+            u8 huff_temp[buffer_size]; // encoding buffer
+            u8* ptr = huff_temp;
 
-                for (int x = 0; x < jp.horizontal_mcus; ++x)
-                {
-                    int cols;
-                    int incr;
-
-                    if (x < right_mcu)
-                    {
-                        cols = jp.mcu_width;
-                        incr = jp.length_minus_mcu_width;
-                    }
-                    else
-                    {
-                        // clipping
-                        cols = jp.cols_in_right_mcus;
-                        incr = jp.length_minus_width;
-                    }
+            const int right_mcu = jp.horizontal_mcus - 1;
 
-                    s16 block[BLOCK_SIZE * 3];
+            for (int x = 0; x < jp.horizontal_mcus; ++x)
+            {
+                int cols;
+                int incr;
 
-                    // read MCU data
-                    jp.read_format(&jp, block, image, rows, cols, incr);
+                if (x < right_mcu)
+                {
+                    cols = jp.mcu_width;
+                    incr = jp.length_minus_mcu_width;
+                }
+                else
+                {
+                    // clipping
+                    cols = jp.cols_in_right_mcus;
+                    incr = jp.length_minus_width;
+                }
 
-                    // encode the data in MCU
-                    for (int i = 0; i < jp.channel_count; ++i)
-                    {
-                        s16 temp[BLOCK_SIZE];
-                        fdct(temp, block + i * BLOCK_SIZE, jp.channel[i].qtable);
-                        ptr = huffman.encode(ptr, jp.channel[i].component, temp);
-                    }
+                s16 block[BLOCK_SIZE * 3];
 
-                    // flush encoding buffer
-                    if (ptr - huff_temp > flush_threshold)
-                    {
-                        buffers[y].write(huff_temp, ptr - huff_temp);
-                        ptr = huff_temp;
-                    }
+                // read MCU data
+                jp.read_format(&jp, block, image, rows, cols, incr);
 
-                    image += jp.mcu_width_size;
+                // encode the data in MCU
+                for (int i = 0; i < jp.channel_count; ++i)
+                {
+                    s16 temp[BLOCK_SIZE];
+                    fdct(temp, block + i * BLOCK_SIZE, jp.channel[i].qtable);
+                    ptr = huffman.encode(ptr, jp.channel[i].component, temp);
                 }
 
                 // flush encoding buffer
-                ptr = huffman.flush(ptr);
-                buffers[y].write(huff_temp, ptr - huff_temp);
-            });
+                if (ptr - huff_temp > flush_threshold)
+                {
+                    buffers[y].write(huff_temp, ptr - huff_temp);
+                    ptr = huff_temp;
+                }
 
-            input += surface.stride * jp.mcu_height;
-        }
+                image += jp.mcu_width_size;
+            }
+
+            // flush encoding buffer
+            ptr = huffman.flush(ptr);
+            buffers[y].write(huff_temp, ptr - huff_temp);
+        });
 
         queue.wait();
 
@@ -1333,18 +1330,31 @@ namespace
         // writing marker data
         jp.write_markers(s, sample, surface.width, surface.height);
 
+        // the restart markers are stored big endian (0xff, 0xd0 + index)
+        static const u8 markers[] =
+        {
+            0xff, 0xd0, 0xff, 0xd1, 0xff, 0xd2, 0xff, 0xd3,
+            0xff, 0xd4, 0xff, 0xd5, 0xff, 0xd6, 0xff, 0xd7,
+        };
+
+        // gather the huffman bitstreams and restart markers so that they are
+        // written with a single call instead of two writes per MCU row
+        BufferChain chain;
+
         for (int y = 0; y < jp.vertical_mcus; ++y)
         {
             Buffer& buffer = buffers[y];
 
-            // write huffman bitstream
-            s.write(buffer, size_t(buffer.size()));
+            // huffman bitstream
+            chain.append(buffer);
 
-            // write restart marker
+            // restart marker
             int index = y & 7;
-            s.write16(0xffd0 + index);
+            chain.append(Memory(const_cast<u8*>(markers + index * 2), 2));
         }
 
+        chain.writeTo(stream);
+
         delete[] buffers;
 
         // EOI marker